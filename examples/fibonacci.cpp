@@ -1,4 +1,3 @@
-// NOTE: This example uses features that haven't yet been implemented
 #include <iostream>
 #include "jitbox.h"
 
@@ -13,14 +12,14 @@ int main()
     //   return fib(x-1)+fib(x-2);
     // }
 
-    jitbox::Module module = jitbox::Module("fib_test");
+    jitbox::Module module("fib_test");
 
     jitbox::ValueType int_type = jitbox::ValueType::i32;
     jitbox::Function* func = module.new_function("fibonacci", int_type);
     jitbox::Value* x = func->new_param("x", jitbox::ValueType::i32);
 
-    const jitbox::Value* one = func->new_constant(int_type, 1);
-    const jitbox::Value* two = func->new_constant(int_type, 2);
+    jitbox::Value* one = func->new_constant(int_type, 1);
+    jitbox::Value* two = func->new_constant(int_type, 2);
 
     func->begin_block("entry");
         // !(x <= 2) ?
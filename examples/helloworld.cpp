@@ -16,7 +16,7 @@ int main()
     //   print(str);
     // }
 
-    jitbox::Module module = jitbox::Module("helloworld");
+    jitbox::Module module("helloworld");
 
     // module.set_option(jitbox::JitOption::DUMP_ASM, true);
 
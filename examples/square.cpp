@@ -11,7 +11,7 @@ int main()
     //   return i * i;
     // }
 
-    jitbox::Module module = jitbox::Module("square_test");
+    jitbox::Module module("square_test");
 
     // module.set_option(jitbox::JitOption::DUMP_ASM, true);
 
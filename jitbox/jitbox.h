@@ -4,3 +4,4 @@
 #include <assert.h>
 
 #include "src/module.h"
+#include "src/exprcompiler.h"
@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "coretypes.h"
+#include "function.h"
+
+namespace jitbox
+{
+
+// compiled Module::new_batch_kernel: for rows begin <= i < end,
+//  output[i] = element(columns[0][i], columns[1][i], ...), with columns and
+//  output arrays of the element function's param and return types
+typedef void (*BatchKernel)(const void* const* columns, void* output, u64 begin, u64 end);
+
+// run a compiled batch kernel function over rows begin <= i < end with
+//  either backend: through its code, or Function::run() when it has none
+//  (see JitOption::INTERPRET)
+inline void run_batch_kernel(Function* kernel, const void* const* columns, void* output,
+                             u64 begin, u64 end)
+{
+    if( void* code = kernel->get() )
+    {
+        ((BatchKernel)code)(columns, output, begin, end);
+        return;
+    }
+    const u64 args[] = { (u64)columns, (u64)output, begin, end };
+    kernel->run(args);
+}
+
+// Runs batch kernels over many rows on a pool of worker threads. Rows are
+//  split into chunks that fit in cache, handed out to the workers in
+//  contiguous runs; a worker that runs out of chunks steals from the end of
+//  another's run. The calling thread works along and run() returns once all
+//  rows are done.
+class BatchRunner
+{
+public:
+    // `threads` includes the calling thread. chunks read and write about
+    //  `chunk_bytes`, by default sized for L2.
+    BatchRunner(size_t threads = std::thread::hardware_concurrency(),
+                size_t chunk_bytes = 256*1024)
+        : m_chunk_bytes(chunk_bytes), m_generation(0), m_pending(0), m_stop(false)
+    {
+        threads = std::max<size_t>(threads, 1);
+        for( size_t i = 0; i < threads; ++i )
+        {
+            m_queues.emplace_back(new WorkQueue());
+        }
+        for( size_t i = 1; i < threads; ++i )
+        {
+            m_workers.emplace_back(&BatchRunner::worker, this, i);
+        }
+    }
+
+    ~BatchRunner()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for( auto &thread : m_workers )
+        {
+            thread.join();
+        }
+    }
+
+    // run `kernel` over `rows` rows. `row_bytes` is the size of one row of
+    //  all columns and the output together, for sizing chunks.
+    void run(BatchKernel kernel, const void* const* columns, void* output, u64 rows,
+             size_t row_bytes)
+    {
+        run_chunks(kernel, nullptr, columns, output, rows, row_bytes);
+    }
+
+    // as above, for a compiled batch kernel function with either backend
+    //  (see run_batch_kernel())
+    void run(Function* kernel, const void* const* columns, void* output, u64 rows,
+             size_t row_bytes)
+    {
+        run_chunks((BatchKernel)kernel->get(), kernel, columns, output, rows, row_bytes);
+    }
+
+    // threads running kernels, including the caller of run()
+    size_t get_thread_count()
+    {
+        return m_queues.size();
+    }
+
+private:
+    struct Chunk
+    {
+        // null to run `function` with run_batch_kernel()
+        BatchKernel kernel;
+        Function* function;
+        const void* const* columns;
+        void* output;
+        u64 begin;
+        u64 end;
+
+        void run()
+        {
+            if( kernel )
+            {
+                kernel(columns, output, begin, end);
+            }
+            else
+            {
+                run_batch_kernel(function, columns, output, begin, end);
+            }
+        }
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    void run_chunks(BatchKernel kernel, Function* function, const void* const* columns,
+                    void* output, u64 rows, size_t row_bytes)
+    {
+        u64 chunk_rows = std::max<u64>(m_chunk_bytes / std::max<size_t>(row_bytes, 1), 1);
+        u64 chunks = (rows + chunk_rows - 1) / chunk_rows;
+        if( chunks <= 1 || m_workers.empty() )
+        {
+            Chunk chunk = { kernel, function, columns, output, 0, rows };
+            chunk.run();
+            return;
+        }
+
+        // one batch at a time
+        std::lock_guard<std::mutex> run_lock(m_run_mutex);
+        size_t threads = m_queues.size();
+        m_pending = chunks;
+        for( size_t t = 0; t < threads; ++t )
+        {
+            WorkQueue &queue = *m_queues[t];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for( u64 c = chunks * t / threads; c < chunks * (t + 1) / threads; ++c )
+            {
+                Chunk chunk;
+                chunk.kernel = kernel;
+                chunk.function = function;
+                chunk.columns = columns;
+                chunk.output = output;
+                chunk.begin = c * chunk_rows;
+                chunk.end = std::min(rows, (c + 1) * chunk_rows);
+                queue.chunks.push_back(chunk);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_generation;
+        }
+        m_wake.notify_all();
+
+        work(0);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_pending == 0; });
+    }
+
+    void worker(size_t index)
+    {
+        u64 generation = 0;
+        for( ;; )
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+                if( m_stop )
+                {
+                    return;
+                }
+                generation = m_generation;
+            }
+            work(index);
+        }
+    }
+
+    // run chunks until there are none left: own ones front to back, then
+    //  stolen ones from the back of the others' queues
+    void work(size_t index)
+    {
+        Chunk chunk;
+        while( take(index, chunk) )
+        {
+            chunk.run();
+            if( --m_pending == 0 )
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.notify_all();
+            }
+        }
+    }
+
+    bool take(size_t index, Chunk &chunk)
+    {
+        {
+            WorkQueue &own = *m_queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if( !own.chunks.empty() )
+            {
+                chunk = own.chunks.front();
+                own.chunks.pop_front();
+                return true;
+            }
+        }
+
+        for( size_t i = 1; i < m_queues.size(); ++i )
+        {
+            WorkQueue &victim = *m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if( !victim.chunks.empty() )
+            {
+                chunk = victim.chunks.back();
+                victim.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t m_chunk_bytes;
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_run_mutex;
+    // guards m_generation and m_stop, and the condition variables
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    u64 m_generation;
+    std::atomic<u64> m_pending;
+    bool m_stop;
+};
+
+} // namespace jitbox
@@ -0,0 +1,786 @@
+#pragma once
+#include <map>
+#include <limits>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <string.h>
+
+#include "codegen.h"
+#include "x64codegen.h"
+
+namespace jitbox
+{
+
+// the interpreter dispatches through the address of each op's code (GNU
+//  computed goto) where the compiler has it, and through a switch otherwise
+#ifndef JITBOX_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define JITBOX_THREADED_DISPATCH 1
+#else
+#define JITBOX_THREADED_DISPATCH 0
+#endif
+#endif
+
+// ops of the bytecode. operations on integers come in a 32 bit form, used
+//  for types narrower than 64 bits as in native code, and a 64 bit one, and
+//  those that take immediates in native code have an `Imm` form reading the
+//  right operand from the instruction. BytecodeGenerator relies on each
+//  group being laid out as 32, 32Imm, 64, 64Imm.
+#define JITBOX_BYTECODE_BINARY(OP, name) \
+    OP(name##32) OP(name##32Imm) OP(name##64) OP(name##64Imm)
+
+#define JITBOX_BYTECODE_OPS(OP) \
+    OP(Mov) OP(MovImm) OP(Spill) OP(Reload) \
+    JITBOX_BYTECODE_BINARY(OP, Add) JITBOX_BYTECODE_BINARY(OP, Sub) \
+    JITBOX_BYTECODE_BINARY(OP, Mul) JITBOX_BYTECODE_BINARY(OP, And) \
+    JITBOX_BYTECODE_BINARY(OP, Or) JITBOX_BYTECODE_BINARY(OP, Xor) \
+    JITBOX_BYTECODE_BINARY(OP, Shl) JITBOX_BYTECODE_BINARY(OP, Shr) \
+    JITBOX_BYTECODE_BINARY(OP, Sar) \
+    JITBOX_BYTECODE_BINARY(OP, Eq) JITBOX_BYTECODE_BINARY(OP, Ne) \
+    JITBOX_BYTECODE_BINARY(OP, LtS) JITBOX_BYTECODE_BINARY(OP, LeS) \
+    JITBOX_BYTECODE_BINARY(OP, GtS) JITBOX_BYTECODE_BINARY(OP, GeS) \
+    JITBOX_BYTECODE_BINARY(OP, LtU) JITBOX_BYTECODE_BINARY(OP, LeU) \
+    JITBOX_BYTECODE_BINARY(OP, GtU) JITBOX_BYTECODE_BINARY(OP, GeU) \
+    OP(AndNot32) OP(AndNot64) \
+    OP(DivS32) OP(DivU32) OP(DivS64) OP(DivU64) \
+    OP(Not32) OP(Not64) OP(Popcnt32) OP(Popcnt64) \
+    OP(Tzcnt32) OP(Tzcnt64) OP(Lzcnt32) OP(Lzcnt64) \
+    OP(Load8S) OP(Load8U) OP(Load16S) OP(Load16U) OP(Load32) OP(Load64) \
+    OP(Store8) OP(Store16) OP(Store32) OP(Store64) \
+    OP(Jump) OP(JumpIfZero32) OP(JumpIfZero64) OP(JumpIfNotZero32) OP(JumpIfNotZero64) \
+    OP(Arg) OP(ArgImm) OP(CallSelf) OP(CallFunction) OP(CallNative) \
+    OP(Ret) OP(RetVoid) OP(Count)
+
+#define JITBOX_BYTECODE_ENUM(name) name,
+#define JITBOX_BYTECODE_NAME(name) #name,
+#if JITBOX_THREADED_DISPATCH
+#define JITBOX_BYTECODE_LABEL(name) &&op_##name,
+#endif
+
+enum class BytecodeOp : u16
+{
+    JITBOX_BYTECODE_OPS(JITBOX_BYTECODE_ENUM)
+};
+
+struct BytecodeInstr
+{
+    BytecodeInstr(BytecodeOp op, u8 dest = 0, u8 lhs = 0, u8 rhs = 0)
+        : handler(nullptr), op(op), dest(dest), lhs(lhs), rhs(rhs), imm(0)
+    {
+    }
+
+    // address of the op's code in the interpreter, set by finalize() with
+    //  JITBOX_THREADED_DISPATCH
+    const void* handler;
+    BytecodeOp op;
+    // registers, or the argument slot for Arg
+    u8 dest;
+    u8 lhs;
+    u8 rhs;
+    union
+    {
+        // immediate operand, index of the jump target or spill slot
+        i64 imm;
+        // native function, callee's generator or block counter
+        void* address;
+    };
+};
+
+// Emits register bytecode instead of machine code, run by a threaded
+//  interpreter (see JitOption::INTERPRET). Nothing is placed in the code
+//  heap, so functions are cheap to build and throw away, e.g. for one-shot
+//  queries.
+// The interpreter models the x64 register file, and the bytecode is lowered
+//  from the same register allocation as native code, so both backends
+//  behave the same down to the bits of narrow values. that makes it an
+//  oracle for testing X64CodeGenerator: build the same function in an
+//  interpreted and a native module and compare Function::run().
+class BytecodeGenerator : public CodeGenerator
+{
+public:
+    BytecodeGenerator(CodeHeap* heap, bool dump_asm)
+        : CodeGenerator(heap, dump_asm), m_spill_slots(0), m_finalized(false)
+    {
+        for( auto reg : X64CodeGenerator::registers() )
+        {
+            if( reg.flags & RegisterFlag::Parameter )
+            {
+                m_param_registers.push_back((u8)reg.idx);
+            }
+        }
+        m_storage_alloc.set_registers(X64CodeGenerator::registers());
+    }
+
+    bool finalize()
+    {
+        if( m_finalized )
+        {
+            return true;
+        }
+
+        for( auto &jump : m_jumps )
+        {
+            auto it = m_labels.find(jump.second);
+            assert(it != m_labels.end() && "Unknown block label");
+            m_program[jump.first].imm = (i64)it->second;
+        }
+        // a function without code returns, so there is always an
+        //  instruction to dispatch to
+        if( m_program.empty() )
+        {
+            emit(BytecodeInstr(BytecodeOp::RetVoid));
+        }
+
+#if JITBOX_THREADED_DISPATCH
+        // direct threading: each instruction holds the address of its
+        //  handler, so dispatch is a single indirect jump
+        const void* const* handlers = nullptr;
+        interpret(nullptr, &handlers);
+        for( auto &instr : m_program )
+        {
+            instr.handler = handlers[(int)instr.op];
+        }
+#endif
+        m_finalized = true;
+        return true;
+    }
+
+    size_t begin_block(std::string label, u32 flags)
+    {
+        // before the block counter the base class emits
+        m_labels[label] = m_program.size();
+        return CodeGenerator::begin_block(label, flags);
+    }
+
+    bool is_interpreted()
+    {
+        return true;
+    }
+
+    u64 run(const u64* args)
+    {
+        assert(m_finalized && "Function isn't compiled");
+        return interpret(args);
+    }
+
+    void mov(Register dest, Register src)
+    {
+        if( dest.idx == src.idx )
+        {
+            return;
+        }
+
+        if(m_dump_asm)
+            std::cout << "  Mov " << reg2str(dest.idx) << ", " << reg2str(src.idx) << std::endl;
+
+        emit(BytecodeInstr(BytecodeOp::Mov, (u8)dest.idx, (u8)src.idx));
+    }
+
+    void mov(Register reg, void* address)
+    {
+        mov(reg, (i64)(size_t)address);
+    }
+
+    void mov(Register reg, i64 value)
+    {
+        if(m_dump_asm)
+            std::cout << "  MovImm " << reg2str(reg.idx) << ", " << value << std::endl;
+
+        BytecodeInstr instr(BytecodeOp::MovImm, (u8)reg.idx);
+        instr.imm = value;
+        emit(instr);
+    }
+
+    void call(void* address)
+    {
+        call(BytecodeOp::CallNative, address);
+    }
+
+    void call_entry()
+    {
+        call(BytecodeOp::CallSelf, nullptr);
+    }
+
+    // interpreted code calls other functions with call_function() whether
+    //  they are compiled yet or not, so never through an entry slot
+    void call_indirect(void** /*slot*/)
+    {
+        assert(false && "Interpreted code calls functions with call_function()");
+    }
+
+    void call_function(CodeGenerator* callee)
+    {
+        assert(callee->is_interpreted() && "Interpreted code can only call interpreted functions");
+        call(BytecodeOp::CallFunction, static_cast<BytecodeGenerator*>(callee));
+    }
+
+    // arguments of function calls go into slots of their own, so unlike in
+    //  native code no argument register gets overwritten while still read
+    void set_arguments(const std::vector<Value*> &args)
+    {
+        assert(args.size() <= ARG_COUNT && "Stack passed arguments not supported");
+        for( size_t i = 0; i < args.size(); ++i )
+        {
+            if( is_immediate(args[i]) )
+            {
+                if(m_dump_asm)
+                    std::cout << "  ArgImm " << i << ", " << args[i]->get_constant() << std::endl;
+
+                BytecodeInstr instr(BytecodeOp::ArgImm, (u8)i);
+                instr.imm = args[i]->get_constant();
+                emit(instr);
+            }
+            else
+            {
+                if(m_dump_asm)
+                    std::cout << "  Arg " << i << ", " << operand2str(args[i]) << std::endl;
+
+                emit(BytecodeInstr(BytecodeOp::Arg, (u8)i, reg(args[i])));
+            }
+        }
+    }
+
+    void get_result(Value* dest)
+    {
+        mov(dest->get_register(), Register(RETURN_REGISTER, RegisterFlag::Return));
+    }
+
+    // every call gets a register file (and spill slots) of its own, so
+    //  nothing has to be saved or restored
+    void prologue(const std::vector<Register> &/*preserved*/, bool /*makes_calls*/,
+                  size_t spill_slots)
+    {
+        m_spill_slots = spill_slots;
+    }
+
+    void save_registers(const std::vector<Register> &/*registers*/)
+    {
+    }
+
+    void restore_registers(const std::vector<Register> &/*registers*/)
+    {
+    }
+
+    void add(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Add32, dest, lhs, rhs);
+    }
+
+    void sub(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Sub32, dest, lhs, rhs);
+    }
+
+    void imul(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Mul32, dest, lhs, rhs);
+    }
+
+    // signed or unsigned division, going by the value type
+    void idiv(Value* dest, Value* lhs, Value* rhs)
+    {
+        BytecodeOp op = is_signed(lhs->value_type)
+                      ? (is_wide(lhs->value_type) ? BytecodeOp::DivS64 : BytecodeOp::DivS32)
+                      : (is_wide(lhs->value_type) ? BytecodeOp::DivU64 : BytecodeOp::DivU32);
+        emit_registers(op, dest, lhs, rhs);
+    }
+
+    void bit_and(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::And32, dest, lhs, rhs);
+    }
+
+    void bit_or(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Or32, dest, lhs, rhs);
+    }
+
+    void bit_xor(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Xor32, dest, lhs, rhs);
+    }
+
+    void bit_not(Value* dest, Value* value)
+    {
+        unary(BytecodeOp::Not32, dest, value);
+    }
+
+    // lhs & ~rhs
+    void andn(Value* dest, Value* lhs, Value* rhs)
+    {
+        BytecodeOp op = is_wide(lhs->value_type) ? BytecodeOp::AndNot64 : BytecodeOp::AndNot32;
+        emit_registers(op, dest, lhs, rhs);
+    }
+
+    void shl(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Shl32, dest, lhs, rhs);
+    }
+
+    void shr(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Shr32, dest, lhs, rhs);
+    }
+
+    void sar(Value* dest, Value* lhs, Value* rhs)
+    {
+        binary(BytecodeOp::Sar32, dest, lhs, rhs);
+    }
+
+    void popcnt(Value* dest, Value* value)
+    {
+        unary(BytecodeOp::Popcnt32, dest, value);
+    }
+
+    void tzcnt(Value* dest, Value* value)
+    {
+        unary(BytecodeOp::Tzcnt32, dest, value);
+    }
+
+    void lzcnt(Value* dest, Value* value)
+    {
+        unary(BytecodeOp::Lzcnt32, dest, value);
+    }
+
+    void cmp(Condition cond, Value* dest, Value* lhs, Value* rhs)
+    {
+        bool is_signed_cmp = is_signed(lhs->value_type);
+        BytecodeOp op = BytecodeOp::Eq32;
+        switch( cond )
+        {
+            case Condition::Equal:        op = BytecodeOp::Eq32; break;
+            case Condition::NotEqual:     op = BytecodeOp::Ne32; break;
+            case Condition::Less:         op = is_signed_cmp ? BytecodeOp::LtS32 : BytecodeOp::LtU32; break;
+            case Condition::LessEqual:    op = is_signed_cmp ? BytecodeOp::LeS32 : BytecodeOp::LeU32; break;
+            case Condition::Greater:      op = is_signed_cmp ? BytecodeOp::GtS32 : BytecodeOp::GtU32; break;
+            case Condition::GreaterEqual: op = is_signed_cmp ? BytecodeOp::GeS32 : BytecodeOp::GeU32; break;
+        }
+        binary(op, dest, lhs, rhs);
+    }
+
+    // narrow values are zero or sign extended into the low 32 bits
+    void load(Value* dest, Value* address)
+    {
+        BytecodeOp op = BytecodeOp::Load64;
+        switch( dest->value_type )
+        {
+            case ValueType::i8:  op = BytecodeOp::Load8S; break;
+            case ValueType::u8:  op = BytecodeOp::Load8U; break;
+            case ValueType::i16: op = BytecodeOp::Load16S; break;
+            case ValueType::u16: op = BytecodeOp::Load16U; break;
+            case ValueType::i32:
+            case ValueType::u32: op = BytecodeOp::Load32; break;
+            default: break;
+        }
+
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " " << operand2str(dest) << ", ["
+                      << operand2str(address) << "]" << std::endl;
+
+        emit(BytecodeInstr(op, reg(dest), reg(address)));
+    }
+
+    void store(Value* address, Value* value)
+    {
+        BytecodeOp op = BytecodeOp::Store64;
+        switch( value_type_size(value->value_type) )
+        {
+            case 1: op = BytecodeOp::Store8; break;
+            case 2: op = BytecodeOp::Store16; break;
+            case 4: op = BytecodeOp::Store32; break;
+            default: break;
+        }
+
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " [" << operand2str(address) << "], "
+                      << operand2str(value) << std::endl;
+
+        emit(BytecodeInstr(op, 0, reg(address), reg(value)));
+    }
+
+    void spill(Value* dest, Value* value)
+    {
+        if(m_dump_asm)
+            std::cout << "  Spill [" << dest->get_stack_offset() / 8 << "], "
+                      << operand2str(value) << std::endl;
+
+        BytecodeInstr instr(BytecodeOp::Spill, 0, reg(value));
+        instr.imm = (i64)(dest->get_stack_offset() / 8);
+        emit(instr);
+    }
+
+    void reload(Value* dest, Value* value)
+    {
+        if(m_dump_asm)
+            std::cout << "  Reload " << operand2str(dest) << ", ["
+                      << value->get_stack_offset() / 8 << "]" << std::endl;
+
+        BytecodeInstr instr(BytecodeOp::Reload, reg(dest));
+        instr.imm = (i64)(value->get_stack_offset() / 8);
+        emit(instr);
+    }
+
+    void jmp(std::string label)
+    {
+        jump(BytecodeInstr(BytecodeOp::Jump), label);
+    }
+
+    void jz(Value* value, std::string label)
+    {
+        BytecodeOp op = is_wide(value->value_type) ? BytecodeOp::JumpIfZero64
+                                                   : BytecodeOp::JumpIfZero32;
+        jump(BytecodeInstr(op, 0, reg(value)), label);
+    }
+
+    void jnz(Value* value, std::string label)
+    {
+        BytecodeOp op = is_wide(value->value_type) ? BytecodeOp::JumpIfNotZero64
+                                                   : BytecodeOp::JumpIfNotZero32;
+        jump(BytecodeInstr(op, 0, reg(value)), label);
+    }
+
+    void ret(Value* value)
+    {
+        if(m_dump_asm)
+            std::cout << "  Ret " << operand2str(value) << std::endl;
+
+        emit(BytecodeInstr(BytecodeOp::Ret, 0, reg(value)));
+    }
+
+    void ret()
+    {
+        if(m_dump_asm)
+            std::cout << "  RetVoid" << std::endl;
+
+        emit(BytecodeInstr(BytecodeOp::RetVoid));
+    }
+
+    void count_block(u64* counter)
+    {
+        if(m_dump_asm)
+            std::cout << "  Count [" << counter << "]" << std::endl;
+
+        BytecodeInstr instr(BytecodeOp::Count);
+        instr.address = counter;
+        emit(instr);
+    }
+
+private:
+    static const size_t REGISTER_COUNT = 16;
+    static const size_t ARG_COUNT = 6;
+    static const size_t LOCAL_SPILL_SLOTS = 16;
+    static const u16 RETURN_REGISTER = 0;
+
+    // runs the program with args[0..5] in the parameter registers, or with
+    //  `handlers` set only returns the dispatch table of the ops (with
+    //  JITBOX_THREADED_DISPATCH)
+    u64 interpret(const u64* args, const void* const** handlers = nullptr)
+    {
+#if JITBOX_THREADED_DISPATCH
+        static const void* const dispatch[] =
+        {
+            JITBOX_BYTECODE_OPS(JITBOX_BYTECODE_LABEL)
+        };
+        if( handlers )
+        {
+            *handlers = dispatch;
+            return 0;
+        }
+#else
+        assert(!handlers && "Only threaded dispatch has a dispatch table");
+#endif
+
+        // registers and the outgoing arguments of calls
+        u64 r[REGISTER_COUNT] = {};
+        u64 out[ARG_COUNT] = {};
+        for( size_t i = 0; i < m_param_registers.size(); ++i )
+        {
+            r[m_param_registers[i]] = args[i];
+        }
+        // spill slots, on the heap for the rare function needing many
+        u64 local_slots[LOCAL_SPILL_SLOTS];
+        std::vector<u64> heap_slots;
+        u64* slots = local_slots;
+        if( m_spill_slots > LOCAL_SPILL_SLOTS )
+        {
+            heap_slots.resize(m_spill_slots);
+            slots = &heap_slots[0];
+        }
+
+        const BytecodeInstr* program = m_program.data();
+        const BytecodeInstr* ip = program;
+
+#if JITBOX_THREADED_DISPATCH
+#define HANDLER(name) op_##name:
+#define NEXT() goto *(++ip)->handler
+#define JUMP() ip = program + ip->imm; goto *ip->handler
+#else
+#define HANDLER(name) case BytecodeOp::name:
+#define NEXT() ++ip; continue
+#define JUMP() ip = program + ip->imm; continue
+#endif
+        // width `U` (u32 or u64) operation on operands of type `T`; 32 bit
+        //  results clear the upper half of the register, as in native code
+#define BINARY(name, T, U, expr) \
+        HANDLER(name) { T a = (T)r[ip->lhs]; T b = (T)r[ip->rhs]; r[ip->dest] = (u64)(U)(expr); NEXT(); } \
+        HANDLER(name##Imm) { T a = (T)r[ip->lhs]; T b = (T)ip->imm; r[ip->dest] = (u64)(U)(expr); NEXT(); }
+#define BINARY_OPS(name, T32, T64, expr) \
+        BINARY(name##32, T32, u32, expr) BINARY(name##64, T64, u64, expr)
+#define COMPARE_OPS(name, T32, T64, op) \
+        BINARY(name##32, T32, u32, a op b ? 1 : 0) BINARY(name##64, T64, u64, a op b ? 1 : 0)
+#define UNARY(name, T, expr) \
+        HANDLER(name) { T a = (T)r[ip->lhs]; r[ip->dest] = (u64)(T)(expr); NEXT(); }
+#define DIVIDE(name, T, U) \
+        HANDLER(name) { T a = (T)r[ip->lhs]; T b = (T)r[ip->rhs]; \
+                        r[ip->dest] = division_traps(a, b) ? raise_divide_error() : (u64)(U)(a / b); \
+                        NEXT(); }
+#define LOAD(name, T, U) \
+        HANDLER(name) { T value; memcpy(&value, (void*)r[ip->lhs], sizeof(T)); \
+                        r[ip->dest] = (u64)(U)value; NEXT(); }
+#define STORE(name, T) \
+        HANDLER(name) { T value = (T)r[ip->rhs]; memcpy((void*)r[ip->lhs], &value, sizeof(T)); NEXT(); }
+
+#if JITBOX_THREADED_DISPATCH
+        goto *ip->handler;
+#else
+        for( ;; ) switch( ip->op )
+        {
+#endif
+
+        HANDLER(Mov) r[ip->dest] = r[ip->lhs]; NEXT();
+        HANDLER(MovImm) r[ip->dest] = (u64)ip->imm; NEXT();
+        HANDLER(Spill) slots[ip->imm] = r[ip->lhs]; NEXT();
+        HANDLER(Reload) r[ip->dest] = slots[ip->imm]; NEXT();
+
+        BINARY_OPS(Add, u32, u64, a + b)
+        BINARY_OPS(Sub, u32, u64, a - b)
+        BINARY_OPS(Mul, u32, u64, a * b)
+        BINARY_OPS(And, u32, u64, a & b)
+        BINARY_OPS(Or, u32, u64, a | b)
+        BINARY_OPS(Xor, u32, u64, a ^ b)
+        // shift counts are masked to the operand width, as by the cpu
+        BINARY(Shl32, u32, u32, a << (b & 31)) BINARY(Shl64, u64, u64, a << (b & 63))
+        BINARY(Shr32, u32, u32, a >> (b & 31)) BINARY(Shr64, u64, u64, a >> (b & 63))
+        BINARY(Sar32, i32, u32, a >> (b & 31)) BINARY(Sar64, i64, u64, a >> (b & 63))
+
+        COMPARE_OPS(Eq, u32, u64, ==)
+        COMPARE_OPS(Ne, u32, u64, !=)
+        COMPARE_OPS(LtS, i32, i64, <)
+        COMPARE_OPS(LeS, i32, i64, <=)
+        COMPARE_OPS(GtS, i32, i64, >)
+        COMPARE_OPS(GeS, i32, i64, >=)
+        COMPARE_OPS(LtU, u32, u64, <)
+        COMPARE_OPS(LeU, u32, u64, <=)
+        COMPARE_OPS(GtU, u32, u64, >)
+        COMPARE_OPS(GeU, u32, u64, >=)
+
+        HANDLER(AndNot32) r[ip->dest] = (u32)r[ip->lhs] & ~(u32)r[ip->rhs]; NEXT();
+        HANDLER(AndNot64) r[ip->dest] = r[ip->lhs] & ~r[ip->rhs]; NEXT();
+
+        // division by zero and overflowing signed division raise SIGFPE,
+        //  as the native div does. (they are undefined in C++)
+        DIVIDE(DivS32, i32, u32) DIVIDE(DivU32, u32, u32)
+        DIVIDE(DivS64, i64, u64) DIVIDE(DivU64, u64, u64)
+
+        UNARY(Not32, u32, ~a) UNARY(Not64, u64, ~a)
+        UNARY(Popcnt32, u32, __builtin_popcount(a)) UNARY(Popcnt64, u64, __builtin_popcountll(a))
+        UNARY(Tzcnt32, u32, a ? __builtin_ctz(a) : 32) UNARY(Tzcnt64, u64, a ? __builtin_ctzll(a) : 64)
+        UNARY(Lzcnt32, u32, a ? __builtin_clz(a) : 32) UNARY(Lzcnt64, u64, a ? __builtin_clzll(a) : 64)
+
+        LOAD(Load8S, i8, u32) LOAD(Load8U, u8, u32)
+        LOAD(Load16S, i16, u32) LOAD(Load16U, u16, u32)
+        LOAD(Load32, u32, u32) LOAD(Load64, u64, u64)
+        STORE(Store8, u8) STORE(Store16, u16) STORE(Store32, u32) STORE(Store64, u64)
+
+        HANDLER(Jump) JUMP();
+        HANDLER(JumpIfZero32) if( (u32)r[ip->lhs] == 0 ) { JUMP(); } NEXT();
+        HANDLER(JumpIfZero64) if( r[ip->lhs] == 0 ) { JUMP(); } NEXT();
+        HANDLER(JumpIfNotZero32) if( (u32)r[ip->lhs] != 0 ) { JUMP(); } NEXT();
+        HANDLER(JumpIfNotZero64) if( r[ip->lhs] != 0 ) { JUMP(); } NEXT();
+
+        HANDLER(Arg) out[ip->dest] = r[ip->lhs]; NEXT();
+        HANDLER(ArgImm) out[ip->dest] = (u64)ip->imm; NEXT();
+        HANDLER(CallSelf) r[RETURN_REGISTER] = interpret(out); NEXT();
+        HANDLER(CallFunction)
+            r[RETURN_REGISTER] = ((BytecodeGenerator*)ip->address)->interpret(out);
+            NEXT();
+        // native code takes its arguments from the argument registers
+        HANDLER(CallNative) r[RETURN_REGISTER] = call_native(ip->address, r); NEXT();
+
+        HANDLER(Ret) return r[ip->lhs];
+        // rax is left as is, e.g. holding the result of a native call
+        HANDLER(RetVoid) return r[RETURN_REGISTER];
+        HANDLER(Count) ++*(u64*)ip->address; NEXT();
+#if !JITBOX_THREADED_DISPATCH
+        }
+#endif
+
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+#undef BINARY
+#undef BINARY_OPS
+#undef COMPARE_OPS
+#undef UNARY
+#undef DIVIDE
+#undef LOAD
+#undef STORE
+    }
+
+    template<typename T>
+    static bool division_traps(T a, T b)
+    {
+        return b == 0 || (std::numeric_limits<T>::is_signed && b == (T)-1 &&
+                          a == std::numeric_limits<T>::min());
+    }
+
+    // if a handler returns, the result is 0
+    static u64 raise_divide_error()
+    {
+        raise(SIGFPE);
+        return 0;
+    }
+
+    u64 call_native(void* address, const u64* r)
+    {
+        typedef u64 (*Native)(u64, u64, u64, u64, u64, u64);
+        const std::vector<u8> &params = m_param_registers;
+        return ((Native)address)(r[params[0]], r[params[1]], r[params[2]],
+                                 r[params[3]], r[params[4]], r[params[5]]);
+    }
+
+    void emit(const BytecodeInstr &instr)
+    {
+        m_program.push_back(instr);
+    }
+
+    // `op32` is the 32 bit register form of the op, see JITBOX_BYTECODE_OPS
+    void binary(BytecodeOp op32, Value* dest, Value* lhs, Value* rhs)
+    {
+        int form = (is_wide(lhs->value_type) ? 2 : 0) + (is_immediate(rhs) ? 1 : 0);
+        BytecodeOp op = (BytecodeOp)((int)op32 + form);
+
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " " << operand2str(dest) << ", "
+                      << operand2str(lhs) << ", " << operand2str(rhs) << std::endl;
+
+        BytecodeInstr instr(op, reg(dest), reg(lhs));
+        if( is_immediate(rhs) )
+        {
+            instr.imm = rhs->get_constant();
+        }
+        else
+        {
+            instr.rhs = reg(rhs);
+        }
+        emit(instr);
+    }
+
+    void unary(BytecodeOp op32, Value* dest, Value* value)
+    {
+        // the 64 bit form follows the 32 bit one
+        BytecodeOp op = (BytecodeOp)((int)op32 + (is_wide(value->value_type) ? 1 : 0));
+
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " " << operand2str(dest) << ", "
+                      << operand2str(value) << std::endl;
+
+        emit(BytecodeInstr(op, reg(dest), reg(value)));
+    }
+
+    void emit_registers(BytecodeOp op, Value* dest, Value* lhs, Value* rhs)
+    {
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " " << operand2str(dest) << ", "
+                      << operand2str(lhs) << ", " << operand2str(rhs) << std::endl;
+
+        emit(BytecodeInstr(op, reg(dest), reg(lhs), reg(rhs)));
+    }
+
+    void call(BytecodeOp op, void* address)
+    {
+        if(m_dump_asm)
+            std::cout << "  " << op2str(op) << " " << address << std::endl;
+
+        BytecodeInstr instr(op);
+        instr.address = address;
+        emit(instr);
+    }
+
+    // the target is resolved by finalize(), once every block is known
+    void jump(BytecodeInstr instr, std::string label)
+    {
+        if(m_dump_asm)
+            std::cout << "  " << op2str(instr.op) << " "
+                      << (instr.op == BytecodeOp::Jump ? "" : reg2str(instr.lhs) + ", ")
+                      << label << std::endl;
+
+        m_jumps.push_back(std::make_pair(m_program.size(), label));
+        emit(instr);
+    }
+
+    static u8 reg(Value* value)
+    {
+        return (u8)value->get_register().idx;
+    }
+
+    // constants without a register are immediates (see is_immediate_operand)
+    static bool is_immediate(Value* value)
+    {
+        return value->get_storage_type() != StorageType::Register;
+    }
+
+    static bool is_wide(ValueType type)
+    {
+        return type == ValueType::i64 || type == ValueType::u64 ||
+               type == ValueType::pointer;
+    }
+
+    static bool is_signed(ValueType type)
+    {
+        return type == ValueType::i8 || type == ValueType::i16 ||
+               type == ValueType::i32 || type == ValueType::i64;
+    }
+
+    static std::string op2str(BytecodeOp op)
+    {
+        static const char* names[] =
+        {
+            JITBOX_BYTECODE_OPS(JITBOX_BYTECODE_NAME)
+        };
+        return names[(int)op];
+    }
+
+    static std::string reg2str(u16 idx)
+    {
+        return "r" + std::to_string(idx);
+    }
+
+    static std::string operand2str(Value* value)
+    {
+        if( is_immediate(value) )
+        {
+            return std::to_string(value->get_constant());
+        }
+        return reg2str(value->get_register().idx);
+    }
+
+    std::vector<BytecodeInstr> m_program;
+    // first instruction of each block
+    std::map<std::string, size_t> m_labels;
+    // (instruction, target label) of the jumps
+    std::vector<std::pair<size_t, std::string>> m_jumps;
+    // registers the parameters arrive in, in order
+    std::vector<u8> m_param_registers;
+    size_t m_spill_slots;
+    bool m_finalized;
+};
+
+#undef JITBOX_BYTECODE_BINARY
+#undef JITBOX_BYTECODE_OPS
+#undef JITBOX_BYTECODE_ENUM
+#undef JITBOX_BYTECODE_NAME
+#undef JITBOX_BYTECODE_LABEL
+
+} // namespace jitbox
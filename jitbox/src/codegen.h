@@ -1,55 +1,97 @@
 #pragma once
-#include <unistd.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <algorithm>
 #include "coretypes.h"
+#include "codeheap.h"
+#include "cpufeatures.h"
 #include "storagealloc.h"
 
-#ifndef MAP_32BIT
-#define MAP_32BIT 0
-#endif
-
 namespace jitbox
 {
 
 class CodeGenerator
 {
 public:
-    CodeGenerator(bool dump_asm)
-        : m_mem(nullptr), m_page_count(0),
-          m_dump_asm(dump_asm), PAGE_SIZE(sysconf(_SC_PAGESIZE))
+    CodeGenerator(CodeHeap* heap, bool dump_asm)
+        : m_cpu_features(CpuFeature::Baseline), m_dump_asm(dump_asm),
+          m_entry_counter(nullptr), m_heap(heap), m_entry(nullptr),
+          m_mem(nullptr), m_size(0), m_cold_mem(nullptr), m_cold_size(0),
+          m_hot(false), m_profile(false),
+          m_function_alignment(16), m_loop_alignment(16)
     {
+        // code emitted before the first block (e.g. constants) belongs to
+        //  an unnamed entry block
+        m_blocks.push_back(Block("", 0, 0));
     }
 
     virtual ~CodeGenerator()
     {
-      munmap(m_mem, PAGE_SIZE*m_page_count);
-      m_mem = nullptr;
+        // other threads may still be running this code, so it is only
+        //  reused once the owner reclaims retired code
+        if( m_mem )
+        {
+            m_heap->retire(m_mem, m_size);
+        }
+        if( m_cold_mem )
+        {
+            m_heap->retire(m_cold_mem, m_cold_size);
+        }
+        m_mem = nullptr;
+        m_cold_mem = nullptr;
     }
 
-    void finalize()
+    // place the code in the heap. false if it couldn't be written there
+    //  (see CodeHeap::write), leaving it unplaced.
+    virtual bool finalize()
     {
-        m_page_count = 1 + (m_code.size()/PAGE_SIZE);
-        m_mem = (u8*)mmap(0, PAGE_SIZE * m_page_count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-        memcpy(m_mem, &m_code[0], m_code.size());
-
-        // link
-        for( auto patch_loc : m_addresses_to_patch )
+        // already compiled by an earlier Module::compile()
+        if( m_mem )
         {
-            u8* patch_address = m_mem + patch_loc;
-            // target address stored, just need relative offset from this.
-            // (int*)patch_address points to location in m_mem of function
-            //   address operand (under assumption loaded into lower 32bits).
-            // *(int*)patch_address loads this stored address.
-            // (size_t) cast to expand to 64bit address (to avoid warning).
-            // (u8*) to treat this address as a pointer.
-            u8* target_address = (u8*)(size_t)*((int*)patch_address);
-            // patch_address + 4 to account for address operand
-            // (call expects offset from address after instruction and operands)
-            int call_offset = (int)(target_address - (patch_address + 4));
-            *((int*)patch_address) = (int)call_offset;
+            return true;
         }
 
-        // mark as executable and read-only
-        mprotect(m_mem, PAGE_SIZE * m_page_count, PROT_READ | PROT_EXEC);
+        // the cold section has to be within rel32 range of the hot one. if
+        //  the heap couldn't manage that, keep everything in one section.
+        return place(true) || place(false);
+    }
+
+    // place with the other hot code of the module
+    void set_hot(bool hot)
+    {
+        m_hot = hot;
+    }
+
+    bool is_hot()
+    {
+        return m_hot;
+    }
+
+    // count executions of each block
+    void set_profiling(bool profile)
+    {
+        m_profile = profile;
+    }
+
+    bool is_profiling()
+    {
+        return m_profile;
+    }
+
+    // alignment of the function entry and of loop headers, padded with nops
+    void set_alignment(u32 function_alignment, u32 loop_alignment)
+    {
+        assert((function_alignment & (function_alignment - 1)) == 0);
+        assert((loop_alignment & (loop_alignment - 1)) == 0);
+        m_function_alignment = function_alignment;
+        m_loop_alignment = loop_alignment;
+    }
+
+    // instruction set extensions (CpuFeature) code may use
+    void set_cpu_features(u32 features)
+    {
+        m_cpu_features = features;
     }
 
     // return index of next instruction
@@ -58,42 +100,144 @@ public:
         return m_code.size();
     }
 
-    size_t get_label_offset(std::string label)
+    virtual size_t begin_block(std::string label, u32 flags)
     {
         if(m_dump_asm)
             std::cout << label << ":" << std::endl;
 
-        return m_code.size();
+        m_blocks.push_back(Block(label, flags, m_code.size()));
+        if( m_profile )
+        {
+            m_block_counters.push_back(0);
+            m_blocks.back().counter = &m_block_counters.back();
+            count_block(m_blocks.back().counter);
+        }
+
+        return m_blocks.back().start;
+    }
+
+    // count calls of the function, with profiling enabled. emitted at the
+    //  start of the function body.
+    void count_entry()
+    {
+        if( m_profile )
+        {
+            m_block_counters.push_back(0);
+            m_entry_counter = &m_block_counters.back();
+            count_block(m_entry_counter);
+        }
+    }
+
+    // calls counted so far, with profiling enabled
+    u64 get_entry_count()
+    {
+        assert(m_entry_counter && "Call counts need JitOption::PROFILE");
+        return *m_entry_counter;
+    }
+
+    // execution count from a previous run, used to find cold blocks
+    void set_block_count(std::string label, u64 count)
+    {
+        Block &block = m_blocks[find_block(label)];
+        block.profile_count = count;
+        block.has_profile_count = true;
     }
 
-    Value* alloc_param(std::string name, ValueType type)
+    // executions counted so far, with profiling enabled
+    u64 get_block_count(std::string label)
     {
-        return m_storage_alloc.alloc_param(name, type);
+        Block &block = m_blocks[find_block(label)];
+        assert(block.counter && "Block counts need JitOption::PROFILE");
+        return *block.counter;
     }
 
-    Value* alloc_local(std::string name, ValueType type)
+    // start of a block's code once placed, in the hot or the cold section
+    void* get_block_address(std::string label)
     {
-        return m_storage_alloc.alloc_local(name, type);
+        return m_blocks[find_block(label)].address;
     }
 
-    Value* alloc_constant(ValueType type, i32 value)
+    // size of the hot section, starting at the entry
+    size_t get_code_size()
     {
-        auto constant = m_storage_alloc.alloc_local("", type);
-        mov(constant->get_register(), value);
+        return m_size;
+    }
 
-        return constant;
+    // register assignment for the function being lowered
+    StorageAllocator& get_storage_alloc()
+    {
+        return m_storage_alloc;
     }
 
     virtual void mov(Register dest, Register src) = 0;
     virtual void mov(Register reg, void* address) = 0;
-    virtual void mov(Register reg, i32 value) = 0;
+    virtual void mov(Register reg, i64 value) = 0;
     virtual void call(void* address) = 0;
-    virtual Value* add(Value* lhs, Value* rhs) = 0;
-    virtual Value* sub(Value* lhs, Value* rhs) = 0;
-    virtual Value* imul(Value* lhs, Value* rhs) = 0;
-    virtual Value* idiv(Value* lhs, Value* rhs) = 0;
+    // call the start of this function (recursion)
+    virtual void call_entry() = 0;
+    // call the address held in *slot, for callees not placed yet
+    virtual void call_indirect(void** slot) = 0;
+    // move call arguments into the argument registers
+    virtual void set_arguments(const std::vector<Value*> &args) = 0;
+    // move the returned value of a call into dest
+    virtual void get_result(Value* dest) = 0;
+    // push the callee saved registers the function uses and reserve
+    //  `spill_slots` 8 byte stack slots, keeping the stack aligned for
+    //  calls. undone by ret().
+    virtual void prologue(const std::vector<Register> &preserved, bool makes_calls,
+                          size_t spill_slots) = 0;
+    // spill/restore caller saved registers around a call
+    virtual void save_registers(const std::vector<Register> &registers) = 0;
+    virtual void restore_registers(const std::vector<Register> &registers) = 0;
+    virtual void add(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void sub(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void imul(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void idiv(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void bit_and(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void bit_or(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void bit_xor(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void bit_not(Value* dest, Value* value) = 0;
+    virtual void andn(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void shl(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void shr(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void sar(Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void popcnt(Value* dest, Value* value) = 0;
+    virtual void tzcnt(Value* dest, Value* value) = 0;
+    virtual void lzcnt(Value* dest, Value* value) = 0;
+    virtual void cmp(Condition cond, Value* dest, Value* lhs, Value* rhs) = 0;
+    virtual void load(Value* dest, Value* address) = 0;
+    virtual void store(Value* address, Value* value) = 0;
+    // store value to the stack slot of dest, and load it back
+    virtual void spill(Value* dest, Value* value) = 0;
+    virtual void reload(Value* dest, Value* value) = 0;
+    virtual void jmp(std::string label) = 0;
+    virtual void jz(Value* value, std::string label) = 0;
+    virtual void jnz(Value* value, std::string label) = 0;
     virtual void ret(Value* value) = 0;
     virtual void ret() = 0;
+    virtual void count_block(u64* counter) = 0;
+
+    // code runs on the bytecode interpreter (see BytecodeGenerator), and
+    //  get_code() stays null
+    virtual bool is_interpreted()
+    {
+        return false;
+    }
+
+    // call another interpreted function. native code calls the entry of
+    //  the callee instead.
+    virtual void call_function(CodeGenerator* /*callee*/)
+    {
+        assert(false && "Only interpreted code calls functions by generator");
+    }
+
+    // run the finalized code with args[0..5] in the argument registers,
+    //  returning the contents of the return register
+    virtual u64 run(const u64* args)
+    {
+        typedef u64 (*Entry)(u64, u64, u64, u64, u64, u64);
+        return ((Entry)get_code())(args[0], args[1], args[2], args[3], args[4], args[5]);
+    }
 
     void* get_code()
     {
@@ -124,17 +268,383 @@ protected:
         EmitValue(address, 8);
     }
 
+    // point the rel8 operand at `operand_offset` to the next instruction
+    void PatchRel8(size_t operand_offset)
+    {
+        size_t distance = m_code.size() - (operand_offset + 1);
+        assert(distance < 128);
+        m_code[operand_offset] = (u8)distance;
+    }
+
+    // the instruction just emitted never falls through (jmp, ret)
+    void EndOfFallthrough()
+    {
+        m_terminator_ends.insert(m_code.size());
+    }
+
+    struct CallPatch
+    {
+        CallPatch(size_t offset, void* target) : offset(offset), target(target) {}
+        // offset of the rel32 operand in m_code
+        size_t offset;
+        void* target;
+    };
+
+    struct JumpPatch
+    {
+        JumpPatch(size_t offset, std::string label) : offset(offset), label(label) {}
+        // offset of the rel32 operand in m_code
+        size_t offset;
+        std::string label;
+    };
+
     // until code is moved into its final location, cannot calculate relative
-    //  jumps. so, store addresses to patch during linking
-    std::vector<size_t> m_addresses_to_patch;
+    //  jumps. so, store call and jump operands to patch during linking
+    std::vector<CallPatch> m_call_patches;
+    std::vector<JumpPatch> m_jump_patches;
     StorageAllocator m_storage_alloc;
+    u32 m_cpu_features;
     bool m_dump_asm;
 
 private:
+    struct Block
+    {
+        Block(std::string label, u32 flags, size_t start)
+            : label(label), flags(flags), start(start), address(nullptr), counter(nullptr),
+              profile_count(0), has_profile_count(false)
+        {
+        }
+
+        std::string label;
+        u32 flags;
+        // offset in m_code
+        size_t start;
+        // once placed
+        u8* address;
+        u64* counter;
+        u64 profile_count;
+        bool has_profile_count;
+    };
+
+    // a contiguous piece of the function's final code
+    struct Section
+    {
+        std::vector<u8> image;
+        // (offset in image, target)
+        std::vector<std::pair<size_t, void*>> calls;
+        // (offset in image, target block)
+        std::vector<std::pair<size_t, size_t>> jumps;
+        size_t veneer_start;
+        u8* mem;
+        size_t size;
+    };
+
+    size_t find_block(std::string label)
+    {
+        for( size_t i = 0; i < m_blocks.size(); ++i )
+        {
+            if( m_blocks[i].label == label )
+            {
+                return i;
+            }
+        }
+
+        assert(false && "Unknown block label");
+        return 0;
+    }
+
+    size_t block_end(size_t idx)
+    {
+        return idx + 1 < m_blocks.size() ? m_blocks[idx + 1].start : m_code.size();
+    }
+
+    // index of the block containing offset `offset` of m_code
+    size_t block_at(size_t offset)
+    {
+        size_t idx = 0;
+        while( idx + 1 < m_blocks.size() && m_blocks[idx + 1].start <= offset )
+        {
+            ++idx;
+        }
+        return idx;
+    }
+
+    bool is_cold(size_t idx, u64 max_count)
+    {
+        // the entry block has to stay at the start of the function
+        if( idx == 0 || m_blocks[idx].start == 0 )
+        {
+            return false;
+        }
+
+        const Block &block = m_blocks[idx];
+        if( block.flags & BlockFlag::Unlikely )
+        {
+            return true;
+        }
+
+        // under 1% of the hottest block
+        return block.has_profile_count &&
+               block.profile_count*COLD_RATIO < max_count;
+    }
+
+    // lay out blocks in hot and cold sections and copy them into the heap.
+    //  returns false if the two sections couldn't be placed within range.
+    bool place(bool split_cold)
+    {
+        u64 max_count = 0;
+        for( auto &block : m_blocks )
+        {
+            if( block.has_profile_count && block.profile_count > max_count )
+            {
+                max_count = block.profile_count;
+            }
+        }
+
+        std::vector<size_t> hot_blocks;
+        std::vector<size_t> cold_blocks;
+        for( size_t i = 0; i < m_blocks.size(); ++i )
+        {
+            if( split_cold && is_cold(i, max_count) )
+            {
+                cold_blocks.push_back(i);
+            }
+            else
+            {
+                hot_blocks.push_back(i);
+            }
+        }
+
+        Section hot;
+        Section cold;
+        std::vector<Section*> block_section(m_blocks.size(), nullptr);
+        std::vector<size_t> block_offset(m_blocks.size(), 0);
+        lay_out(hot_blocks, hot, block_section, block_offset);
+        lay_out(cold_blocks, cold, block_section, block_offset);
+
+        for( auto &patch : m_call_patches )
+        {
+            size_t idx = block_at(patch.offset);
+            size_t offset = block_offset[idx] + (patch.offset - m_blocks[idx].start);
+            block_section[idx]->calls.push_back(std::make_pair(offset, patch.target));
+        }
+        for( auto &patch : m_jump_patches )
+        {
+            size_t idx = block_at(patch.offset);
+            size_t offset = block_offset[idx] + (patch.offset - m_blocks[idx].start);
+            block_section[idx]->jumps.push_back(std::make_pair(offset, find_block(patch.label)));
+        }
+
+        // loop headers are aligned relative to the start of their section
+        size_t hot_alignment = std::max(m_function_alignment, m_loop_alignment);
+        CodeRegion hot_region = m_hot ? CodeRegion::Hot : CodeRegion::Normal;
+        void* near = nullptr;
+        for( auto &patch : m_call_patches )
+        {
+            if( patch.target )
+            {
+                near = patch.target;
+                break;
+            }
+        }
+        allocate(hot, hot_alignment, near, hot_region);
+        if( !cold_blocks.empty() )
+        {
+            allocate(cold, m_loop_alignment, hot.mem, CodeRegion::Cold);
+            if( !CodeHeap::in_rel32_range(hot.mem, cold.mem + cold.size) ||
+                !CodeHeap::in_rel32_range(cold.mem, hot.mem + hot.size) )
+            {
+                m_heap->free(hot.mem, hot.size);
+                m_heap->free(cold.mem, cold.size);
+                return false;
+            }
+        }
+
+        m_entry = hot.mem;
+        if( !link(hot, block_section, block_offset) ||
+            (!cold_blocks.empty() && !link(cold, block_section, block_offset)) )
+        {
+            m_heap->free(hot.mem, hot.size);
+            if( !cold_blocks.empty() )
+            {
+                m_heap->free(cold.mem, cold.size);
+            }
+            return false;
+        }
+        m_mem = hot.mem;
+        m_size = hot.size;
+        if( !cold_blocks.empty() )
+        {
+            m_cold_mem = cold.mem;
+            m_cold_size = cold.size;
+        }
+        for( size_t i = 0; i < m_blocks.size(); ++i )
+        {
+            m_blocks[i].address = block_section[i]->mem + block_offset[i];
+        }
+
+        return true;
+    }
+
+    // copy `blocks` into `section` in order, padding loop headers and
+    //  adding jumps where a block no longer falls through to its successor
+    void lay_out(const std::vector<size_t> &blocks, Section &section,
+                 std::vector<Section*> &block_section,
+                 std::vector<size_t> &block_offset)
+    {
+        for( size_t i = 0; i < blocks.size(); ++i )
+        {
+            size_t idx = blocks[i];
+            const Block &block = m_blocks[idx];
+            if( (block.flags & BlockFlag::LoopHeader) && m_loop_alignment > 1 )
+            {
+                size_t padding = (m_loop_alignment - section.image.size() % m_loop_alignment)
+                               % m_loop_alignment;
+                append_nops(section.image, padding);
+            }
+
+            block_section[idx] = &section;
+            block_offset[idx] = section.image.size();
+            size_t end = block_end(idx);
+            section.image.insert(section.image.end(),
+                                 m_code.begin() + block.start, m_code.begin() + end);
+
+            bool falls_through = m_terminator_ends.count(end) == 0 ||
+                                 end == block.start;
+            bool successor_next = i + 1 < blocks.size() && blocks[i + 1] == idx + 1;
+            if( falls_through && idx + 1 < m_blocks.size() && !successor_next )
+            {
+                // jmp rel32
+                section.image.push_back(0xe9);
+                section.jumps.push_back(std::make_pair(section.image.size(), idx + 1));
+                section.image.resize(section.image.size() + 4, 0);
+            }
+        }
+    }
+
+    // reserve heap space for a laid out section, including a veneer slot
+    //  per distinct call target
+    void allocate(Section &section, size_t alignment, void* near, CodeRegion region)
+    {
+        std::set<void*> targets;
+        for( auto &call : section.calls )
+        {
+            // (calls to the function's own entry are always in range)
+            if( call.second )
+            {
+                targets.insert(call.second);
+            }
+        }
+
+        section.veneer_start = (section.image.size() + VENEER_ALIGN - 1) & ~(VENEER_ALIGN - 1);
+        section.size = section.veneer_start + targets.size()*VENEER_SIZE;
+        section.mem = m_heap->allocate(section.size, alignment, near, region);
+
+        // padding up to the veneers is never executed, but keep it decodable
+        append_nops(section.image, section.veneer_start - section.image.size());
+        section.image.resize(section.size, 0);
+    }
+
+    // false if the heap couldn't write the section
+    bool link(Section &section, std::vector<Section*> &block_section,
+              std::vector<size_t> &block_offset)
+    {
+        // veneers follow the code, one per target that ends up out of
+        //  rel32 range
+        std::map<void*, size_t> veneers;
+        size_t veneer_count = 0;
+
+        for( auto &call : section.calls )
+        {
+            u8* patch_address = section.mem + call.first;
+            u8* target_address = call.second ? (u8*)call.second : m_entry;
+            // patch_address + 4 to account for address operand
+            // (call expects offset from address after instruction and operands)
+            if( !CodeHeap::in_rel32_range(patch_address + 4, target_address) )
+            {
+                // too far for a direct call, so go through a veneer:
+                //  jmp [rip+0] followed by the absolute target address
+                size_t &veneer = veneers[call.second];
+                if( veneer == 0 )
+                {
+                    veneer = section.veneer_start + veneer_count*VENEER_SIZE;
+                    ++veneer_count;
+                    write_veneer(&section.image[veneer], call.second);
+                }
+                target_address = section.mem + veneer;
+            }
+            i64 call_offset = target_address - (patch_address + 4);
+            *((i32*)&section.image[call.first]) = (i32)call_offset;
+        }
+
+        for( auto &jump : section.jumps )
+        {
+            u8* patch_address = section.mem + jump.first;
+            u8* target_address = block_section[jump.second]->mem + block_offset[jump.second];
+            i64 jump_offset = target_address - (patch_address + 4);
+            *((i32*)&section.image[jump.first]) = (i32)jump_offset;
+        }
+
+        // heap pages are read-only and executable outside of writes
+        return m_heap->write(section.mem, &section.image[0], section.size);
+    }
+
+    static void write_veneer(u8* veneer, void* target)
+    {
+        // jmp qword ptr [rip+0]
+        const u8 jmp_indirect[] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+        memcpy(veneer, jmp_indirect, sizeof(jmp_indirect));
+        memcpy(veneer + sizeof(jmp_indirect), &target, sizeof(target));
+    }
+
+    // recommended multi-byte nop forms, longest first
+    static void append_nops(std::vector<u8> &image, size_t count)
+    {
+        static const u8 nops[9][9] =
+        {
+            { 0x90 },
+            { 0x66, 0x90 },
+            { 0x0f, 0x1f, 0x00 },
+            { 0x0f, 0x1f, 0x40, 0x00 },
+            { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+            { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+            { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+            { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        };
+
+        while( count > 0 )
+        {
+            size_t size = count < 9 ? count : 9;
+            image.insert(image.end(), nops[size - 1], nops[size - 1] + size);
+            count -= size;
+        }
+    }
+
+    // jmp [rip+0] (6 bytes) + 8 byte absolute address, padded to 16
+    static const size_t VENEER_SIZE = 16;
+    static const size_t VENEER_ALIGN = 16;
+    // blocks run less than 1/COLD_RATIO as often as the hottest are cold
+    static const u64 COLD_RATIO = 100;
+
     std::vector<u8> m_code;
-    const size_t PAGE_SIZE;
-    size_t m_page_count;
+    std::vector<Block> m_blocks;
+    // offsets in m_code just past a jmp or ret
+    std::set<size_t> m_terminator_ends;
+    // stable addresses for the profiling counters baked into the code
+    std::deque<u64> m_block_counters;
+    u64* m_entry_counter;
+    CodeHeap* m_heap;
+    // start of the hot section, while linking
+    u8* m_entry;
     u8* m_mem;
+    size_t m_size;
+    u8* m_cold_mem;
+    size_t m_cold_size;
+    bool m_hot;
+    bool m_profile;
+    size_t m_function_alignment;
+    size_t m_loop_alignment;
 };
 
 } // namespace jitbox
@@ -0,0 +1,491 @@
+#pragma once
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <iterator>
+#include <set>
+#include <vector>
+#include "coretypes.h"
+
+namespace jitbox
+{
+
+// which set of chunks code is allocated from
+enum class CodeRegion
+{
+    Normal,
+    // performance critical functions, packed together
+    Hot,
+    // rarely executed blocks split out of functions
+    Cold,
+};
+
+// Executable memory shared by the functions of a Module.
+// Code is packed into large mappings (chunks). Freed ranges go back onto
+//  the owning chunk's free list and are reused by later allocations, so
+//  functions can be released individually instead of only with the Module.
+// Hot and cold code get chunks of their own so hot code ends up packed
+//  together, and chunks can be backed by 2MB pages to cut down on iTLB misses.
+// New space is bumped off the tail of the newest chunk of a region without
+//  locking; freed ranges are reused once that runs out.
+class CodeHeap
+{
+public:
+    CodeHeap() : m_huge_pages(false), m_thread_safe(false), PAGE_SIZE(sysconf(_SC_PAGESIZE))
+    {
+        for( auto &newest : m_newest )
+        {
+            newest = nullptr;
+        }
+    }
+
+    ~CodeHeap()
+    {
+        for( auto &chunk : m_chunks )
+        {
+            munmap(chunk->base, chunk->size);
+        }
+    }
+
+    // let several threads allocate, write, free and retire code at once.
+    //  set before other threads use the heap.
+    void set_thread_safe(bool thread_safe)
+    {
+        m_thread_safe = thread_safe;
+    }
+
+    // back chunks mapped from now on with 2MB pages where the system allows
+    //  it, falling back to regular pages otherwise
+    void set_huge_pages(bool use_huge_pages)
+    {
+        std::unique_lock<std::mutex> guard = lock();
+        m_huge_pages = use_huge_pages;
+    }
+
+    // returns `size` bytes of (read/exec) code space from `region`, starting
+    //  at a multiple of `alignment` (a power of two). if `near` is set, the
+    //  space is placed within rel32 range of it when possible.
+    u8* allocate(size_t size, size_t alignment, void* near, CodeRegion region)
+    {
+        size = align_up(size, ALLOC_ALIGN);
+        if( alignment < ALLOC_ALIGN )
+        {
+            alignment = ALLOC_ALIGN;
+        }
+
+        Chunk* newest = m_newest[(int)region].load(std::memory_order_acquire);
+        if( newest && (!near || chunk_in_range(*newest, (u8*)near)) )
+        {
+            u8* mem = bump(*newest, size, alignment);
+            if( mem )
+            {
+                return mem;
+            }
+        }
+
+        std::unique_lock<std::mutex> guard = lock();
+        for( auto &chunk : m_chunks )
+        {
+            if( chunk->region != region ||
+                (near && !chunk_in_range(*chunk, (u8*)near)) )
+            {
+                continue;
+            }
+            u8* mem = allocate_from(*chunk, size, alignment);
+            if( !mem )
+            {
+                mem = bump(*chunk, size, alignment);
+            }
+            if( mem )
+            {
+                return mem;
+            }
+        }
+
+        m_chunks.push_back(map_chunk(align_up(size, CHUNK_SIZE), near, region));
+        Chunk* chunk = m_chunks.back().get();
+        u8* mem = bump(*chunk, size, alignment);
+        m_newest[(int)region].store(chunk, std::memory_order_release);
+        return mem;
+    }
+
+    // copy code into space returned by allocate(). pages are only writable
+    //  for the duration of the copy, and stay executable throughout: they
+    //  may hold code of other functions that is running meanwhile. false if
+    //  the system refuses to change the protection (e.g. where writable
+    //  code pages aren't allowed), leaving the code unwritten or, if the
+    //  pages can't be made read-only again, not to be used.
+    bool write(u8* dest, const void* src, size_t size)
+    {
+        // writes are serialized, so one can't make a page read-only while
+        //  another is still copying into it
+        std::unique_lock<std::mutex> guard = lock();
+
+        // huge page chunks are protected in whole huge pages, so the kernel
+        //  never has to split them
+        size_t page_size = find_chunk(dest).page_size;
+        u8* start = (u8*)align_down((size_t)dest, page_size);
+        size_t length = align_up((size_t)(dest + size - start), page_size);
+
+        if( mprotect(start, length, PROT_READ | PROT_WRITE | PROT_EXEC) != 0 )
+        {
+            return false;
+        }
+        memcpy(dest, src, size);
+        return mprotect(start, length, PROT_READ | PROT_EXEC) == 0;
+    }
+
+    // return space to the heap immediately. the caller guarantees that no
+    //  thread is executing it.
+    void free(u8* mem, size_t size)
+    {
+        std::unique_lock<std::mutex> guard = lock();
+        free_locked(mem, size);
+    }
+
+    // queue space to be freed by the next reclaim(), for code that other
+    //  threads may still be executing
+    void retire(u8* mem, size_t size)
+    {
+        std::unique_lock<std::mutex> guard = lock();
+        m_retired.push_back(std::make_pair(mem, size));
+    }
+
+    // free everything retired so far. the caller guarantees that every
+    //  thread has left the retired code since it was retired.
+    void reclaim()
+    {
+        std::unique_lock<std::mutex> guard = lock();
+        for( auto &retired : m_retired )
+        {
+            free_locked(retired.first, retired.second);
+        }
+        m_retired.clear();
+    }
+
+    static bool in_rel32_range(u8* from, u8* to)
+    {
+        i64 offset = to - from;
+        return offset >= INT32_MIN && offset <= INT32_MAX;
+    }
+
+    // bytes of code space currently handed out
+    size_t get_used_size()
+    {
+        std::unique_lock<std::mutex> guard = lock();
+        size_t used = 0;
+        for( auto &chunk : m_chunks )
+        {
+            used += chunk->used;
+        }
+        return used;
+    }
+
+private:
+    struct Chunk
+    {
+        u8* base;
+        size_t size;
+        // bytes currently allocated
+        std::atomic<size_t> used;
+        // offset of the tail never allocated from, see bump()
+        std::atomic<size_t> top;
+        // granularity of protection changes and of pages handed back
+        size_t page_size;
+        CodeRegion region;
+        // free ranges below top, offset -> size
+        std::map<size_t, size_t> free_ranges;
+    };
+
+    // held for everything but bump() in thread safe mode
+    std::unique_lock<std::mutex> lock()
+    {
+        if( m_thread_safe )
+        {
+            return std::unique_lock<std::mutex>(m_mutex);
+        }
+        return std::unique_lock<std::mutex>();
+    }
+
+    static size_t align_up(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    static size_t align_down(size_t value, size_t alignment)
+    {
+        return value & ~(alignment - 1);
+    }
+
+    static bool chunk_in_range(Chunk &chunk, u8* near)
+    {
+        return in_rel32_range(chunk.base, near) &&
+               in_rel32_range(chunk.base + chunk.size, near);
+    }
+
+    Chunk& find_chunk(u8* mem)
+    {
+        for( auto &chunk : m_chunks )
+        {
+            if( mem >= chunk->base && mem < chunk->base + chunk->size )
+            {
+                return *chunk;
+            }
+        }
+
+        assert(false && "Code wasn't allocated from this heap");
+        return *m_chunks.front();
+    }
+
+    // take space off the tail of `chunk`, with a compare and swap on its top
+    //  so it needs no lock. the alignment gap in front is skipped.
+    u8* bump(Chunk &chunk, size_t size, size_t alignment)
+    {
+        size_t top = chunk.top.load(std::memory_order_relaxed);
+        size_t offset = 0;
+        do
+        {
+            offset = align_up((size_t)chunk.base + top, alignment) - (size_t)chunk.base;
+            if( offset + size > chunk.size )
+            {
+                return nullptr;
+            }
+        } while( !chunk.top.compare_exchange_weak(top, offset + size, std::memory_order_relaxed) );
+
+        chunk.used += size;
+        return chunk.base + offset;
+    }
+
+    // first fit among the freed ranges
+    u8* allocate_from(Chunk &chunk, size_t size, size_t alignment)
+    {
+        for( auto it = chunk.free_ranges.begin(); it != chunk.free_ranges.end(); ++it )
+        {
+            size_t start = it->first;
+            size_t end = it->first + it->second;
+            size_t offset = align_up((size_t)chunk.base + start, alignment)
+                          - (size_t)chunk.base;
+            if( offset + size > end )
+            {
+                continue;
+            }
+
+            // alignment gap in front stays free
+            chunk.free_ranges.erase(it);
+            if( offset > start )
+            {
+                chunk.free_ranges[start] = offset - start;
+            }
+            if( end > offset + size )
+            {
+                chunk.free_ranges[offset + size] = end - (offset + size);
+            }
+            chunk.used += size;
+            return chunk.base + offset;
+        }
+
+        return nullptr;
+    }
+
+    void free_locked(u8* mem, size_t size)
+    {
+        size = align_up(size, ALLOC_ALIGN);
+
+        // empty chunks stay mapped for reuse; their pages were already
+        //  handed back to the OS by free_to()
+        Chunk &chunk = find_chunk(mem);
+        free_to(chunk, mem - chunk.base, size);
+    }
+
+    void free_to(Chunk &chunk, size_t offset, size_t size)
+    {
+        chunk.used -= size;
+
+        // coalesce with neighbouring free ranges
+        auto next = chunk.free_ranges.lower_bound(offset);
+        if( next != chunk.free_ranges.end() && offset + size == next->first )
+        {
+            size += next->second;
+            next = chunk.free_ranges.erase(next);
+        }
+        if( next != chunk.free_ranges.begin() )
+        {
+            auto prev = std::prev(next);
+            if( prev->first + prev->second == offset )
+            {
+                offset = prev->first;
+                size += prev->second;
+                chunk.free_ranges.erase(prev);
+            }
+        }
+        // a range ending at the top goes back to the tail instead. (unless
+        //  a bump() got in first)
+        size_t top = offset + size;
+        if( !chunk.top.compare_exchange_strong(top, offset, std::memory_order_relaxed) )
+        {
+            chunk.free_ranges[offset] = size;
+        }
+
+        // hand whole free pages back to the OS; they are zero filled again
+        //  on next use
+        size_t page_start = align_up((size_t)chunk.base + offset, chunk.page_size);
+        size_t page_end = align_down((size_t)chunk.base + offset + size, chunk.page_size);
+        if( page_end > page_start )
+        {
+            madvise((void*)page_start, page_end - page_start, MADV_DONTNEED);
+        }
+    }
+
+    std::unique_ptr<Chunk> map_chunk(size_t size, void* near, CodeRegion region)
+    {
+        std::unique_ptr<Chunk> chunk(new Chunk());
+        chunk->page_size = PAGE_SIZE;
+        void* mem = MAP_FAILED;
+
+        if( m_huge_pages )
+        {
+            // explicit hugetlb pages if the system has a pool reserved,
+            //  otherwise transparent huge pages on an aligned reservation
+            size = align_up(size, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+            mem = map_near(size, near, MAP_HUGETLB, HUGE_PAGE_SIZE);
+            if( mem != MAP_FAILED )
+            {
+                chunk->page_size = HUGE_PAGE_SIZE;
+            }
+#endif
+#ifdef MADV_HUGEPAGE
+            if( mem == MAP_FAILED )
+            {
+                mem = map_near(size, near, 0, HUGE_PAGE_SIZE);
+                if( mem != MAP_FAILED &&
+                    madvise(mem, size, MADV_HUGEPAGE) == 0 )
+                {
+                    chunk->page_size = HUGE_PAGE_SIZE;
+                }
+            }
+#endif
+        }
+
+        if( mem == MAP_FAILED )
+        {
+            mem = map_near(size, near, 0, PAGE_SIZE);
+        }
+        assert(mem != MAP_FAILED);
+
+        chunk->base = (u8*)mem;
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->top = 0;
+        chunk->region = region;
+        return chunk;
+    }
+
+    // map anywhere in the address space, but prefer somewhere within rel32
+    //  range of `near` so that calls to it can be direct. calls from the
+    //  rest go through veneers.
+    void* map_near(size_t size, void* near, int extra_flags, size_t alignment)
+    {
+        // once probing found no room near a target, later chunks for it
+        //  go straight to veneers instead of probing all over again
+        if( near && m_far_targets.count((size_t)near / FAR_TARGET_GRANULE) == 0 )
+        {
+            // mmap hints are only taken if the range is free, so probe
+            //  outward from the target until one lands in range. hints stay
+            //  within user space, with room for the mapping.
+            const size_t step = 64 << 20;
+            const size_t lowest = align_up(MIN_MAP_ADDRESS, alignment);
+            const size_t highest = USER_SPACE_END - align_up(size + alignment, alignment);
+            size_t base = align_down((size_t)near, alignment);
+            for( size_t distance = step; distance < (1u << 30); distance += step )
+            {
+                std::vector<size_t> hints;
+                if( base >= lowest + distance )
+                {
+                    hints.push_back(base - distance);
+                }
+                if( base + distance <= highest )
+                {
+                    hints.push_back(base + distance);
+                }
+
+                for( auto hint : hints )
+                {
+                    void* mem = map_aligned((void*)hint, size, extra_flags, alignment);
+                    if( mem == MAP_FAILED )
+                    {
+                        // not for lack of room near the hint (e.g. no huge
+                        //  pages), so mapping elsewhere fails the same way
+                        return MAP_FAILED;
+                    }
+                    if( in_rel32_range((u8*)mem, (u8*)near) &&
+                        in_rel32_range((u8*)mem + size, (u8*)near) )
+                    {
+                        return mem;
+                    }
+                    munmap(mem, size);
+                }
+            }
+            m_far_targets.insert((size_t)near / FAR_TARGET_GRANULE);
+        }
+
+        return map_aligned(nullptr, size, extra_flags, alignment);
+    }
+
+    // mmap with the start aligned to `alignment`, by over-reserving and
+    //  trimming the excess
+    void* map_aligned(void* hint, size_t size, int extra_flags, size_t alignment)
+    {
+        const int prot = PROT_READ | PROT_EXEC;
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS | extra_flags;
+        // (hugetlb mappings are always aligned to their page size)
+        if( alignment <= PAGE_SIZE || extra_flags != 0 )
+        {
+            return mmap(hint, size, prot, flags, -1, 0);
+        }
+
+        size_t reserved = size + alignment;
+        u8* mem = (u8*)mmap(hint, reserved, prot, flags, -1, 0);
+        if( mem == MAP_FAILED )
+        {
+            return MAP_FAILED;
+        }
+
+        u8* aligned = (u8*)align_up((size_t)mem, alignment);
+        if( aligned != mem )
+        {
+            munmap(mem, aligned - mem);
+        }
+        munmap(aligned + size, (mem + reserved) - (aligned + size));
+        return aligned;
+    }
+
+    // minimum alignment and size granularity of allocations
+    static const size_t ALLOC_ALIGN = 16;
+    static const size_t CHUNK_SIZE = 1 << 20;
+    static const size_t HUGE_PAGE_SIZE = 2 << 20;
+    static const size_t REGION_COUNT = 3;
+    // bounds of the addresses mmap hands out to user space (the usual
+    //  vm.mmap_min_addr, and the top of 4-level paging)
+    static const size_t MIN_MAP_ADDRESS = 1 << 16;
+    static const size_t USER_SPACE_END = (size_t)1 << 47;
+    static const size_t FAR_TARGET_GRANULE = 64 << 20;
+
+    // chunks are only added or looked up with m_mutex held, the newest of
+    //  each region is also reachable without it
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    std::atomic<Chunk*> m_newest[REGION_COUNT];
+    std::vector<std::pair<u8*, size_t>> m_retired;
+    // targets (in FAR_TARGET_GRANULE units) with no free space in range
+    std::set<size_t> m_far_targets;
+    std::mutex m_mutex;
+    bool m_huge_pages;
+    bool m_thread_safe;
+    const size_t PAGE_SIZE;
+};
+
+} // namespace jitbox
@@ -0,0 +1,193 @@
+#pragma once
+#include <stdint.h>
+
+#include "coretypes.h"
+#include "ir.h"
+
+namespace jitbox
+{
+
+// Evaluates operations on constants at compile time, e.g. once inlining
+//  has substituted constant arguments into a callee's body. Results match
+//  what the generated code computes: operations are 64 bit for 64 bit types
+//  and 32 bit otherwise.
+class ConstantFolder
+{
+public:
+    ConstantFolder(FunctionIR &ir) : m_ir(ir)
+    {
+    }
+
+    // fold until nothing changes. returns the number of instructions folded.
+    size_t run()
+    {
+        size_t total = 0;
+        size_t folded = 0;
+        do
+        {
+            folded = 0;
+            for( auto &block : m_ir.blocks() )
+            {
+                std::vector<Instruction> &instructions = block.instructions;
+                for( size_t i = 0; i < instructions.size(); )
+                {
+                    Instruction &instr = instructions[i];
+                    if( is_branch(instr.op) && instr.op != Opcode::Jump &&
+                        instr.operands[0]->is_constant() )
+                    {
+                        // decided at compile time: take it or drop it
+                        bool taken = (instr.operands[0]->get_constant() != 0) ==
+                                     (instr.op == Opcode::BranchIf);
+                        ++folded;
+                        if( !taken )
+                        {
+                            instructions.erase(instructions.begin() + i);
+                            continue;
+                        }
+                        instr.op = Opcode::Jump;
+                        instr.operands.clear();
+                    }
+                    else if( fold(instr) )
+                    {
+                        ++folded;
+                    }
+                    ++i;
+                }
+            }
+            total += folded;
+        } while( folded > 0 );
+
+        return total;
+    }
+
+private:
+    static bool is_wide(ValueType type)
+    {
+        return type == ValueType::i64 || type == ValueType::u64 ||
+               type == ValueType::pointer;
+    }
+
+    static bool is_signed(ValueType type)
+    {
+        return type == ValueType::i8 || type == ValueType::i16 ||
+               type == ValueType::i32 || type == ValueType::i64;
+    }
+
+    // constants of 32 bit types are kept sign or zero extended
+    static i64 normalize(ValueType type, u64 value)
+    {
+        if( is_wide(type) )
+        {
+            return (i64)value;
+        }
+        return is_signed(type) ? (i64)(i32)(u32)value : (i64)(u32)value;
+    }
+
+    // replace `instr` by a Const if its operands are all constants
+    bool fold(Instruction &instr)
+    {
+        if( !is_pure(instr.op) || instr.op == Opcode::Const || !instr.dest ||
+            instr.dest->is_mutable() )
+        {
+            return false;
+        }
+        for( auto operand : instr.operands )
+        {
+            if( !operand->is_constant() )
+            {
+                return false;
+            }
+        }
+
+        ValueType type = instr.operands[0]->value_type;
+        bool wide = is_wide(type);
+        bool is_signed_op = is_signed(type);
+        u64 width = wide ? 64 : 32;
+        u64 mask = wide ? ~0ull : 0xffffffffull;
+        u64 a = (u64)instr.operands[0]->get_constant() & mask;
+        u64 b = instr.operands.size() > 1 ? (u64)instr.operands[1]->get_constant() & mask : 0;
+        // signed views, for signed division, shifts and compares
+        i64 sa = wide ? (i64)a : (i64)(i32)(u32)a;
+        i64 sb = wide ? (i64)b : (i64)(i32)(u32)b;
+        u64 result = 0;
+
+        switch( instr.op )
+        {
+            case Opcode::Copy:   result = a; break;
+            case Opcode::Add:    result = a + b; break;
+            case Opcode::Sub:    result = a - b; break;
+            case Opcode::Mul:    result = a * b; break;
+            case Opcode::Div:
+            {
+                // leave faulting divisions to run time
+                i64 min = wide ? INT64_MIN : INT32_MIN;
+                if( b == 0 || (is_signed_op && sa == min && sb == -1) )
+                {
+                    return false;
+                }
+                result = is_signed_op ? (u64)(sa / sb) : a / b;
+                break;
+            }
+            case Opcode::And:    result = a & b; break;
+            case Opcode::Or:     result = a | b; break;
+            case Opcode::Xor:    result = a ^ b; break;
+            case Opcode::Not:    result = ~a; break;
+            case Opcode::AndNot: result = a & ~b; break;
+            // shift counts are masked like the hardware does
+            case Opcode::Shl:    result = a << (b & (width - 1)); break;
+            case Opcode::Shr:    result = a >> (b & (width - 1)); break;
+            case Opcode::Sar:    result = (u64)(sa >> (b & (width - 1))); break;
+            case Opcode::Popcnt:
+                for( u64 bits = a; bits; bits &= bits - 1 )
+                {
+                    ++result;
+                }
+                break;
+            case Opcode::Tzcnt:
+                result = 0;
+                while( result < width && !(a & (1ull << result)) )
+                {
+                    ++result;
+                }
+                break;
+            case Opcode::Lzcnt:
+                result = 0;
+                while( result < width && !(a & (1ull << (width - 1 - result))) )
+                {
+                    ++result;
+                }
+                break;
+            case Opcode::Cmp:
+                result = compare(instr.cond, is_signed_op, sa, sb, a, b);
+                break;
+            default:
+                return false;
+        }
+
+        Value* dest = instr.dest;
+        dest->set_constant(normalize(dest->value_type, result));
+        Instruction constant(Opcode::Const);
+        constant.dest = dest;
+        constant.imm = dest->get_constant();
+        instr = constant;
+        return true;
+    }
+
+    static u64 compare(Condition cond, bool is_signed_op, i64 sa, i64 sb, u64 a, u64 b)
+    {
+        switch( cond )
+        {
+            case Condition::Equal:        return a == b;
+            case Condition::NotEqual:     return a != b;
+            case Condition::Less:         return is_signed_op ? sa < sb : a < b;
+            case Condition::LessEqual:    return is_signed_op ? sa <= sb : a <= b;
+            case Condition::Greater:      return is_signed_op ? sa > sb : a > b;
+            case Condition::GreaterEqual: return is_signed_op ? sa >= sb : a >= b;
+        }
+        return 0;
+    }
+
+    FunctionIR &m_ir;
+};
+
+} // namespace jitbox
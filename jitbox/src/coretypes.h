@@ -30,6 +30,27 @@ enum class ValueType
     none,
 };
 
+// bytes a value of `type` takes in memory
+inline size_t value_type_size(ValueType type)
+{
+    switch( type )
+    {
+        case ValueType::i8:
+        case ValueType::u8:      return 1;
+        case ValueType::i16:
+        case ValueType::u16:     return 2;
+        case ValueType::i32:
+        case ValueType::u32:
+        case ValueType::f32:     return 4;
+        case ValueType::i64:
+        case ValueType::u64:
+        case ValueType::f64:
+        case ValueType::pointer: return 8;
+        case ValueType::none:    return 0;
+    }
+    return 0;
+}
+
 enum class StorageType
 {
     Register,
@@ -50,6 +71,24 @@ namespace RegisterFlag
     const u16 Preserved = 1 << 4;
 }
 
+namespace BlockFlag
+{
+    // rarely executed, moved out of line into the cold section
+    const u32 Unlikely = 1 << 0;
+    // target of a loop back edge, start is aligned
+    const u32 LoopHeader = 1 << 1;
+}
+
+enum class Condition
+{
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+};
+
 struct Register
 {
     Register(): idx(0), flags(0) {}
@@ -63,8 +102,51 @@ class Value
 public:
     Value(std::string name, ValueType value_type)
     : name(name), value_type(value_type), m_storage_type(StorageType::Unset),
-      m_stack_offset(0)
+      m_stack_offset(0), m_constant(0), m_is_constant(false), m_is_mutable(false),
+      m_is_assigned_before_use(false)
+    {
+    }
+
+    // value is a known constant (see Function::new_constant)
+    void set_constant(i64 constant)
+    {
+        m_is_constant = true;
+        m_constant = constant;
+    }
+
+    bool is_constant()
+    {
+        return m_is_constant;
+    }
+
+    i64 get_constant()
+    {
+        assert(m_is_constant);
+        return m_constant;
+    }
+
+    // value may be assigned more than once (locals, params)
+    void set_mutable(bool is_mutable)
+    {
+        m_is_mutable = is_mutable;
+    }
+
+    bool is_mutable()
+    {
+        return m_is_mutable;
+    }
+
+    // a mutable value every path assigns before reading it (e.g. the result
+    //  of an inlined call with several returns), so within a loop it never
+    //  holds a value from the previous iteration
+    void set_assigned_before_use(bool assigned_before_use)
+    {
+        m_is_assigned_before_use = assigned_before_use;
+    }
+
+    bool is_assigned_before_use()
     {
+        return m_is_assigned_before_use;
     }
 
     void set_register(Register reg)
@@ -104,6 +186,10 @@ private:
     size_t m_stack_offset;
     Register m_register;
     StorageType m_storage_type;
+    i64 m_constant;
+    bool m_is_constant;
+    bool m_is_mutable;
+    bool m_is_assigned_before_use;
 };
 
 } // namespace jitbox
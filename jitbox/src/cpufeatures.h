@@ -0,0 +1,54 @@
+#pragma once
+#include "coretypes.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define JITBOX_HAS_CPUID 1
+#endif
+
+namespace jitbox
+{
+
+// instruction set extensions the code generator can make use of
+namespace CpuFeature
+{
+    const u32 POPCNT = 1 << 0;
+    const u32 LZCNT = 1 << 1;
+    // andn, tzcnt
+    const u32 BMI1 = 1 << 2;
+    // shlx, sarx, shrx
+    const u32 BMI2 = 1 << 3;
+
+    // plain x86-64, every host has this
+    const u32 Baseline = 0;
+    const u32 All = POPCNT | LZCNT | BMI1 | BMI2;
+}
+
+// query the host cpu via cpuid
+inline u32 detect_cpu_features()
+{
+    u32 features = CpuFeature::Baseline;
+#ifdef JITBOX_HAS_CPUID
+    unsigned int eax, ebx, ecx, edx;
+
+    if( __get_cpuid(1, &eax, &ebx, &ecx, &edx) )
+    {
+        if( ecx & (1 << 23) ) features |= CpuFeature::POPCNT;
+    }
+
+    if( __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) )
+    {
+        // abm
+        if( ecx & (1 << 5) ) features |= CpuFeature::LZCNT;
+    }
+
+    if( __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) )
+    {
+        if( ebx & (1 << 3) ) features |= CpuFeature::BMI1;
+        if( ebx & (1 << 8) ) features |= CpuFeature::BMI2;
+    }
+#endif
+    return features;
+}
+
+} // namespace jitbox
@@ -0,0 +1,254 @@
+#pragma once
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "coretypes.h"
+
+namespace jitbox
+{
+
+enum class ExprKind
+{
+    Column,
+    Literal,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Compare,
+    And,
+    Or,
+    Not,
+    Case,
+};
+
+class Expr;
+typedef std::shared_ptr<const Expr> ExprPtr;
+
+// Node of an expression over the columns of a row, e.g. a predicate or a
+//  projection of a query, lowered by ExprCompiler. Nodes are immutable and
+//  can be shared between trees.
+// Types are checked as the tree is built: arithmetic and comparisons take
+//  operands of the same integer type, comparisons and the logical operators
+//  produce booleans (u8 0 or 1), and the branches of a CASE share a type.
+//  the logical operators and CASE take any u8 as a condition, true unless 0.
+class Expr
+{
+public:
+    // column `index` of the row, with values of `type`
+    static ExprPtr column(size_t index, ValueType type)
+    {
+        check_integer(type);
+        return ExprPtr(new Expr(ExprKind::Column, type, index, 0, Condition::Equal, {}));
+    }
+
+    static ExprPtr literal(ValueType type, i64 value)
+    {
+        check_integer(type);
+        return ExprPtr(new Expr(ExprKind::Literal, type, 0, value, Condition::Equal, {}));
+    }
+
+    static ExprPtr add(ExprPtr lhs, ExprPtr rhs)
+    {
+        return arithmetic(ExprKind::Add, lhs, rhs);
+    }
+
+    static ExprPtr sub(ExprPtr lhs, ExprPtr rhs)
+    {
+        return arithmetic(ExprKind::Sub, lhs, rhs);
+    }
+
+    static ExprPtr mul(ExprPtr lhs, ExprPtr rhs)
+    {
+        return arithmetic(ExprKind::Mul, lhs, rhs);
+    }
+
+    // traps on division by zero, like the generated div does
+    static ExprPtr div(ExprPtr lhs, ExprPtr rhs)
+    {
+        return arithmetic(ExprKind::Div, lhs, rhs);
+    }
+
+    static ExprPtr eq(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::Equal, lhs, rhs);
+    }
+
+    static ExprPtr ne(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::NotEqual, lhs, rhs);
+    }
+
+    static ExprPtr lt(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::Less, lhs, rhs);
+    }
+
+    static ExprPtr le(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::LessEqual, lhs, rhs);
+    }
+
+    static ExprPtr gt(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::Greater, lhs, rhs);
+    }
+
+    static ExprPtr ge(ExprPtr lhs, ExprPtr rhs)
+    {
+        return compare(Condition::GreaterEqual, lhs, rhs);
+    }
+
+    // rhs is only evaluated if lhs is true
+    static ExprPtr logical_and(ExprPtr lhs, ExprPtr rhs)
+    {
+        return logical(ExprKind::And, lhs, rhs);
+    }
+
+    // rhs is only evaluated if lhs is false
+    static ExprPtr logical_or(ExprPtr lhs, ExprPtr rhs)
+    {
+        return logical(ExprKind::Or, lhs, rhs);
+    }
+
+    static ExprPtr logical_not(ExprPtr value)
+    {
+        assert(value->type == ValueType::u8 && "NOT takes a boolean");
+        return ExprPtr(new Expr(ExprKind::Not, ValueType::u8, 0, 0, Condition::Equal, { value }));
+    }
+
+    // CASE WHEN whens[0].first THEN whens[0].second ... ELSE otherwise END.
+    //  only the branch taken is evaluated.
+    static ExprPtr case_when(const std::vector<std::pair<ExprPtr, ExprPtr>> &whens,
+                             ExprPtr otherwise)
+    {
+        std::vector<ExprPtr> operands;
+        for( auto &when : whens )
+        {
+            assert(when.first->type == ValueType::u8 && "CASE conditions have to be booleans");
+            assert(when.second->type == otherwise->type && "CASE branch types differ");
+            operands.push_back(when.first);
+            operands.push_back(when.second);
+        }
+        operands.push_back(otherwise);
+        return ExprPtr(new Expr(ExprKind::Case, otherwise->type, 0, 0, Condition::Equal,
+                                operands));
+    }
+
+    // number of nodes in the tree
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // known to be 0 or 1, rather than any u8
+    bool is_boolean() const
+    {
+        return kind == ExprKind::Compare || kind == ExprKind::And ||
+               kind == ExprKind::Or || kind == ExprKind::Not;
+    }
+
+    // the tree contains a division, which can trap
+    bool can_trap() const
+    {
+        return m_can_trap;
+    }
+
+    // same kind, type, details and operands all the way down
+    static bool equal(const Expr &a, const Expr &b)
+    {
+        if( &a == &b )
+        {
+            return true;
+        }
+        if( a.hash != b.hash || a.kind != b.kind || a.type != b.type || a.index != b.index ||
+            a.value != b.value || a.cond != b.cond || a.operands.size() != b.operands.size() )
+        {
+            return false;
+        }
+        for( size_t i = 0; i < a.operands.size(); ++i )
+        {
+            if( !equal(*a.operands[i], *b.operands[i]) )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const ExprKind kind;
+    const ValueType type;
+    // column index, for Column
+    const size_t index;
+    // for Literal
+    const i64 value;
+    // for Compare
+    const Condition cond;
+    // Case: condition, value pairs followed by the ELSE value
+    const std::vector<ExprPtr> operands;
+    // equal for structurally equal trees (see equal()), combined from the
+    //  hashes of the operands
+    const size_t hash;
+
+private:
+    Expr(ExprKind kind, ValueType type, size_t index, i64 value, Condition cond,
+         const std::vector<ExprPtr> &operands)
+        : kind(kind), type(type), index(index), value(value), cond(cond),
+          operands(operands), hash(make_hash(kind, type, index, value, cond, operands)),
+          m_size(1), m_can_trap(kind == ExprKind::Div)
+    {
+        for( auto &operand : operands )
+        {
+            m_size += operand->m_size;
+            m_can_trap = m_can_trap || operand->m_can_trap;
+        }
+    }
+
+    static void check_integer(ValueType type)
+    {
+        assert(type >= ValueType::i8 && type <= ValueType::u64 &&
+               "Unsupported value type in expression");
+    }
+
+    static ExprPtr arithmetic(ExprKind kind, ExprPtr lhs, ExprPtr rhs)
+    {
+        assert(lhs->type == rhs->type && "Operand types differ");
+        return ExprPtr(new Expr(kind, lhs->type, 0, 0, Condition::Equal, { lhs, rhs }));
+    }
+
+    static ExprPtr compare(Condition cond, ExprPtr lhs, ExprPtr rhs)
+    {
+        assert(lhs->type == rhs->type && "Operand types differ");
+        return ExprPtr(new Expr(ExprKind::Compare, ValueType::u8, 0, 0, cond, { lhs, rhs }));
+    }
+
+    static ExprPtr logical(ExprKind kind, ExprPtr lhs, ExprPtr rhs)
+    {
+        assert(lhs->type == ValueType::u8 && rhs->type == ValueType::u8 &&
+               "AND/OR take booleans");
+        return ExprPtr(new Expr(kind, ValueType::u8, 0, 0, Condition::Equal, { lhs, rhs }));
+    }
+
+    static size_t combine(size_t hash, u64 value)
+    {
+        return hash ^ (size_t)(value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+    }
+
+    static size_t make_hash(ExprKind kind, ValueType type, size_t index, i64 value,
+                            Condition cond, const std::vector<ExprPtr> &operands)
+    {
+        size_t hash = combine(combine(0, (u64)kind), (u64)type);
+        hash = combine(combine(combine(hash, index), (u64)value), (u64)cond);
+        for( auto &operand : operands )
+        {
+            hash = combine(hash, operand->hash);
+        }
+        return hash;
+    }
+
+    size_t m_size;
+    bool m_can_trap;
+};
+
+} // namespace jitbox
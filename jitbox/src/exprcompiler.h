@@ -0,0 +1,334 @@
+#pragma once
+#include <exception>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coretypes.h"
+#include "expr.h"
+#include "function.h"
+#include "module.h"
+
+namespace jitbox
+{
+
+// Lowers expression trees (see Expr) onto functions of a Module, and keeps
+//  the compiled functions, so structurally equal expressions over the same
+//  columns are only compiled once. Can be shared between threads when the
+//  module is JitOption::THREAD_SAFE.
+class ExprCompiler
+{
+public:
+    ExprCompiler(Module &module) : m_module(module), m_function_count(0)
+    {
+    }
+
+    // compiled function taking one argument per column of the row, of the
+    //  types in `columns` (at most 6), and returning the expression's value.
+    //  null if the module can't compile it (see Module::compile), which is
+    //  remembered like a compiled function.
+    Function* compile(const ExprPtr &expr, const std::vector<ValueType> &columns)
+    {
+        return get_function(expr, columns);
+    }
+
+    // compiled batch kernel evaluating the expression for a range of rows of
+    //  columnar data, with columns of the types in `columns` (run it with a
+    //  BatchRunner or run_batch_kernel()). null as for compile().
+    Function* compile_batch(const ExprPtr &expr, const std::vector<ValueType> &columns,
+                            u32 unroll = 1)
+    {
+        Key key = { expr, columns, unroll };
+        std::promise<Function*> promise;
+        std::string name;
+        std::shared_future<Function*> existing = claim(key, promise, name);
+        if( existing.valid() )
+        {
+            return existing.get();
+        }
+
+        Function* kernel = nullptr;
+        try
+        {
+            Function* element = get_function(expr, columns);
+            kernel = element ? m_module.new_batch_kernel(name, element, unroll) : nullptr;
+            if( kernel && !m_module.compile(kernel) )
+            {
+                m_module.release_function(kernel);
+                kernel = nullptr;
+            }
+        }
+        catch( ... )
+        {
+            abandon(key, promise);
+            throw;
+        }
+        promise.set_value(kernel);
+        return kernel;
+    }
+
+    // number of functions compiled (or being compiled) so far
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_functions.size();
+    }
+
+private:
+    // a right operand of AND/OR at most this big is evaluated regardless of
+    //  the left one, when it can't trap, instead of branching around it
+    static const size_t BRANCHLESS_MAX_SIZE = 8;
+
+    // a structurally equal tree over the same column types is the same
+    //  function. batch kernels have their unroll count, functions 0.
+    struct Key
+    {
+        ExprPtr expr;
+        std::vector<ValueType> columns;
+        u32 unroll;
+
+        bool operator==(const Key &other) const
+        {
+            return unroll == other.unroll && columns == other.columns &&
+                   Expr::equal(*expr, *other.expr);
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            size_t hash = key.expr->hash ^ ((size_t)key.unroll << 48);
+            for( auto type : key.columns )
+            {
+                hash = hash * 31 + (size_t)type;
+            }
+            return hash;
+        }
+    };
+
+    // the function being built for an expression
+    struct Lowering
+    {
+        Function* func;
+        std::vector<Value*> columns;
+        size_t label_count;
+    };
+
+    // the function compiled (or being compiled by another thread) for `key`,
+    //  or an invalid future after entering `promise` for it, which the
+    //  caller then fulfils with a new function called `name`. only the
+    //  lookup holds the lock, so threads compile different keys at once.
+    std::shared_future<Function*> claim(const Key &key, std::promise<Function*> &promise,
+                                        std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_functions.find(key);
+        if( it != m_functions.end() )
+        {
+            return it->second;
+        }
+
+        m_functions[key] = promise.get_future().share();
+        name = "expr." + std::to_string(++m_function_count);
+        return std::shared_future<Function*>();
+    }
+
+    // on an exception while compiling a claimed key, threads waiting for it
+    //  get the exception, and later lookups try again
+    void abandon(const Key &key, std::promise<Function*> &promise)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_functions.erase(key);
+        }
+        promise.set_exception(std::current_exception());
+    }
+
+    Function* get_function(const ExprPtr &expr, const std::vector<ValueType> &columns)
+    {
+        std::promise<Function*> promise;
+        std::string name;
+        Key key = { expr, columns, 0 };
+        std::shared_future<Function*> existing = claim(key, promise, name);
+        if( existing.valid() )
+        {
+            return existing.get();
+        }
+
+        Function* func = nullptr;
+        try
+        {
+            func = build_function(expr, columns, name);
+        }
+        catch( ... )
+        {
+            abandon(key, promise);
+            throw;
+        }
+        promise.set_value(func);
+        return func;
+    }
+
+    // new function `name` evaluating `expr`, or null if it doesn't compile
+    Function* build_function(const ExprPtr &expr, const std::vector<ValueType> &columns,
+                             const std::string &name)
+    {
+        assert(columns.size() <= 6 && "Stack passed parameters not supported");
+        Lowering lowering;
+        lowering.func = m_module.new_function(name, expr->type);
+        lowering.label_count = 0;
+        for( size_t c = 0; c < columns.size(); ++c )
+        {
+            lowering.columns.push_back(lowering.func->new_param("col" + std::to_string(c),
+                                                                columns[c]));
+        }
+
+        lowering.func->begin_block("entry");
+        lowering.func->end_block_with_return(lower(lowering, expr));
+        Function* func = lowering.func;
+        if( !m_module.compile(func) )
+        {
+            m_module.release_function(func);
+            func = nullptr;
+        }
+        return func;
+    }
+
+    Value* lower(Lowering &l, const ExprPtr &expr)
+    {
+        Function* func = l.func;
+        const std::vector<ExprPtr> &operands = expr->operands;
+        switch( expr->kind )
+        {
+            case ExprKind::Column:
+                assert(expr->index < l.columns.size() && "Column out of range");
+                assert(l.columns[expr->index]->value_type == expr->type &&
+                       "Column type differs from the row's");
+                return l.columns[expr->index];
+            case ExprKind::Literal:
+                return func->new_constant(expr->type, expr->value);
+            case ExprKind::Add:
+                return func->add(lower(l, operands[0]), lower(l, operands[1]));
+            case ExprKind::Sub:
+                return func->sub(lower(l, operands[0]), lower(l, operands[1]));
+            case ExprKind::Mul:
+                return func->mul(lower(l, operands[0]), lower(l, operands[1]));
+            case ExprKind::Div:
+                return func->div(lower(l, operands[0]), lower(l, operands[1]));
+            case ExprKind::Compare:
+                return compare(func, expr->cond, lower(l, operands[0]),
+                               lower(l, operands[1]));
+            case ExprKind::Not:
+                return func->bit_xor(lower_boolean(l, operands[0]),
+                                     func->new_constant(ValueType::u8, 1));
+            case ExprKind::And:
+            case ExprKind::Or:
+                return logical(l, expr);
+            case ExprKind::Case:
+                return case_when(l, expr);
+        }
+
+        assert(false && "Unknown expression kind");
+        return nullptr;
+    }
+
+    // `expr` as 0 or 1, for operators that work on the bits of booleans
+    Value* lower_boolean(Lowering &l, const ExprPtr &expr)
+    {
+        Value* value = lower(l, expr);
+        if( expr->is_boolean() )
+        {
+            return value;
+        }
+        return l.func->cmp_ne(value, l.func->new_constant(ValueType::u8, 0));
+    }
+
+    Value* compare(Function* func, Condition cond, Value* lhs, Value* rhs)
+    {
+        switch( cond )
+        {
+            case Condition::Equal:        return func->cmp_eq(lhs, rhs);
+            case Condition::NotEqual:     return func->cmp_ne(lhs, rhs);
+            case Condition::Less:         return func->cmp_lt(lhs, rhs);
+            case Condition::LessEqual:    return func->cmp_le(lhs, rhs);
+            case Condition::Greater:      return func->cmp_gt(lhs, rhs);
+            case Condition::GreaterEqual: return func->cmp_ge(lhs, rhs);
+        }
+        return nullptr;
+    }
+
+    Value* logical(Lowering &l, const ExprPtr &expr)
+    {
+        Function* func = l.func;
+        bool is_and = expr->kind == ExprKind::And;
+        const ExprPtr &rhs = expr->operands[1];
+
+        // booleans are 0 or 1, so small operands that can't trap are
+        //  cheaper to just evaluate than to branch around
+        if( !rhs->can_trap() && rhs->size() <= BRANCHLESS_MAX_SIZE )
+        {
+            Value* lhs_value = lower_boolean(l, expr->operands[0]);
+            Value* rhs_value = lower_boolean(l, rhs);
+            return is_and ? func->bit_and(lhs_value, rhs_value) : func->bit_or(lhs_value, rhs_value);
+        }
+
+        // the left operand decides unless it is true (AND) or false (OR)
+        std::string done = next_label(l, is_and ? "and" : "or");
+        Value* result = new_result(func, ValueType::u8);
+        func->assign(result, lower_boolean(l, expr->operands[0]));
+        if( is_and )
+        {
+            func->branch_if_not(result, done);
+        }
+        else
+        {
+            func->branch_if(result, done);
+        }
+        func->assign(result, lower_boolean(l, rhs));
+        func->begin_block(done);
+        return result;
+    }
+
+    Value* case_when(Lowering &l, const ExprPtr &expr)
+    {
+        Function* func = l.func;
+        const std::vector<ExprPtr> &operands = expr->operands;
+        std::string done = next_label(l, "case");
+        Value* result = new_result(func, expr->type);
+        for( size_t i = 0; i + 1 < operands.size(); i += 2 )
+        {
+            std::string next = next_label(l, "when");
+            func->branch_if_not(lower(l, operands[i]), next);
+            func->assign(result, lower(l, operands[i + 1]));
+            func->branch(done);
+            func->begin_block(next);
+        }
+        func->assign(result, lower(l, operands.back()));
+        func->begin_block(done);
+        return result;
+    }
+
+    // local holding the value of a conditionally evaluated expression
+    Value* new_result(Function* func, ValueType type)
+    {
+        Value* result = func->new_local("", type);
+        result->set_assigned_before_use(true);
+        return result;
+    }
+
+    static std::string next_label(Lowering &l, std::string name)
+    {
+        return name + "." + std::to_string(++l.label_count);
+    }
+
+    Module &m_module;
+    // compiled functions and batch kernels by key
+    std::unordered_map<Key, std::shared_future<Function*>, KeyHash> m_functions;
+    std::mutex m_mutex;
+    size_t m_function_count;
+};
+
+} // namespace jitbox
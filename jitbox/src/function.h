@@ -3,43 +3,92 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <mutex>
 
 #include "coretypes.h"
 #include "codegen.h"
-#include "coretypes.h"
+#include "ir.h"
+#include "loop.h"
 
 namespace jitbox
 {
 
+// Builds a function. Operations are recorded first and only lowered onto the
+//  code generator by finalize(), once registers can be allocated (and loops
+//  optimized) with the whole function known.
 class Function
 {
 public:
     Function(std::string name, ValueType return_type, CodeGenerator* gen)
     : m_name(name), m_return_type(return_type),
-      m_gen(gen)
+      m_gen(gen), m_entry(nullptr), m_call_count(0), m_always_inline(false),
+      m_calls_inlined(false), m_finalized(false)
     {
     }
 
     Value* new_param(std::string name, ValueType type)
     {
-        return m_gen->alloc_param(name, type);
+        Value* param = m_ir.new_value(name, type);
+        param->set_mutable(true);
+        m_ir.params().push_back(param);
+        return param;
     }
 
+    // a variable, set with assign()
     Value* new_local(std::string name, ValueType type)
     {
-        return m_gen->alloc_local(name, type);
+        Value* local = m_ir.new_value(name, type);
+        local->set_mutable(true);
+        return local;
+    }
+
+    Value* new_constant(ValueType type, i64 value)
+    {
+        Value* constant = m_ir.new_value("", type);
+        constant->set_constant(value);
+        Instruction instr(Opcode::Const);
+        instr.dest = constant;
+        instr.imm = value;
+        m_ir.append(instr);
+        return constant;
+    }
+
+    // local = value
+    void assign(Value* local, Value* value)
+    {
+        assert(local->is_mutable() && "Only locals and params can be assigned");
+        assert(local->value_type == value->value_type);
+        Instruction instr(Opcode::Copy);
+        instr.dest = local;
+        instr.operands.push_back(value);
+        m_ir.append(instr);
     }
 
-    Value* new_constant(ValueType type, i32 value)
+    // flags are a combination of BlockFlag values
+    void begin_block(std::string block_name, u32 flags = 0)
     {
-        return m_gen->alloc_constant(type, value);
+        m_ir.new_block(block_name, flags);
     }
 
-    void begin_block(std::string block_name)
+    // counted loop, for( iv = start; iv < end; iv += step ) with step > 0.
+    //  returns the induction variable iv. everything recorded up to the
+    //  matching end_loop() is the body; values computed in the body are
+    //  only valid inside it (assign() to a local to carry results out).
+    //  unroll > 1 replicates the body that many times per iteration.
+    Value* begin_loop(Value* start, Value* end, Value* step, u32 unroll = 1)
     {
-        assert(m_blocks.find(block_name) == m_blocks.end());
-        // associate label with offset of next instruction
-        m_blocks[block_name] = m_gen->get_label_offset(block_name);
+        assert(start->value_type == end->value_type);
+        check_offset_operands(start, step);
+        m_loops.emplace_back(new Loop(m_ir, start, end, step, unroll));
+        return m_loops.back()->get_induction_variable();
+    }
+
+    void end_loop()
+    {
+        assert(!m_loops.empty() && "end_loop() without begin_loop()");
+        m_loops.back()->close();
+        m_loops.pop_back();
     }
 
     Value* mul(Value* lhs, Value* rhs)
@@ -50,7 +99,7 @@ public:
         {
             assert(lhs->value_type == rhs->value_type);
 
-            temp = m_gen->imul(lhs, rhs);
+            temp = binary(Opcode::Mul, lhs, rhs);
         }
         else
         {
@@ -68,7 +117,7 @@ public:
         {
             assert(lhs->value_type == rhs->value_type);
 
-            temp = m_gen->idiv(lhs, rhs);
+            temp = binary(Opcode::Div, lhs, rhs);
         }
         else
         {
@@ -78,15 +127,17 @@ public:
         return temp;
     }
 
+    // also pointer + 64 bit integer offset (in bytes)
     Value* add(Value* lhs, Value* rhs)
     {
         Value* temp = nullptr;
-        if( lhs->value_type >= ValueType::i8 &&
-            lhs->value_type <= ValueType::u64 )
+        if( (lhs->value_type >= ValueType::i8 &&
+             lhs->value_type <= ValueType::u64) ||
+            lhs->value_type == ValueType::pointer )
         {
-            assert(lhs->value_type == rhs->value_type);
+            check_offset_operands(lhs, rhs);
 
-            temp = m_gen->add(lhs, rhs);
+            temp = binary(Opcode::Add, lhs, rhs);
         }
         else
         {
@@ -96,15 +147,17 @@ public:
         return temp;
     }
 
+    // also pointer - 64 bit integer offset (in bytes)
     Value* sub(Value* lhs, Value* rhs)
     {
         Value* temp = nullptr;
-        if( lhs->value_type >= ValueType::i8 &&
-            lhs->value_type <= ValueType::u64 )
+        if( (lhs->value_type >= ValueType::i8 &&
+             lhs->value_type <= ValueType::u64) ||
+            lhs->value_type == ValueType::pointer )
         {
-            assert(lhs->value_type == rhs->value_type);
+            check_offset_operands(lhs, rhs);
 
-            temp = m_gen->sub(lhs, rhs);
+            temp = binary(Opcode::Sub, lhs, rhs);
         }
         else
         {
@@ -114,37 +167,620 @@ public:
         return temp;
     }
 
+    Value* bit_and(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        return binary(Opcode::And, lhs, rhs);
+    }
+
+    Value* bit_or(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        return binary(Opcode::Or, lhs, rhs);
+    }
+
+    Value* bit_xor(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        return binary(Opcode::Xor, lhs, rhs);
+    }
+
+    Value* bit_not(Value* value)
+    {
+        check_integer_operands(value, value);
+        return unary(Opcode::Not, value);
+    }
+
+    // lhs & ~rhs
+    Value* and_not(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        return binary(Opcode::AndNot, lhs, rhs);
+    }
+
+    Value* shl(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        return binary(Opcode::Shl, lhs, rhs);
+    }
+
+    // arithmetic shift for signed types, logical for unsigned
+    Value* shr(Value* lhs, Value* rhs)
+    {
+        check_integer_operands(lhs, rhs);
+        if( lhs->value_type == ValueType::i8 || lhs->value_type == ValueType::i16 ||
+            lhs->value_type == ValueType::i32 || lhs->value_type == ValueType::i64 )
+        {
+            return binary(Opcode::Sar, lhs, rhs);
+        }
+        return binary(Opcode::Shr, lhs, rhs);
+    }
+
+    Value* popcount(Value* value)
+    {
+        check_integer_operands(value, value);
+        return unary(Opcode::Popcnt, value);
+    }
+
+    // operand width for zero
+    Value* count_trailing_zeros(Value* value)
+    {
+        check_integer_operands(value, value);
+        return unary(Opcode::Tzcnt, value);
+    }
+
+    // operand width for zero
+    Value* count_leading_zeros(Value* value)
+    {
+        check_integer_operands(value, value);
+        return unary(Opcode::Lzcnt, value);
+    }
+
+    Value* cmp_eq(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::Equal, lhs, rhs);
+    }
+
+    Value* cmp_ne(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::NotEqual, lhs, rhs);
+    }
+
+    Value* cmp_lt(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::Less, lhs, rhs);
+    }
+
+    Value* cmp_le(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::LessEqual, lhs, rhs);
+    }
+
+    Value* cmp_gt(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::Greater, lhs, rhs);
+    }
+
+    Value* cmp_ge(Value* lhs, Value* rhs)
+    {
+        return compare(Condition::GreaterEqual, lhs, rhs);
+    }
+
+    // value of `type` read from `address`. narrower integers are zero or
+    //  sign extended, going by the type.
+    Value* load(Value* address, ValueType type)
+    {
+        assert(address->value_type == ValueType::pointer);
+        assert(((type >= ValueType::i8 && type <= ValueType::u64) ||
+                type == ValueType::pointer) && "Unsupported value type in load");
+        Instruction instr(Opcode::Load);
+        instr.dest = m_ir.new_value("", type);
+        instr.operands.push_back(address);
+        m_ir.append(instr);
+        return instr.dest;
+    }
+
+    // write `value` to `address`, at the width of its type
+    void store(Value* address, Value* value)
+    {
+        assert(address->value_type == ValueType::pointer);
+        assert(((value->value_type >= ValueType::i8 && value->value_type <= ValueType::u64) ||
+                value->value_type == ValueType::pointer) && "Unsupported value type in store");
+        Instruction instr(Opcode::Store);
+        instr.operands.push_back(address);
+        instr.operands.push_back(value);
+        m_ir.append(instr);
+    }
+
+    void branch(std::string block_name)
+    {
+        Instruction instr(Opcode::Jump);
+        instr.label = block_name;
+        m_ir.append(instr);
+    }
+
+    void branch_if(Value* cond, std::string block_name)
+    {
+        conditional_branch(Opcode::BranchIf, cond, block_name);
+    }
+
+    void branch_if_not(Value* cond, std::string block_name)
+    {
+        conditional_branch(Opcode::BranchIfNot, cond, block_name);
+    }
+
     void end_block_with_return()
     {
-        m_gen->ret();
+        m_ir.append(Instruction(Opcode::Return));
     }
 
     void end_block_with_return(Value* value)
     {
         assert(value->value_type == m_return_type);
-        m_gen->ret(value);
+        Instruction instr(Opcode::Return);
+        instr.operands.push_back(value);
+        m_ir.append(instr);
     }
 
+    // arguments are passed through from this function's params
     void call(void* address)
     {
-        m_gen->call(address);
+        Instruction instr(Opcode::CallNative);
+        instr.address = address;
+        m_ir.append(instr);
+    }
+
+    // call another function of the module (or this one). returns the
+    //  result, or nullptr if the callee returns none.
+    Value* call(Function* callee, const std::vector<Value*> &args)
+    {
+        assert(args.size() == callee->m_ir.params().size() && "Wrong number of arguments");
+        for( size_t i = 0; i < args.size(); ++i )
+        {
+            assert(args[i]->value_type == callee->m_ir.params()[i]->value_type &&
+                   "Argument type doesn't match the parameter");
+        }
+
+        Instruction instr(Opcode::Call);
+        instr.callee = callee;
+        instr.operands = args;
+        if( callee->m_return_type != ValueType::none )
+        {
+            instr.dest = m_ir.new_value("", callee->m_return_type);
+        }
+        m_ir.append(instr);
+        return instr.dest;
+    }
+
+    Value* call(Function* callee)
+    {
+        return call(callee, std::vector<Value*>());
+    }
+
+    template<typename... Args>
+    Value* call(Function* callee, Value* arg, Args... args)
+    {
+        return call(callee, std::vector<Value*>{ arg, args... });
     }
 
-    void finalize()
+    // hint that this function is performance critical; hot functions are
+    //  packed together in the code heap
+    void set_hot(bool hot)
     {
-        m_gen->finalize();
+        m_gen->set_hot(hot);
     }
 
+    bool is_hot()
+    {
+        return m_gen->is_hot();
+    }
+
+    // inline calls to this function whatever its size (see
+    //  Module::set_inline_limits), e.g. per-row functions of batch kernels
+    void set_always_inline(bool always_inline)
+    {
+        m_always_inline = always_inline;
+    }
+
+    bool is_always_inline()
+    {
+        return m_always_inline;
+    }
+
+    // false if the function can't be compiled, e.g. because some point of
+    //  it needs more values in registers than there are, or the code heap
+    //  can't be written. it is left uncompiled then.
+    bool finalize()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( !m_finalized )
+        {
+            assert(m_loops.empty() && "begin_loop() without end_loop()");
+            if( !lower() )
+            {
+                return false;
+            }
+            m_finalized = true;
+        }
+        if( !m_gen->finalize() )
+        {
+            return false;
+        }
+        // the code is complete before other threads can see its address
+        m_entry.store(m_gen->get_code(), std::memory_order_release);
+        return true;
+    }
+
+    bool is_finalized()
+    {
+        return m_finalized;
+    }
+
+    std::string get_name()
+    {
+        return m_name;
+    }
+
+    ValueType get_return_type()
+    {
+        return m_return_type;
+    }
+
+    // the recorded operations, until finalize() lowers them
+    FunctionIR& get_ir()
+    {
+        return m_ir;
+    }
+
+    // code address once compiled, null before (and always for interpreted
+    //  functions, see run()). safe to call from any thread: a non-null
+    //  address is only returned once the code behind it is complete.
     void* get()
     {
-        return m_gen->get_code();
+        return m_entry.load(std::memory_order_acquire);
+    }
+
+    // run the compiled function with args[i] as its i-th parameter, with
+    //  either backend. the result is sign or zero extended from the return
+    //  type (0 for none), so the results of an interpreted and a native
+    //  build of a function can be compared (see JitOption::INTERPRET).
+    u64 run(const u64* args)
+    {
+        assert(m_finalized && "Function isn't compiled");
+        u64 slots[6] = {};
+        for( size_t i = 0; i < m_ir.params().size(); ++i )
+        {
+            slots[i] = args[i];
+        }
+
+        u64 result = m_gen->run(slots);
+        switch( m_return_type )
+        {
+            case ValueType::i8:   return (u64)(i64)(i8)result;
+            case ValueType::u8:   return (u8)result;
+            case ValueType::i16:  return (u64)(i64)(i16)result;
+            case ValueType::u16:  return (u16)result;
+            case ValueType::i32:  return (u64)(i64)(i32)result;
+            case ValueType::u32:  return (u32)result;
+            case ValueType::none: return 0;
+            default:              return result;
+        }
+    }
+
+    // held while the function is compiled, and by the inliner while copying
+    //  the function into a caller
+    std::mutex& get_mutex()
+    {
+        return m_mutex;
+    }
+
+    // calls made by the function have been inlined (see Module::compile)
+    void set_calls_inlined()
+    {
+        m_calls_inlined = true;
+    }
+
+    bool are_calls_inlined()
+    {
+        return m_calls_inlined;
+    }
+
+    // execution count of a block from an earlier run (e.g. get_block_count
+    //  of a profiled build). rarely run blocks are moved out of line.
+    void set_block_count(std::string block_name, u64 count)
+    {
+        BasicBlock &block = m_ir.blocks()[m_ir.find_block(block_name)];
+        block.profile_count = count;
+        block.has_profile_count = true;
+    }
+
+    // times a block has run so far, with JitOption::PROFILE set
+    u64 get_block_count(std::string block_name)
+    {
+        return m_gen->get_block_count(block_name);
+    }
+
+    // where a block's native code starts once compiled. blocks moved out of
+    //  line are outside of get() .. get() + get_code_size().
+    void* get_block_address(std::string block_name)
+    {
+        return m_gen->get_block_address(block_name);
+    }
+
+    size_t get_code_size()
+    {
+        return m_gen->get_code_size();
+    }
+
+    // number of calls from an earlier run (e.g. get_call_count of a profiled
+    //  build). frequently called functions are inlined into their callers.
+    void set_call_count(u64 count)
+    {
+        m_call_count = count;
+    }
+
+    // calls so far with JitOption::PROFILE set, otherwise the count set by
+    //  set_call_count()
+    u64 get_call_count()
+    {
+        if( m_finalized && m_gen->is_profiling() )
+        {
+            return m_gen->get_entry_count();
+        }
+        return m_call_count;
     }
 
 private:
-    std::map<std::string, size_t> m_blocks;
+    void check_integer_operands(Value* lhs, Value* rhs)
+    {
+        assert(lhs->value_type >= ValueType::i8 &&
+               lhs->value_type <= ValueType::u64 &&
+               "Unsupported value type in integer op");
+        assert(lhs->value_type == rhs->value_type);
+    }
+
+    // same types, or a pointer and a byte offset
+    void check_offset_operands(Value* lhs, Value* rhs)
+    {
+        if( lhs->value_type == ValueType::pointer )
+        {
+            assert((rhs->value_type == ValueType::i64 ||
+                    rhs->value_type == ValueType::u64) &&
+                   "Pointer offsets have to be 64 bit integers");
+            return;
+        }
+        assert(lhs->value_type == rhs->value_type);
+    }
+
+    Value* unary(Opcode op, Value* value)
+    {
+        Instruction instr(op);
+        instr.dest = m_ir.new_value("", value->value_type);
+        instr.operands.push_back(value);
+        m_ir.append(instr);
+        return instr.dest;
+    }
+
+    Value* binary(Opcode op, Value* lhs, Value* rhs)
+    {
+        // constants go on the right, where they can be immediates
+        bool commutative = op == Opcode::Add || op == Opcode::Mul || op == Opcode::And ||
+                           op == Opcode::Or || op == Opcode::Xor;
+        if( commutative && lhs->is_constant() && !rhs->is_constant() &&
+            lhs->value_type == rhs->value_type )
+        {
+            std::swap(lhs, rhs);
+        }
+
+        Instruction instr(op);
+        instr.dest = m_ir.new_value("", lhs->value_type);
+        instr.operands.push_back(lhs);
+        instr.operands.push_back(rhs);
+        m_ir.append(instr);
+        return instr.dest;
+    }
+
+    void conditional_branch(Opcode op, Value* cond, std::string block_name)
+    {
+        Instruction instr(op);
+        instr.operands.push_back(cond);
+        instr.label = block_name;
+        m_ir.append(instr);
+    }
+
+    Value* compare(Condition cond, Value* lhs, Value* rhs)
+    {
+        Value* temp = nullptr;
+        if( (lhs->value_type >= ValueType::i8 &&
+             lhs->value_type <= ValueType::u64) ||
+            lhs->value_type == ValueType::pointer )
+        {
+            assert(lhs->value_type == rhs->value_type);
+
+            Instruction instr(Opcode::Cmp);
+            instr.dest = m_ir.new_value("", ValueType::u8);
+            instr.operands.push_back(lhs);
+            instr.operands.push_back(rhs);
+            instr.cond = cond;
+            m_ir.append(instr);
+            temp = instr.dest;
+        }
+        else
+        {
+            assert(false && "Unsupported value type in compare(lhs,rhs)");
+        }
+
+        return temp;
+    }
+
+    // allocate registers and emit the recorded function. false, with
+    //  nothing emitted, if the allocation fails.
+    bool lower()
+    {
+        // spill code goes into a copy of the blocks. the recorded ones stay
+        //  as they are, for callers inlining the function.
+        std::vector<BasicBlock> blocks = m_ir.blocks();
+        StorageAllocator &storage = m_gen->get_storage_alloc();
+        if( !storage.allocate(m_ir, blocks) )
+        {
+            return false;
+        }
+        std::vector<std::pair<Register, Register>> param_moves = storage.get_param_moves();
+
+        m_gen->prologue(storage.get_used_preserved(), storage.has_calls(),
+                        storage.get_spill_slots());
+        for( auto &move : param_moves )
+        {
+            m_gen->mov(move.first, move.second);
+        }
+        m_gen->count_entry();
+
+        size_t position = 1;
+        for( size_t b = 0; b < blocks.size(); ++b )
+        {
+            BasicBlock &block = blocks[b];
+            // the unnamed entry block is implicit in the code generator
+            if( b > 0 )
+            {
+                m_gen->begin_block(block.name, block.flags);
+                if( block.has_profile_count )
+                {
+                    m_gen->set_block_count(block.name, block.profile_count);
+                }
+            }
+
+            for( auto &instr : block.instructions )
+            {
+                lower(instr, position, param_moves);
+                ++position;
+            }
+        }
+        return true;
+    }
+
+    void lower(Instruction &instr, size_t position,
+               std::vector<std::pair<Register, Register>> &param_moves)
+    {
+        Value* dest = instr.dest;
+        Value* lhs = instr.operands.size() > 0 ? instr.operands[0] : nullptr;
+        Value* rhs = instr.operands.size() > 1 ? instr.operands[1] : nullptr;
+
+        switch( instr.op )
+        {
+            case Opcode::Const:
+                // constants only used as immediates never get a register
+                if( dest->get_storage_type() == StorageType::Register )
+                {
+                    m_gen->mov(dest->get_register(), instr.imm);
+                }
+                break;
+            case Opcode::Copy:
+                if( lhs->get_storage_type() == StorageType::Register )
+                {
+                    m_gen->mov(dest->get_register(), lhs->get_register());
+                }
+                else
+                {
+                    m_gen->mov(dest->get_register(), lhs->get_constant());
+                }
+                break;
+            case Opcode::Add:     m_gen->add(dest, lhs, rhs); break;
+            case Opcode::Sub:     m_gen->sub(dest, lhs, rhs); break;
+            case Opcode::Mul:     m_gen->imul(dest, lhs, rhs); break;
+            case Opcode::Div:     m_gen->idiv(dest, lhs, rhs); break;
+            case Opcode::And:     m_gen->bit_and(dest, lhs, rhs); break;
+            case Opcode::Or:      m_gen->bit_or(dest, lhs, rhs); break;
+            case Opcode::Xor:     m_gen->bit_xor(dest, lhs, rhs); break;
+            case Opcode::Not:     m_gen->bit_not(dest, lhs); break;
+            case Opcode::AndNot:  m_gen->andn(dest, lhs, rhs); break;
+            case Opcode::Shl:     m_gen->shl(dest, lhs, rhs); break;
+            case Opcode::Shr:     m_gen->shr(dest, lhs, rhs); break;
+            case Opcode::Sar:     m_gen->sar(dest, lhs, rhs); break;
+            case Opcode::Popcnt:  m_gen->popcnt(dest, lhs); break;
+            case Opcode::Tzcnt:   m_gen->tzcnt(dest, lhs); break;
+            case Opcode::Lzcnt:   m_gen->lzcnt(dest, lhs); break;
+            case Opcode::Cmp:     m_gen->cmp(instr.cond, dest, lhs, rhs); break;
+            case Opcode::Load:    m_gen->load(dest, lhs); break;
+            case Opcode::Store:   m_gen->store(lhs, rhs); break;
+            case Opcode::Spill:   m_gen->spill(dest, lhs); break;
+            case Opcode::Reload:  m_gen->reload(dest, lhs); break;
+            case Opcode::Jump:    m_gen->jmp(instr.label); break;
+            case Opcode::BranchIf:    m_gen->jnz(lhs, instr.label); break;
+            case Opcode::BranchIfNot: m_gen->jz(lhs, instr.label); break;
+            case Opcode::Return:
+                if( lhs )
+                {
+                    m_gen->ret(lhs);
+                }
+                else
+                {
+                    m_gen->ret();
+                }
+                break;
+            case Opcode::CallNative:
+            {
+                std::vector<Register> live = m_gen->get_storage_alloc().get_clobbered_across(position);
+                m_gen->save_registers(live);
+                // params that were moved out of their argument register on
+                //  entry go back for the call
+                for( auto &move : param_moves )
+                {
+                    m_gen->mov(move.second, move.first);
+                }
+                m_gen->call(instr.address);
+                m_gen->restore_registers(live);
+                break;
+            }
+            case Opcode::Call:
+            {
+                std::vector<Register> live = m_gen->get_storage_alloc().get_clobbered_across(position);
+                m_gen->save_registers(live);
+                m_gen->set_arguments(instr.operands);
+                Function* callee = instr.callee;
+                if( callee == this )
+                {
+                    m_gen->call_entry();
+                }
+                else if( m_gen->is_interpreted() )
+                {
+                    // interpreted callees have no entry, the interpreter
+                    //  runs them itself
+                    m_gen->call_function(callee->m_gen);
+                }
+                else if( void* entry = callee->get() )
+                {
+                    m_gen->call(entry);
+                }
+                else
+                {
+                    // not compiled yet (e.g. mutual recursion), so go through
+                    //  the slot it fills in once it is
+                    m_gen->call_indirect((void**)&callee->m_entry);
+                }
+                if( dest )
+                {
+                    m_gen->get_result(dest);
+                }
+                m_gen->restore_registers(live);
+                break;
+            }
+        }
+    }
+
+    FunctionIR m_ir;
+    std::vector<std::unique_ptr<Loop>> m_loops;
     std::string m_name;
     ValueType m_return_type;
     CodeGenerator* m_gen;
+    // code address once finalized, which callers compiled earlier call
+    //  through (so it has to have the layout of a plain pointer)
+    std::atomic<void*> m_entry;
+    static_assert(sizeof(std::atomic<void*>) == sizeof(void*), "Entry slot isn't a plain pointer");
+    std::mutex m_mutex;
+    u64 m_call_count;
+    bool m_always_inline;
+    bool m_calls_inlined;
+    bool m_finalized;
 };
 
 } // namespace jitbox
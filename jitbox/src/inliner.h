@@ -0,0 +1,261 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "coretypes.h"
+#include "ir.h"
+#include "function.h"
+#include "constfold.h"
+
+namespace jitbox
+{
+
+// Copies the bodies of small or frequently called functions into their
+//  callers, so the call overhead goes away and constant arguments can be
+//  folded into the callee's code.
+class Inliner
+{
+public:
+    // callees of up to `max_size` instructions are inlined, and callees
+    //  called at least `hot_call_count` times (0 to disable) regardless of
+    //  their size
+    Inliner(size_t max_size, u64 hot_call_count)
+        : m_max_size(max_size), m_hot_call_count(hot_call_count)
+    {
+    }
+
+    // inline calls made by `caller`, then fold constants. callees should
+    //  have been processed first, so calls they inlined are carried along.
+    //  callees another thread is compiling at the same time are skipped.
+    void run(Function* caller)
+    {
+        FunctionIR &ir = caller->get_ir();
+        bool inlined = false;
+        for( size_t b = 0; b < ir.blocks().size(); ++b )
+        {
+            for( size_t i = 0; i < ir.blocks()[b].instructions.size(); ++i )
+            {
+                Instruction &instr = ir.blocks()[b].instructions[i];
+                if( instr.op != Opcode::Call || instr.callee == caller )
+                {
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(instr.callee->get_mutex(), std::try_to_lock);
+                if( lock.owns_lock() && should_inline(instr.callee) )
+                {
+                    // the rest of the block moves behind the callee's body;
+                    //  continue from there, so calls in the copied body
+                    //  aren't expanded again
+                    b = inline_call(ir, b, i) - 1;
+                    inlined = true;
+                    break;
+                }
+            }
+        }
+
+        if( inlined )
+        {
+            ConstantFolder(ir).run();
+        }
+    }
+
+private:
+    bool should_inline(Function* callee)
+    {
+        FunctionIR &ir = callee->get_ir();
+        for( auto &block : ir.blocks() )
+        {
+            for( auto &instr : block.instructions )
+            {
+                // native calls pass the callee's own params through in the
+                //  argument registers, which an inlined copy doesn't have.
+                //  recursive callees would only inline one level.
+                if( instr.op == Opcode::CallNative || instr.callee == callee )
+                {
+                    return false;
+                }
+            }
+        }
+
+        return callee->is_always_inline() || ir.size() <= m_max_size ||
+               (m_hot_call_count > 0 && callee->get_call_count() >= m_hot_call_count);
+    }
+
+    // replace the call at `ir.blocks()[b].instructions[i]` by a copy of the
+    //  callee. returns the index of the block holding the code after it.
+    size_t inline_call(FunctionIR &ir, size_t b, size_t i)
+    {
+        Instruction call = ir.blocks()[b].instructions[i];
+        Function* callee = call.callee;
+        FunctionIR &callee_ir = callee->get_ir();
+        std::vector<BasicBlock> callee_blocks = callee_ir.blocks();
+
+        // values of the callee get new ones in the caller. params the callee
+        //  never assigns are replaced by the arguments directly, the rest
+        //  become locals initialized from them.
+        std::map<Value*, Value*> values;
+        std::vector<Instruction> param_copies;
+        for( size_t p = 0; p < callee_ir.params().size(); ++p )
+        {
+            Value* param = callee_ir.params()[p];
+            if( !is_assigned(callee_blocks, param) )
+            {
+                values[param] = call.operands[p];
+                continue;
+            }
+
+            Value* local = ir.new_value(param->name, param->value_type);
+            local->set_mutable(true);
+            values[param] = local;
+            Instruction copy(Opcode::Copy);
+            copy.dest = local;
+            copy.operands.push_back(call.operands[p]);
+            param_copies.push_back(copy);
+        }
+        for( auto &block : callee_blocks )
+        {
+            for( auto &instr : block.instructions )
+            {
+                Value* dest = instr.dest;
+                if( dest && !values.count(dest) )
+                {
+                    Value* copy = ir.new_value(dest->name, dest->value_type);
+                    copy->set_mutable(dest->is_mutable());
+                    copy->set_assigned_before_use(dest->is_assigned_before_use());
+                    if( dest->is_constant() )
+                    {
+                        copy->set_constant(dest->get_constant());
+                    }
+                    values[dest] = copy;
+                }
+            }
+        }
+
+        // the result is assigned once per return, before the code after the
+        //  call reads it
+        size_t return_count = 0;
+        for( auto &block : callee_blocks )
+        {
+            for( auto &instr : block.instructions )
+            {
+                return_count += instr.op == Opcode::Return;
+            }
+        }
+        if( call.dest && return_count > 1 )
+        {
+            call.dest->set_mutable(true);
+            call.dest->set_assigned_before_use(true);
+        }
+
+        std::string prefix = callee->get_name();
+        std::map<std::string, std::string> labels;
+        for( auto &block : callee_blocks )
+        {
+            std::string base = block.name.empty() ? prefix : prefix + "." + block.name;
+            labels[block.name] = unique_name(ir, labels, base);
+        }
+        std::string after = unique_name(ir, labels, prefix + ".ret");
+
+        // split the caller's block at the call
+        std::vector<Instruction> &instructions = ir.blocks()[b].instructions;
+        std::vector<Instruction> tail(instructions.begin() + i + 1, instructions.end());
+        instructions.erase(instructions.begin() + i, instructions.end());
+        instructions.insert(instructions.end(), param_copies.begin(), param_copies.end());
+
+        size_t at = b + 1;
+        for( size_t c = 0; c < callee_blocks.size(); ++c )
+        {
+            BasicBlock &block = callee_blocks[c];
+            ir.insert_block(at, labels[block.name], block.flags);
+            std::vector<Instruction> &copied = ir.blocks()[at].instructions;
+            for( auto instr : block.instructions )
+            {
+                if( instr.dest )
+                {
+                    instr.dest = values[instr.dest];
+                }
+                for( auto &operand : instr.operands )
+                {
+                    if( values.count(operand) )
+                    {
+                        operand = values[operand];
+                    }
+                }
+                if( is_branch(instr.op) )
+                {
+                    instr.label = labels[instr.label];
+                }
+
+                if( instr.op == Opcode::Return )
+                {
+                    if( call.dest )
+                    {
+                        Instruction result(Opcode::Copy);
+                        result.dest = call.dest;
+                        result.operands.push_back(instr.operands[0]);
+                        copied.push_back(result);
+                    }
+                    instr = Instruction(Opcode::Jump);
+                    instr.label = after;
+                }
+                copied.push_back(instr);
+            }
+            ++at;
+        }
+
+        // falling off the end of the callee's code continues after the
+        //  call, as does a jump there from the last block
+        std::vector<Instruction> &last = ir.blocks()[at - 1].instructions;
+        if( !last.empty() && last.back().op == Opcode::Jump && last.back().label == after )
+        {
+            last.pop_back();
+        }
+
+        ir.insert_block(at, after, 0);
+        ir.blocks()[at].instructions = tail;
+        return at;
+    }
+
+    static bool is_assigned(const std::vector<BasicBlock> &blocks, Value* value)
+    {
+        for( auto &block : blocks )
+        {
+            for( auto &instr : block.instructions )
+            {
+                if( instr.dest == value )
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // block name unused in `ir` and not taken by `labels` yet
+    static std::string unique_name(FunctionIR &ir, const std::map<std::string, std::string> &labels,
+                                   std::string base)
+    {
+        std::string name = ir.unique_block_name(base);
+        for( int n = 1; ; ++n )
+        {
+            bool taken = false;
+            for( auto &label : labels )
+            {
+                taken = taken || label.second == name;
+            }
+            if( !taken )
+            {
+                return name;
+            }
+            name = ir.unique_block_name(base + "." + std::to_string(n));
+        }
+    }
+
+    size_t m_max_size;
+    u64 m_hot_call_count;
+};
+
+} // namespace jitbox
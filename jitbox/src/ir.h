@@ -0,0 +1,258 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+#include "coretypes.h"
+
+namespace jitbox
+{
+
+class Function;
+
+// Operations recorded by Function. Values are lowered onto the code
+//  generator once the whole function is known.
+enum class Opcode
+{
+    // dest = imm
+    Const,
+    // dest = operands[0]
+    Copy,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    And,
+    Or,
+    Xor,
+    Not,
+    // operands[0] & ~operands[1]
+    AndNot,
+    Shl,
+    // logical shift right
+    Shr,
+    // arithmetic shift right
+    Sar,
+    Popcnt,
+    Tzcnt,
+    Lzcnt,
+    // dest = operands[0] <cond> operands[1]
+    Cmp,
+    // dest = *operands[0], at the width of dest
+    Load,
+    // *operands[0] = operands[1]
+    Store,
+    // goto label
+    Jump,
+    // if operands[0] goto label
+    BranchIf,
+    BranchIfNot,
+    // return operands[0], or nothing without operands
+    Return,
+    // call address, arguments pass through in the parameter registers
+    CallNative,
+    // dest = callee(operands...), dest is null for none
+    Call,
+    // dest = operands[0], where dest is in a stack slot. added by the
+    //  register allocator, as is Reload.
+    Spill,
+    // dest = operands[0], where operands[0] is in a stack slot
+    Reload,
+};
+
+struct Instruction
+{
+    Instruction(Opcode op)
+        : op(op), dest(nullptr), cond(Condition::Equal), imm(0), address(nullptr),
+          callee(nullptr)
+    {
+    }
+
+    Opcode op;
+    Value* dest;
+    std::vector<Value*> operands;
+    Condition cond;
+    i64 imm;
+    std::string label;
+    void* address;
+    Function* callee;
+};
+
+struct BasicBlock
+{
+    BasicBlock(std::string name, u32 flags)
+        : name(name), flags(flags), profile_count(0), has_profile_count(false)
+    {
+    }
+
+    std::string name;
+    // BlockFlag values
+    u32 flags;
+    std::vector<Instruction> instructions;
+    u64 profile_count;
+    bool has_profile_count;
+};
+
+// never falls through to the next instruction
+inline bool is_terminator(Opcode op)
+{
+    return op == Opcode::Jump || op == Opcode::Return;
+}
+
+inline bool is_branch(Opcode op)
+{
+    return op == Opcode::Jump || op == Opcode::BranchIf ||
+           op == Opcode::BranchIfNot;
+}
+
+// only computes dest, so can be removed if dest is unused
+inline bool is_pure(Opcode op)
+{
+    return op <= Opcode::Cmp;
+}
+
+// pure and can't fault, so can be executed speculatively
+inline bool is_speculatable(Opcode op)
+{
+    return is_pure(op) && op != Opcode::Div;
+}
+
+// operand `index` of `instr` is a constant the instruction can encode as
+//  an immediate, so it doesn't need a register
+inline bool is_immediate_operand(const Instruction &instr, size_t index)
+{
+    Value* operand = instr.operands[index];
+    if( !operand->is_constant() )
+    {
+        return false;
+    }
+
+    i64 value = operand->get_constant();
+    switch( instr.op )
+    {
+        case Opcode::Copy:
+            return true;
+        case Opcode::Add:
+        case Opcode::Sub:
+        case Opcode::Mul:
+        case Opcode::And:
+        case Opcode::Or:
+        case Opcode::Xor:
+        case Opcode::Cmp:
+            return index == 1 && value >= INT32_MIN && value <= INT32_MAX;
+        case Opcode::Shl:
+        case Opcode::Shr:
+        case Opcode::Sar:
+            return index == 1 && value >= 0 && value < 64;
+        default:
+            return false;
+    }
+}
+
+// Values and blocks of a function under construction
+class FunctionIR
+{
+public:
+    FunctionIR()
+    {
+        // instructions recorded before the first block (e.g. constants) go
+        //  into an unnamed entry block
+        m_blocks.push_back(BasicBlock("", 0));
+    }
+
+    Value* new_value(std::string name, ValueType type)
+    {
+        m_values.emplace_back(new Value(name, type));
+        return m_values.back().get();
+    }
+
+    size_t new_block(std::string name, u32 flags)
+    {
+        assert(m_block_names.find(name) == m_block_names.end());
+        m_block_names[name] = m_blocks.size();
+        m_blocks.push_back(BasicBlock(name, flags));
+        return m_blocks.size() - 1;
+    }
+
+    // add a block in front of block `index`, e.g. to split a block
+    size_t insert_block(size_t index, std::string name, u32 flags)
+    {
+        assert(m_block_names.find(name) == m_block_names.end());
+        m_blocks.insert(m_blocks.begin() + index, BasicBlock(name, flags));
+        for( auto &block_name : m_block_names )
+        {
+            if( block_name.second >= index )
+            {
+                ++block_name.second;
+            }
+        }
+        m_block_names[name] = index;
+        return index;
+    }
+
+    size_t find_block(std::string name)
+    {
+        auto it = m_block_names.find(name);
+        assert(it != m_block_names.end() && "Unknown block");
+        return it->second;
+    }
+
+    bool has_block(std::string name)
+    {
+        return m_block_names.find(name) != m_block_names.end();
+    }
+
+    // block name not used yet, based on `base`
+    std::string unique_block_name(std::string base)
+    {
+        std::string name = base;
+        for( int i = 1; has_block(name); ++i )
+        {
+            name = base + "." + std::to_string(i);
+        }
+        return name;
+    }
+
+    // the block instructions are currently appended to
+    BasicBlock& current()
+    {
+        return m_blocks.back();
+    }
+
+    Instruction& append(Instruction instr)
+    {
+        current().instructions.push_back(instr);
+        return current().instructions.back();
+    }
+
+    std::vector<BasicBlock>& blocks()
+    {
+        return m_blocks;
+    }
+
+    std::vector<Value*>& params()
+    {
+        return m_params;
+    }
+
+    // number of instructions, as a size estimate
+    size_t size()
+    {
+        size_t count = 0;
+        for( auto &block : m_blocks )
+        {
+            count += block.instructions.size();
+        }
+        return count;
+    }
+
+private:
+    std::vector<std::unique_ptr<Value>> m_values;
+    std::vector<Value*> m_params;
+    std::vector<BasicBlock> m_blocks;
+    std::map<std::string, size_t> m_block_names;
+};
+
+} // namespace jitbox
@@ -0,0 +1,531 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "coretypes.h"
+#include "ir.h"
+
+namespace jitbox
+{
+
+// A counted loop, for( iv = start; iv < end; iv += step ), recorded in
+//  rotated form so each iteration only takes one branch:
+//
+//  preheader:  iv = start; <hoisted code>; if !(iv < end) goto exit
+//  body:       ... (LoopHeader, so it gets aligned)
+//  latch:      iv += step; if iv < end goto body
+//  exit:
+//
+// Once the body is closed, invariant computations are hoisted into the
+//  preheader and multiplies/shifts of the induction variable are replaced by
+//  values stepped alongside it (so base + i*stride becomes a pointer bumped
+//  by stride). The body can also be unrolled; the unrolled loop runs while a
+//  full set of iterations remains and a copy of the original loop finishes
+//  the rest.
+class Loop
+{
+public:
+    Loop(FunctionIR &ir, Value* start, Value* end, Value* step, u32 unroll)
+        : m_ir(ir), m_end(end), m_step(step), m_unroll_span(nullptr), m_unroll(unroll)
+    {
+        assert(unroll >= 1);
+        if( step->is_constant() )
+        {
+            assert(step->get_constant() > 0 && "Loop step has to be positive");
+        }
+
+        m_label = ir.unique_block_name("loop");
+        m_iv = ir.new_value(m_label + ".iv", start->value_type);
+        m_iv->set_mutable(true);
+
+        m_preheader = ir.blocks().size() - 1;
+        Instruction init(Opcode::Copy);
+        init.dest = m_iv;
+        init.operands.push_back(start);
+        ir.append(init);
+        m_insert_at = ir.current().instructions.size();
+
+        if( unroll > 1 )
+        {
+            // the unrolled loop runs while (unroll-1)*step more steps stay
+            //  below end
+            m_unroll_span = ir.new_value("", step->value_type);
+            if( step->is_constant() )
+            {
+                Instruction span_init(Opcode::Const);
+                span_init.dest = m_unroll_span;
+                span_init.imm = (unroll - 1)*step->get_constant();
+                m_unroll_span->set_constant(span_init.imm);
+                ir.append(span_init);
+            }
+            else
+            {
+                Value* count = ir.new_value("", step->value_type);
+                count->set_constant(unroll - 1);
+                Instruction count_init(Opcode::Const);
+                count_init.dest = count;
+                count_init.imm = unroll - 1;
+                ir.append(count_init);
+                ir.append(binary(Opcode::Mul, m_unroll_span, step, count));
+            }
+            emit_test(m_unroll_span, Opcode::BranchIfNot, m_label + ".rem");
+        }
+        else
+        {
+            emit_test(nullptr, Opcode::BranchIfNot, m_label + ".exit");
+        }
+
+        m_body = ir.new_block(m_label, BlockFlag::LoopHeader);
+    }
+
+    Value* get_induction_variable()
+    {
+        return m_iv;
+    }
+
+    // optimize the body recorded since the constructor and emit the latch,
+    //  remainder loop and exit block
+    void close()
+    {
+        hoist_invariants();
+        reduce_strength();
+
+        // steps taken at the end of each iteration. stepped values that
+        //  were folded into others don't need updating.
+        std::vector<std::pair<Value*, Value*>> steps;
+        steps.push_back(std::make_pair(m_iv, m_step));
+        for( auto &induction : m_inductions )
+        {
+            if( used_in_loop(induction.first) )
+            {
+                steps.push_back(induction);
+            }
+            else
+            {
+                // only the initial value is left, which isn't carried
+                //  around the loop
+                induction.first->set_mutable(false);
+            }
+        }
+
+        size_t body_end = m_ir.blocks().size();
+        if( m_unroll == 1 )
+        {
+            m_ir.new_block(m_label + ".latch", 0);
+            emit_steps(steps);
+            emit_test(nullptr, Opcode::BranchIf, m_label);
+            m_ir.new_block(m_label + ".exit", 0);
+            return;
+        }
+
+        std::set<Value*> defs = defined_in_loop();
+        assert(!defs.count(m_end) && !defs.count(m_step) &&
+               "Unrolled loops need an invariant end and step");
+
+        for( u32 copy = 1; copy < m_unroll; ++copy )
+        {
+            m_ir.new_block(m_ir.unique_block_name(m_label + ".step"), 0);
+            emit_steps(steps);
+            clone_blocks(m_body, body_end, ".u" + std::to_string(copy), false);
+        }
+        m_ir.new_block(m_label + ".latch", 0);
+        emit_steps(steps);
+        emit_test(m_unroll_span, Opcode::BranchIf, m_label);
+
+        // remaining iterations, one at a time
+        m_ir.new_block(m_label + ".rem", 0);
+        emit_test(nullptr, Opcode::BranchIfNot, m_label + ".exit");
+        std::string remainder = clone_blocks(m_body, body_end, ".rem", true);
+        m_ir.new_block(m_label + ".rem.latch", 0);
+        emit_steps(steps);
+        emit_test(nullptr, Opcode::BranchIf, remainder);
+
+        m_ir.new_block(m_label + ".exit", 0);
+    }
+
+private:
+    static Instruction binary(Opcode op, Value* dest, Value* lhs, Value* rhs)
+    {
+        Instruction instr(op);
+        instr.dest = dest;
+        instr.operands.push_back(lhs);
+        instr.operands.push_back(rhs);
+        return instr;
+    }
+
+    // branch on iv < end, or with `span` on iv + span < end. that is tested
+    //  as iv < end && end - iv > span, as iv + span can overflow near the top
+    //  of the type's range. (a signed end - iv too large for the type just
+    //  leaves the rest to the remainder loop.)
+    void emit_test(Value* span, Opcode branch, std::string label)
+    {
+        Value* in_range = m_ir.new_value("", ValueType::u8);
+        Instruction test = binary(Opcode::Cmp, in_range, m_iv, m_end);
+        test.cond = Condition::Less;
+        m_ir.append(test);
+
+        if( span )
+        {
+            Value* left = m_ir.new_value("", m_iv->value_type);
+            m_ir.append(binary(Opcode::Sub, left, m_end, m_iv));
+            Value* room = m_ir.new_value("", ValueType::u8);
+            Instruction room_test = binary(Opcode::Cmp, room, left, span);
+            room_test.cond = Condition::Greater;
+            m_ir.append(room_test);
+            Value* both = m_ir.new_value("", ValueType::u8);
+            m_ir.append(binary(Opcode::And, both, in_range, room));
+            in_range = both;
+        }
+
+        Instruction jump(branch);
+        jump.operands.push_back(in_range);
+        jump.label = label;
+        m_ir.append(jump);
+    }
+
+    void emit_steps(const std::vector<std::pair<Value*, Value*>> &steps)
+    {
+        for( auto &step : steps )
+        {
+            m_ir.append(binary(Opcode::Add, step.first, step.first, step.second));
+        }
+    }
+
+    // place `instr` in the preheader, after the code hoisted so far
+    void hoist(const Instruction &instr)
+    {
+        std::vector<Instruction> &preheader = m_ir.blocks()[m_preheader].instructions;
+        preheader.insert(preheader.begin() + m_insert_at, instr);
+        ++m_insert_at;
+    }
+
+    // values the loop changes. the steps in the latch aren't recorded yet,
+    //  so stepped values are added explicitly.
+    std::set<Value*> defined_in_loop()
+    {
+        std::set<Value*> defs;
+        defs.insert(m_iv);
+        for( auto &induction : m_inductions )
+        {
+            defs.insert(induction.first);
+        }
+        std::vector<BasicBlock> &blocks = m_ir.blocks();
+        for( size_t b = m_body; b < blocks.size(); ++b )
+        {
+            for( auto &instr : blocks[b].instructions )
+            {
+                if( instr.dest )
+                {
+                    defs.insert(instr.dest);
+                }
+            }
+        }
+        return defs;
+    }
+
+    bool assigned_in_loop(Value* value)
+    {
+        std::vector<BasicBlock> &blocks = m_ir.blocks();
+        for( size_t b = m_body; b < blocks.size(); ++b )
+        {
+            for( auto &instr : blocks[b].instructions )
+            {
+                if( instr.dest == value )
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool used_in_loop(Value* value)
+    {
+        std::vector<BasicBlock> &blocks = m_ir.blocks();
+        for( size_t b = m_body; b < blocks.size(); ++b )
+        {
+            for( auto &instr : blocks[b].instructions )
+            {
+                for( auto operand : instr.operands )
+                {
+                    if( operand == value )
+                    {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    // move computations that don't depend on anything the loop changes into
+    //  the preheader. only instructions that can't fault are moved, since the
+    //  body might not run them at all.
+    void hoist_invariants()
+    {
+        std::set<Value*> defs = defined_in_loop();
+        std::vector<BasicBlock> &blocks = m_ir.blocks();
+        bool changed = true;
+        while( changed )
+        {
+            changed = false;
+            for( size_t b = m_body; b < blocks.size(); ++b )
+            {
+                std::vector<Instruction> &instructions = blocks[b].instructions;
+                for( size_t i = 0; i < instructions.size(); )
+                {
+                    Instruction &instr = instructions[i];
+                    bool invariant = is_speculatable(instr.op) && instr.dest &&
+                                     !instr.dest->is_mutable();
+                    for( auto operand : instr.operands )
+                    {
+                        invariant = invariant && !defs.count(operand);
+                    }
+                    if( !invariant )
+                    {
+                        ++i;
+                        continue;
+                    }
+
+                    defs.erase(instr.dest);
+                    hoist(instr);
+                    instructions.erase(instructions.begin() + i);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // value computed in the preheader from values that are invariant, or
+    //  hold their initial value there
+    Value* hoist_value(Opcode op, Value* lhs, Value* rhs)
+    {
+        if( op == Opcode::Mul && lhs->is_constant() && lhs->get_constant() == 1 )
+        {
+            return rhs;
+        }
+        if( op == Opcode::Mul && rhs->is_constant() && rhs->get_constant() == 1 )
+        {
+            return lhs;
+        }
+
+        Value* dest = m_ir.new_value("", lhs->value_type);
+        if( lhs->is_constant() && rhs->is_constant() )
+        {
+            // typically a constant step, which can then be an immediate
+            Instruction fold(Opcode::Const);
+            fold.dest = dest;
+            fold.imm = op == Opcode::Mul ? lhs->get_constant()*rhs->get_constant()
+                                         : lhs->get_constant() << rhs->get_constant();
+            dest->set_constant(fold.imm);
+            hoist(fold);
+            return dest;
+        }
+
+        hoist(binary(op, dest, lhs, rhs));
+        return dest;
+    }
+
+    // replace linear functions of the induction variable (iv*c, iv<<c, and
+    //  base+x of those) by values initialized in the preheader and stepped
+    //  in the latch
+    void reduce_strength()
+    {
+        std::set<Value*> defs = defined_in_loop();
+        if( assigned_in_loop(m_iv) || defs.count(m_step) )
+        {
+            // the body changes the iteration itself
+            return;
+        }
+
+        // stepped value -> step
+        std::map<Value*, Value*> steps;
+        steps[m_iv] = m_step;
+        std::map<Value*, Value*> renames;
+        std::vector<BasicBlock> &blocks = m_ir.blocks();
+        for( size_t b = m_body; b < blocks.size(); ++b )
+        {
+            std::vector<Instruction> &instructions = blocks[b].instructions;
+            for( size_t i = 0; i < instructions.size(); )
+            {
+                Instruction &instr = instructions[i];
+                rename_operands(instr, renames);
+
+                Value* step = nullptr;
+                if( instr.dest && !instr.dest->is_mutable() && instr.operands.size() == 2 )
+                {
+                    step = derived_step(instr, steps, defs);
+                }
+                if( !step )
+                {
+                    ++i;
+                    continue;
+                }
+
+                // the initial value is the same operation on the initial
+                //  values, which the operands hold in the preheader
+                Value* stepped = m_ir.new_value(instr.dest->name, instr.dest->value_type);
+                stepped->set_mutable(true);
+                Instruction init = instr;
+                init.dest = stepped;
+                hoist(init);
+
+                steps[stepped] = step;
+                m_inductions.push_back(std::make_pair(stepped, step));
+                renames[instr.dest] = stepped;
+                defs.insert(stepped);
+                instructions.erase(instructions.begin() + i);
+            }
+        }
+
+        for( size_t b = m_body; b < blocks.size(); ++b )
+        {
+            for( auto &instr : blocks[b].instructions )
+            {
+                rename_operands(instr, renames);
+            }
+        }
+    }
+
+    // step of `instr`'s result if it is a linear function of a stepped
+    //  value, otherwise nullptr
+    Value* derived_step(Instruction &instr, std::map<Value*, Value*> &steps,
+                        std::set<Value*> &defs)
+    {
+        Value* lhs = instr.operands[0];
+        Value* rhs = instr.operands[1];
+        bool lhs_stepped = steps.count(lhs) != 0;
+        bool rhs_stepped = steps.count(rhs) != 0;
+        bool lhs_invariant = !defs.count(lhs);
+        bool rhs_invariant = !defs.count(rhs);
+
+        switch( instr.op )
+        {
+            case Opcode::Mul:
+                if( lhs_stepped && rhs_invariant )
+                {
+                    return hoist_value(Opcode::Mul, steps[lhs], rhs);
+                }
+                if( rhs_stepped && lhs_invariant )
+                {
+                    return hoist_value(Opcode::Mul, lhs, steps[rhs]);
+                }
+                break;
+            case Opcode::Shl:
+                if( lhs_stepped && rhs_invariant )
+                {
+                    return hoist_value(Opcode::Shl, steps[lhs], rhs);
+                }
+                break;
+            // stepped values no longer used in the body once everything
+            //  derived from them is stepped itself are dropped again
+            case Opcode::Add:
+                if( lhs_stepped && rhs_invariant )
+                {
+                    return steps[lhs];
+                }
+                if( rhs_stepped && lhs_invariant )
+                {
+                    return steps[rhs];
+                }
+                break;
+            case Opcode::Sub:
+                if( lhs_stepped && rhs_invariant )
+                {
+                    return steps[lhs];
+                }
+                break;
+            default:
+                break;
+        }
+
+        return nullptr;
+    }
+
+    static void rename_operands(Instruction &instr, std::map<Value*, Value*> &renames)
+    {
+        for( auto &operand : instr.operands )
+        {
+            auto it = renames.find(operand);
+            if( it != renames.end() )
+            {
+                operand = it->second;
+            }
+        }
+    }
+
+    // append a copy of blocks [first, last). labels get `suffix`, and values
+    //  defined in the copy are replaced by new ones; mutable values are
+    //  shared with the original. returns the label of the first block.
+    std::string clone_blocks(size_t first, size_t last, std::string suffix, bool loop_header)
+    {
+        std::map<std::string, std::string> labels;
+        std::map<Value*, Value*> values;
+        for( size_t b = first; b < last; ++b )
+        {
+            BasicBlock &block = m_ir.blocks()[b];
+            labels[block.name] = m_ir.unique_block_name(block.name + suffix);
+            for( auto &instr : block.instructions )
+            {
+                Value* dest = instr.dest;
+                if( dest && !dest->is_mutable() && !values.count(dest) )
+                {
+                    Value* copy = m_ir.new_value(dest->name, dest->value_type);
+                    if( dest->is_constant() )
+                    {
+                        copy->set_constant(dest->get_constant());
+                    }
+                    values[dest] = copy;
+                }
+            }
+        }
+
+        for( size_t b = first; b < last; ++b )
+        {
+            // copied, as adding blocks moves the originals
+            BasicBlock block = m_ir.blocks()[b];
+            u32 flags = block.flags;
+            if( b == first && !loop_header )
+            {
+                flags &= ~BlockFlag::LoopHeader;
+            }
+            m_ir.new_block(labels[block.name], flags);
+
+            for( auto instr : block.instructions )
+            {
+                if( instr.dest && values.count(instr.dest) )
+                {
+                    instr.dest = values[instr.dest];
+                }
+                rename_operands(instr, values);
+                if( labels.count(instr.label) )
+                {
+                    instr.label = labels[instr.label];
+                }
+                m_ir.append(instr);
+            }
+        }
+
+        return labels[m_ir.blocks()[first].name];
+    }
+
+    FunctionIR &m_ir;
+    std::string m_label;
+    Value* m_iv;
+    Value* m_end;
+    Value* m_step;
+    // (unroll-1)*step, for the unrolled loop's exit test
+    Value* m_unroll_span;
+    u32 m_unroll;
+    size_t m_preheader;
+    // where hoisted code goes in the preheader
+    size_t m_insert_at;
+    // first block of the body
+    size_t m_body;
+    // values stepped alongside the induction variable, with their steps
+    std::vector<std::pair<Value*, Value*>> m_inductions;
+};
+
+} // namespace jitbox
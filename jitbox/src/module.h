@@ -2,9 +2,20 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <mutex>
 
 #include "coretypes.h"
+#include "batch.h"
+#include "bytecodegen.h"
+#include "codeheap.h"
+#include "cpufeatures.h"
 #include "function.h"
+#include "inliner.h"
+#include "trampoline.h"
 #include "x64codegen.h"
 
 namespace jitbox
@@ -13,28 +24,221 @@ namespace jitbox
 namespace JitOption
 {
     const u32 DUMP_ASM = 1 << 0;
+    // back the code heap with 2MB pages where the system allows it
+    const u32 HUGE_PAGES = 1 << 1;
+    // count block executions, see Function::get_block_count
+    const u32 PROFILE = 1 << 2;
+    // functions can be created, built, compiled and released by several
+    //  threads at once, each building its own functions and compiling them
+    //  with compile(Function*). release_function() only sees the calls of
+    //  compiled functions then. set before other threads use the module.
+    const u32 THREAD_SAFE = 1 << 3;
+    // emit bytecode run by an interpreter instead of native code (see
+    //  BytecodeGenerator). functions are called with Function::run().
+    //  set before creating functions.
+    const u32 INTERPRET = 1 << 4;
 }
 
 class Module
 {
 public:
-    Module(std::string name) : m_name(name), m_options(0)
+    Module(std::string name)
+        : m_trampolines(&m_code_heap), m_name(name), m_options(0),
+          m_function_alignment(16), m_loop_alignment(16),
+          m_cpu_features(detect_cpu_features()),
+          m_inline_max_size(16), m_inline_hot_call_count(0)
     {
     }
 
     Function* new_function(std::string name, ValueType return_type)
     {
-        m_jitters.emplace_back(new X64CodeGenerator(m_options & JitOption::DUMP_ASM));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( m_options & JitOption::INTERPRET )
+        {
+            m_jitters.emplace_back(new BytecodeGenerator(&m_code_heap,
+                                                         m_options & JitOption::DUMP_ASM));
+        }
+        else
+        {
+            m_jitters.emplace_back(new X64CodeGenerator(&m_code_heap,
+                                                        m_options & JitOption::DUMP_ASM));
+        }
+        m_jitters.back()->set_profiling(m_options & JitOption::PROFILE);
+        m_jitters.back()->set_alignment(m_function_alignment, m_loop_alignment);
+        m_jitters.back()->set_cpu_features(m_cpu_features);
         m_functions.emplace_back(new Function(name, return_type, m_jitters.back().get()));
         return m_functions.back().get();
     }
 
-    void compile()
+    // a function running `element` over rows of columnar data; compiled
+    //  along with the rest of the module, then run by run_batch_kernel() or
+    //  split across threads by a BatchRunner (native code can also be called
+    //  through BatchKernel directly). element is inlined into the loop over
+    //  the rows; values its body can't keep in the registers the loop leaves
+    //  are spilled to the stack.
+    Function* new_batch_kernel(std::string name, Function* element, u32 unroll = 1)
+    {
+        FunctionIR &element_ir = element->get_ir();
+        assert(element->get_return_type() != ValueType::none);
+        assert(element_ir.params().size() <= 6 && "Batch kernels take at most 6 columns");
+        element->set_always_inline(true);
+
+        Function* kernel = new_function(name, ValueType::none);
+        Value* columns = kernel->new_param("columns", ValueType::pointer);
+        Value* output = kernel->new_param("output", ValueType::pointer);
+        Value* begin = kernel->new_param("begin", ValueType::i64);
+        Value* end = kernel->new_param("end", ValueType::i64);
+
+        // the rows are counted up from begin - end to 0, addressed from the
+        //  end of each column. that leaves one pointer per column and the
+        //  counter live in the loop; the params are dead after entry.
+        kernel->begin_block("entry");
+        std::vector<Value*> column_ends;
+        for( size_t c = 0; c < element_ir.params().size(); ++c )
+        {
+            Value* offset = kernel->new_constant(ValueType::i64, c * sizeof(void*));
+            Value* column = kernel->load(kernel->add(columns, offset), ValueType::pointer);
+            column_ends.push_back(element_address(kernel, column, end,
+                                                  element_ir.params()[c]->value_type));
+        }
+        Value* output_end = element_address(kernel, output, end, element->get_return_type());
+
+        Value* zero = kernel->new_constant(ValueType::i64, 0);
+        Value* one = kernel->new_constant(ValueType::i64, 1);
+        Value* row = kernel->begin_loop(kernel->sub(begin, end), zero, one, unroll);
+            std::vector<Value*> args;
+            for( size_t c = 0; c < column_ends.size(); ++c )
+            {
+                ValueType type = element_ir.params()[c]->value_type;
+                args.push_back(kernel->load(element_address(kernel, column_ends[c], row, type),
+                                            type));
+            }
+            Value* result = kernel->call(element, args);
+            kernel->store(element_address(kernel, output_end, row, result->value_type), result);
+        kernel->end_loop();
+        kernel->end_block_with_return();
+
+        return kernel;
+    }
+
+    // compile every function of the module. no other thread may be
+    //  building functions meanwhile. false if some function couldn't be
+    //  compiled (see Function::finalize); neither it nor its callers may
+    //  be run then.
+    bool compile()
+    {
+        std::vector<Function*> functions;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for( auto &func : m_functions )
+            {
+                functions.push_back(func.get());
+            }
+        }
+        return compile(functions);
+    }
+
+    // compile `func` and the functions it calls, which have to be completely
+    //  built. with JitOption::THREAD_SAFE, threads can compile the functions
+    //  they built while others are still building theirs.
+    bool compile(Function* func)
+    {
+        return compile(std::vector<Function*>(1, func));
+    }
+
+    // drop a function. the Function* is invalid afterwards; its code space
+    //  is retired and reused after the next reclaim(). functions still
+    //  calling it (rather than an inlined copy) have to be released first.
+    //  false, releasing nothing, if other functions still call it or it
+    //  isn't a function of this module.
+    bool release_function(Function* func)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t index = m_functions.size();
+        for( size_t i = 0; i < m_functions.size(); ++i )
+        {
+            Function* caller = m_functions[i].get();
+            if( caller == func )
+            {
+                index = i;
+            }
+            else if( still_calls(caller, func) )
+            {
+                return false;
+            }
+        }
+        if( index == m_functions.size() )
+        {
+            return false;
+        }
+
+        m_callees.erase(func);
+        m_functions.erase(m_functions.begin() + index);
+        m_jitters.erase(m_jitters.begin() + index);
+        return true;
+    }
+
+    // called by reclaim() before any retired code is reused. should block
+    //  until no thread can still be executing code of released functions
+    //  (e.g. wait for every worker to pass a quiescent point).
+    void set_quiescence_callback(std::function<void()> wait_for_quiescence)
+    {
+        m_wait_for_quiescence = wait_for_quiescence;
+    }
+
+    // return code space of released functions to the code heap. without a
+    //  quiescence callback, the caller guarantees no thread is still in it.
+    void reclaim()
     {
-        for( auto &func : m_functions )
+        if( m_wait_for_quiescence )
         {
-            func.get()->finalize();
+            m_wait_for_quiescence();
         }
+        m_code_heap.reclaim();
+    }
+
+    // byte alignment (power of two, e.g. 16/32/64) of function entries and
+    //  of loop header blocks, for functions created from now on
+    void set_code_alignment(u32 function_alignment, u32 loop_alignment)
+    {
+        m_function_alignment = function_alignment;
+        m_loop_alignment = loop_alignment;
+    }
+
+    // calls to functions of up to `max_size` IR instructions are inlined by
+    //  compile(), as are calls to functions with a call count (see
+    //  Function::set_call_count) of at least `hot_call_count`, if non-zero.
+    //  set_inline_limits(0, 0) disables inlining.
+    void set_inline_limits(size_t max_size, u64 hot_call_count)
+    {
+        m_inline_max_size = max_size;
+        m_inline_hot_call_count = hot_call_count;
+    }
+
+    // instruction set extensions (CpuFeature) generated code may use, for
+    //  functions created from now on. defaults to what the host supports;
+    //  override e.g. with CpuFeature::Baseline for reproducible code.
+    //  features the host lacks are left out.
+    void set_cpu_features(u32 features)
+    {
+        m_cpu_features = features & detect_cpu_features();
+    }
+
+    u32 get_cpu_features()
+    {
+        return m_cpu_features;
+    }
+
+    // trampoline for calling native functions of the given signature with
+    //  arguments in an array, e.g.:
+    //    Trampoline call = module.get_trampoline(Signature(ValueType::f64,
+    //                                            { ValueType::f64, ValueType::i32 }));
+    //    u64 args[2] = ...; u64 result;
+    //    call((void*)&ldexp, args, &result);
+    //  null if the code couldn't be written to the code heap.
+    Trampoline get_trampoline(const Signature &signature)
+    {
+        return m_trampolines.get(signature, m_options & JitOption::DUMP_ASM);
     }
 
     void set_option(u32 option, bool should_set)
@@ -47,13 +251,160 @@ public:
         {
             m_options &= ~option;
         }
+        if( option & JitOption::THREAD_SAFE )
+        {
+            m_code_heap.set_thread_safe(should_set);
+        }
     }
 
 private:
+    bool compile(const std::vector<Function*> &functions)
+    {
+        m_code_heap.set_huge_pages(m_options & JitOption::HUGE_PAGES);
+
+        // callees before their callers, so inlined callees are already
+        //  optimized and calls to compiled functions can be direct
+        std::vector<Function*> order = callees_first(functions);
+        Inliner inliner(m_inline_max_size, m_inline_hot_call_count);
+        for( auto func : order )
+        {
+            std::lock_guard<std::mutex> lock(func->get_mutex());
+            if( !func->is_finalized() && !func->are_calls_inlined() )
+            {
+                inliner.run(func);
+                func->set_calls_inlined();
+            }
+        }
+
+        // hot functions first, so they land next to each other
+        for( auto func : order )
+        {
+            if( func->is_hot() )
+            {
+                func->finalize();
+            }
+        }
+        bool compiled = true;
+        for( auto func : order )
+        {
+            if( func->finalize() )
+            {
+                record_callees(func);
+            }
+            else
+            {
+                compiled = false;
+            }
+        }
+        return compiled;
+    }
+
+    // remember the calls left in a compiled function, whose IR won't change
+    //  any more, for release_function() to check without reading the IR
+    //  of functions other threads may be building
+    void record_callees(Function* func)
+    {
+        std::vector<Function*> callees;
+        for( auto &block : func->get_ir().blocks() )
+        {
+            for( auto &instr : block.instructions )
+            {
+                if( instr.op == Opcode::Call )
+                {
+                    callees.push_back(instr.callee);
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_callees[func] = callees;
+    }
+
+    // `caller` calls `callee` as far as release_function() can tell. with
+    //  JitOption::THREAD_SAFE, functions not compiled yet may be being
+    //  built by another thread, so only calls of compiled ones are known.
+    bool still_calls(Function* caller, Function* callee)
+    {
+        auto recorded = m_callees.find(caller);
+        if( recorded != m_callees.end() )
+        {
+            const std::vector<Function*> &callees = recorded->second;
+            return std::find(callees.begin(), callees.end(), callee) != callees.end();
+        }
+        return !(m_options & JitOption::THREAD_SAFE) && calls(caller, callee);
+    }
+
+    // &column[row], for columns of `type`
+    static Value* element_address(Function* func, Value* column, Value* row, ValueType type)
+    {
+        Value* size = func->new_constant(ValueType::i64, value_type_size(type));
+        return func->add(column, func->mul(row, size));
+    }
+
+    static bool calls(Function* caller, Function* callee)
+    {
+        for( auto &block : caller->get_ir().blocks() )
+        {
+            for( auto &instr : block.instructions )
+            {
+                if( instr.op == Opcode::Call && instr.callee == callee )
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // `functions` and everything they call, in post order over the call
+    //  graph
+    std::vector<Function*> callees_first(const std::vector<Function*> &functions)
+    {
+        std::vector<Function*> order;
+        std::set<Function*> visited;
+        for( auto func : functions )
+        {
+            visit(func, visited, order);
+        }
+        return order;
+    }
+
+    void visit(Function* func, std::set<Function*> &visited, std::vector<Function*> &order)
+    {
+        if( !visited.insert(func).second )
+        {
+            return;
+        }
+        for( auto &block : func->get_ir().blocks() )
+        {
+            for( auto &instr : block.instructions )
+            {
+                if( instr.op == Opcode::Call )
+                {
+                    visit(instr.callee, visited, order);
+                }
+            }
+        }
+        order.push_back(func);
+    }
+
+    // declared first so it outlives the code generators placing code in it
+    CodeHeap m_code_heap;
+    TrampolineCache m_trampolines;
+    // guards m_functions, m_jitters and m_callees
+    std::mutex m_mutex;
     std::vector<std::unique_ptr<Function>> m_functions;
     std::vector<std::unique_ptr<CodeGenerator>> m_jitters;
+    // calls left in each compiled function, see record_callees()
+    std::map<Function*, std::vector<Function*>> m_callees;
+    std::function<void()> m_wait_for_quiescence;
     std::string m_name;
     u32 m_options;
+    u32 m_function_alignment;
+    u32 m_loop_alignment;
+    u32 m_cpu_features;
+    size_t m_inline_max_size;
+    u64 m_inline_hot_call_count;
 };
 
 } // namespace jitbox
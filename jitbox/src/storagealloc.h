@@ -1,116 +1,568 @@
 #pragma once
 #include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
 #include "coretypes.h"
+#include "ir.h"
 
 namespace jitbox
 {
 
-// Allocates storage (register/stack) for a Value
+// Allocates storage (registers) for the values of a function.
+// Live intervals are taken over the linear instruction order and widened
+//  across loop back edges, then registers are handed out by linear scan.
+//  values that don't fit are spilled to stack slots: each definition is
+//  stored to the slot and each use reloads it into a short lived value,
+//  and the allocation is repeated with those.
 class StorageAllocator
 {
 public:
     StorageAllocator()
+        : m_spill_slots(0)
     {
     }
 
     void set_registers(const std::vector<Register> &registers)
     {
         m_registers = registers;
-        m_reg_allocations.resize(registers.size(), nullptr);
     }
 
-    Value* alloc_value(std::string name, ValueType type, u16 flag)
+    // assign a register or stack slot to every value used in `blocks`, a
+    //  copy of the blocks of `ir`, adding Spill and Reload instructions
+    //  there for the latter. false if some point of the function needs more
+    //  registers than there are, even with everything else spilled.
+    bool allocate(FunctionIR &ir, std::vector<BasicBlock> &blocks)
     {
-        Value* value = nullptr;
-        // TODO: handle spill
-        for( auto reg : m_registers )
+        m_spill_slots = 0;
+        m_reloaded.clear();
+        while( true )
         {
-            if( (reg.flags & flag) &&
-                m_reg_allocations[reg.idx] == nullptr )
+            compute_intervals(ir, blocks);
+            std::vector<Value*> spilled;
+            if( !assign_registers(ir, spilled) )
+            {
+                return false;
+            }
+            if( spilled.empty() )
             {
-                m_values.emplace_back(new Value(name, type));
-                value = m_values.back().get();
-                m_reg_allocations[reg.idx] = value;
-                value->set_register(reg);
-                break;
+                return true;
+            }
+            for( auto value : spilled )
+            {
+                spill(ir, blocks, value);
             }
         }
+    }
 
-        return value;
+    // 8 byte stack slots holding spilled values
+    size_t get_spill_slots()
+    {
+        return m_spill_slots;
     }
 
-    // TODO: need to track evictions for codegen to push to stack
-    Value* alloc_local(std::string name, ValueType type)
+    // registers a call at `position` clobbers while they hold live values
+    std::vector<Register> get_clobbered_across(size_t position)
     {
-        return alloc_value(name, type, RegisterFlag::GeneralPurpose);
+        std::vector<Register> registers;
+        for( auto &interval : m_intervals )
+        {
+            Register reg = interval.value->get_register();
+            if( interval.start < position && interval.end > position &&
+                !(reg.flags & RegisterFlag::Preserved) &&
+                !contains(registers, reg) )
+            {
+                registers.push_back(reg);
+            }
+        }
+        std::sort(registers.begin(), registers.end(), by_idx);
+        return registers;
     }
 
-    Value* alloc_temp(ValueType type)
+    // callee saved registers in use, which the function has to preserve
+    std::vector<Register> get_used_preserved()
     {
-        Value* value = nullptr;
-        std::string name = "$temp";
-        for( auto reg : m_registers )
+        std::vector<Register> registers;
+        for( auto &interval : m_intervals )
         {
-            if( reg.flags & RegisterFlag::Temp )
+            Register reg = interval.value->get_register();
+            if( (reg.flags & RegisterFlag::Preserved) && !contains(registers, reg) )
             {
-                if( m_reg_allocations[reg.idx] == nullptr )
+                registers.push_back(reg);
+            }
+        }
+        std::sort(registers.begin(), registers.end(), by_idx);
+        return registers;
+    }
+
+    bool has_calls()
+    {
+        return !m_call_positions.empty();
+    }
+
+    // (dest, src) moves needed on entry, for parameters that arrive in
+    //  registers not available for allocation
+    std::vector<std::pair<Register, Register>> get_param_moves()
+    {
+        return m_param_moves;
+    }
+
+private:
+    struct Interval
+    {
+        Value* value;
+        size_t start;
+        size_t end;
+        size_t first_def;
+        size_t first_use;
+        size_t def_count;
+        bool has_use;
+    };
+
+    static bool by_idx(const Register &a, const Register &b)
+    {
+        return a.idx < b.idx;
+    }
+
+    static bool contains(const std::vector<Register> &registers, Register reg)
+    {
+        for( auto &r : registers )
+        {
+            if( r.idx == reg.idx )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void touch(std::map<Value*, size_t> &index, Value* value, size_t position, bool is_def)
+    {
+        // spill slots aren't allocated
+        if( value->get_storage_type() == StorageType::Stack )
+        {
+            return;
+        }
+
+        auto it = index.find(value);
+        if( it == index.end() )
+        {
+            Interval interval;
+            interval.value = value;
+            interval.start = position;
+            interval.end = position;
+            interval.first_def = 0;
+            interval.first_use = 0;
+            interval.def_count = 0;
+            interval.has_use = false;
+            index[value] = m_intervals.size();
+            m_intervals.push_back(interval);
+            it = index.find(value);
+        }
+
+        Interval &interval = m_intervals[it->second];
+        interval.start = std::min(interval.start, position);
+        interval.end = std::max(interval.end, position);
+        if( is_def )
+        {
+            if( interval.def_count++ == 0 )
+            {
+                interval.first_def = position;
+            }
+        }
+        else if( !interval.has_use )
+        {
+            interval.has_use = true;
+            interval.first_use = position;
+        }
+    }
+
+    // values that may carry a value around a back edge rather than just
+    //  being computed and used within one iteration
+    static bool carried_by_loops(const Interval &interval)
+    {
+        bool used_before_def = interval.has_use && interval.first_use <= interval.first_def;
+        if( interval.value->is_assigned_before_use() )
+        {
+            return used_before_def;
+        }
+        return interval.value->is_mutable() || interval.def_count != 1 || used_before_def;
+    }
+
+    // ops whose code reads lhs before writing dest, so dest can take over
+    //  the register of an lhs that dies there (see also X64CodeGenerator::cmp)
+    static bool can_share_lhs_register(Opcode op)
+    {
+        switch( op )
+        {
+            case Opcode::Copy:
+            case Opcode::Add:
+            case Opcode::Sub:
+            case Opcode::Mul:
+            case Opcode::Div:
+            case Opcode::And:
+            case Opcode::Or:
+            case Opcode::Xor:
+            case Opcode::Not:
+            case Opcode::Shl:
+            case Opcode::Shr:
+            case Opcode::Sar:
+            case Opcode::Cmp:
+            case Opcode::Load:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // params are defined at position 0, instructions numbered from 1
+    void compute_intervals(FunctionIR &ir, std::vector<BasicBlock> &blocks)
+    {
+        m_intervals.clear();
+        m_call_positions.clear();
+        m_shared_lhs.clear();
+        std::map<Value*, size_t> index;
+
+        for( auto param : ir.params() )
+        {
+            touch(index, param, 0, true);
+        }
+
+        // constants only need a register (and their Const instruction) if
+        //  some use can't encode them as an immediate
+        std::set<Value*> needs_register;
+        for( auto &block : blocks )
+        {
+            for( auto &instr : block.instructions )
+            {
+                for( size_t i = 0; i < instr.operands.size(); ++i )
                 {
-                    m_values.emplace_back(new Value(name, type));
-                    value = m_values.back().get();
-                    m_reg_allocations[reg.idx] = value;
-                    value->set_register(reg);
+                    if( !is_immediate_operand(instr, i) )
+                    {
+                        needs_register.insert(instr.operands[i]);
+                    }
                 }
-                else
+            }
+        }
+
+        std::vector<size_t> block_start(blocks.size(), 0);
+        std::vector<std::pair<size_t, std::string>> jumps;
+        size_t position = 1;
+        for( size_t b = 0; b < blocks.size(); ++b )
+        {
+            block_start[b] = position;
+            for( auto &instr : blocks[b].instructions )
+            {
+                for( size_t i = 0; i < instr.operands.size(); ++i )
+                {
+                    // constants that got a register are read from it by
+                    //  every use
+                    if( !is_immediate_operand(instr, i) ||
+                        needs_register.count(instr.operands[i]) )
+                    {
+                        touch(index, instr.operands[i], position, false);
+                    }
+                }
+                if( instr.dest &&
+                    (instr.op != Opcode::Const || needs_register.count(instr.dest)) )
+                {
+                    touch(index, instr.dest, position, true);
+                }
+                if( instr.dest && !instr.operands.empty() && instr.operands[0] != instr.dest &&
+                    can_share_lhs_register(instr.op) && !is_immediate_operand(instr, 0) )
+                {
+                    m_shared_lhs[position] = std::make_pair(instr.dest, instr.operands[0]);
+                }
+                if( instr.op == Opcode::CallNative )
+                {
+                    // arguments are passed through in place
+                    for( auto param : ir.params() )
+                    {
+                        touch(index, param, position, false);
+                    }
+                }
+                if( instr.op == Opcode::CallNative || instr.op == Opcode::Call )
                 {
-                    // fall back to using general purpose register
-                    return alloc_value(name, type, RegisterFlag::GeneralPurpose);
+                    m_call_positions.push_back(position);
                 }
-                break;
+                if( is_branch(instr.op) )
+                {
+                    jumps.push_back(std::make_pair(position, instr.label));
+                }
+                ++position;
             }
         }
 
-        return value;
+        // anything live into a loop, or carried around it, stays live for
+        //  the whole loop. repeat for nested loops.
+        std::vector<std::pair<size_t, size_t>> loops;
+        for( auto &jump : jumps )
+        {
+            size_t target = block_start[ir.find_block(jump.second)];
+            if( target <= jump.first )
+            {
+                loops.push_back(std::make_pair(target, jump.first));
+            }
+        }
+
+        bool changed = true;
+        while( changed )
+        {
+            changed = false;
+            for( auto &loop : loops )
+            {
+                for( auto &interval : m_intervals )
+                {
+                    bool overlaps = interval.start <= loop.second &&
+                                    interval.end >= loop.first;
+                    if( !overlaps ||
+                        (interval.start >= loop.first && !carried_by_loops(interval)) )
+                    {
+                        continue;
+                    }
+                    if( interval.start > loop.first || interval.end < loop.second )
+                    {
+                        interval.start = std::min(interval.start, loop.first);
+                        interval.end = std::max(interval.end, loop.second);
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    bool crosses_call(const Interval &interval)
+    {
+        for( auto position : m_call_positions )
+        {
+            if( interval.start < position && interval.end > position )
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    Value* alloc_return(ValueType type)
+    // params keep their arrival registers, and reloaded values are live
+    //  for a single instruction, so spilling those wouldn't help
+    bool can_spill(Interval* interval, const std::map<Value*, Register> &arriving_in)
     {
-        Value* value = nullptr;
-        std::string name = "$ret";
+        return !arriving_in.count(interval->value) && !m_reloaded.count(interval->value);
+    }
+
+    // false if registers ran out with nothing left to spill. values to
+    //  spill before trying again are added to `spilled`.
+    bool assign_registers(FunctionIR &ir, std::vector<Value*> &spilled)
+    {
+        m_param_moves.clear();
+        std::vector<Interval*> order;
+        for( auto &interval : m_intervals )
+        {
+            order.push_back(&interval);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [](Interval* a, Interval* b) { return a->start < b->start; });
+
+        std::vector<Interval*> active;
+        std::vector<bool> busy(16, false);
+
+        // parameters stay in the register they arrive in, if allocatable
+        std::vector<Register> param_registers;
         for( auto reg : m_registers )
         {
-            if( reg.flags & RegisterFlag::Return )
+            if( reg.flags & RegisterFlag::Parameter )
+            {
+                param_registers.push_back(reg);
+            }
+        }
+        assert(ir.params().size() <= param_registers.size() &&
+               "Stack passed parameters not supported");
+
+        std::map<Value*, Register> arriving_in;
+        std::set<Value*> fixed;
+        for( size_t i = 0; i < ir.params().size(); ++i )
+        {
+            Value* param = ir.params()[i];
+            Register reg = param_registers[i];
+            arriving_in[param] = reg;
+            if( reg.flags & RegisterFlag::GeneralPurpose )
+            {
+                param->set_register(reg);
+                busy[reg.idx] = true;
+                fixed.insert(param);
+            }
+        }
+        for( auto interval : order )
+        {
+            if( fixed.count(interval->value) )
+            {
+                active.push_back(interval);
+            }
+        }
+
+        for( auto interval : order )
+        {
+            Value* value = interval->value;
+            if( fixed.count(value) )
             {
-                if( m_reg_allocations[reg.idx] == nullptr )
+                continue;
+            }
+
+            // an lhs last used by the instruction defining this value is
+            //  done with its register too
+            Value* dying_lhs = nullptr;
+            auto shared = m_shared_lhs.find(interval->start);
+            if( shared != m_shared_lhs.end() && shared->second.first == value )
+            {
+                dying_lhs = shared->second.second;
+            }
+
+            for( size_t i = 0; i < active.size(); )
+            {
+                if( active[i]->end < interval->start ||
+                    (active[i]->end == interval->start && active[i]->value == dying_lhs) )
                 {
-                    m_values.emplace_back(new Value(name, type));
-                    value = m_values.back().get();
-                    m_reg_allocations[reg.idx] = value;
-                    value->set_register(reg);
+                    busy[active[i]->value->get_register().idx] = false;
+                    active.erase(active.begin() + i);
                 }
                 else
                 {
-                    // steal register
-                    // TODO: handle spill
-                    value = m_reg_allocations[reg.idx];
+                    ++i;
                 }
-                break;
             }
-        }
 
-        return value;
+            // values live across a call prefer callee saved registers, the
+            //  rest prefer caller saved ones
+            bool prefer_preserved = crosses_call(*interval);
+            Register chosen;
+            bool found = false;
+            for( int pass = 0; pass < 2 && !found; ++pass )
+            {
+                for( auto reg : m_registers )
+                {
+                    bool preserved = (reg.flags & RegisterFlag::Preserved) != 0;
+                    if( (reg.flags & RegisterFlag::GeneralPurpose) && !busy[reg.idx] &&
+                        (pass == 1 || preserved == prefer_preserved) )
+                    {
+                        chosen = reg;
+                        found = true;
+                        break;
+                    }
+                }
+            }
+            if( !found )
+            {
+                // spill whichever of the live values is needed again last,
+                //  this one or one holding a register
+                Interval* victim = can_spill(interval, arriving_in) ? interval : nullptr;
+                size_t victim_index = active.size();
+                for( size_t i = 0; i < active.size(); ++i )
+                {
+                    if( can_spill(active[i], arriving_in) &&
+                        (!victim || active[i]->end > victim->end) )
+                    {
+                        victim = active[i];
+                        victim_index = i;
+                    }
+                }
+                if( !victim )
+                {
+                    return false;
+                }
+                spilled.push_back(victim->value);
+                if( victim == interval )
+                {
+                    continue;
+                }
+                chosen = victim->value->get_register();
+                active.erase(active.begin() + victim_index);
+            }
+
+            value->set_register(chosen);
+            busy[chosen.idx] = true;
+            active.push_back(interval);
+
+            if( arriving_in.count(value) )
+            {
+                m_param_moves.push_back(std::make_pair(chosen, arriving_in[value]));
+            }
+        }
+        return true;
     }
 
-    Value* alloc_param(std::string name, ValueType type)
+    // move `value` to a new stack slot: definitions write a new value that
+    //  is stored to the slot, and uses read one reloaded just before them.
+    //  constants are rematerialized at each use instead.
+    void spill(FunctionIR &ir, std::vector<BasicBlock> &blocks, Value* value)
     {
-        return alloc_value(name, type, RegisterFlag::Parameter);
+        if( !value->is_constant() )
+        {
+            value->set_stack_offset(m_spill_slots++ * 8);
+        }
+
+        for( auto &block : blocks )
+        {
+            std::vector<Instruction> instructions;
+            for( auto instr : block.instructions )
+            {
+                if( instr.dest == value && value->is_constant() )
+                {
+                    continue;
+                }
+
+                Value* reloaded = nullptr;
+                for( auto &operand : instr.operands )
+                {
+                    if( operand != value )
+                    {
+                        continue;
+                    }
+                    if( !reloaded )
+                    {
+                        reloaded = ir.new_value(value->name, value->value_type);
+                        m_reloaded.insert(reloaded);
+                        Instruction reload(value->is_constant() ? Opcode::Const : Opcode::Reload);
+                        reload.dest = reloaded;
+                        if( value->is_constant() )
+                        {
+                            reloaded->set_constant(value->get_constant());
+                            reload.imm = value->get_constant();
+                        }
+                        else
+                        {
+                            reload.operands.push_back(value);
+                        }
+                        instructions.push_back(reload);
+                    }
+                    operand = reloaded;
+                }
+
+                if( instr.dest != value )
+                {
+                    instructions.push_back(instr);
+                    continue;
+                }
+                instr.dest = ir.new_value(value->name, value->value_type);
+                m_reloaded.insert(instr.dest);
+                instructions.push_back(instr);
+                Instruction store(Opcode::Spill);
+                store.dest = value;
+                store.operands.push_back(instr.dest);
+                instructions.push_back(store);
+            }
+            block.instructions = instructions;
+        }
     }
 
-private:
     std::vector<Register> m_registers;
-    // registers currently reserved by a Value
-    // indexed by register idx
-    std::vector<Value*> m_reg_allocations;
-    std::vector<std::unique_ptr<Value>> m_values;
+    std::vector<Interval> m_intervals;
+    size_t m_spill_slots;
+    // values added by spill(), which are never spilled themselves
+    std::set<Value*> m_reloaded;
+    std::vector<size_t> m_call_positions;
+    std::vector<std::pair<Register, Register>> m_param_moves;
+    // position -> (dest, lhs) of instructions that may share a register
+    std::map<size_t, std::pair<Value*, Value*>> m_shared_lhs;
 };
 
 } // namespace jitbox
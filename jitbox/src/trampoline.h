@@ -0,0 +1,86 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "coretypes.h"
+#include "codeheap.h"
+#include "x64codegen.h"
+
+namespace jitbox
+{
+
+// argument and return types of a native function
+struct Signature
+{
+    Signature(ValueType return_type, const std::vector<ValueType> &params)
+        : return_type(return_type), params(params)
+    {
+    }
+
+    bool operator<(const Signature &other) const
+    {
+        if( return_type != other.return_type )
+        {
+            return return_type < other.return_type;
+        }
+        return params < other.params;
+    }
+
+    ValueType return_type;
+    std::vector<ValueType> params;
+};
+
+// calls `target` with args[i] as its i-th argument, one 8 byte slot per
+//  argument: integers and pointers in the low bits (narrow ones are read at
+//  their width), f32/f64 as their bit patterns. the return value is stored
+//  in *result, integers sign or zero extended to 64 bits and f32 in the low
+//  32 bits. result may be null for functions returning ValueType::none.
+typedef void (*Trampoline)(void* target, const u64* args, u64* result);
+
+// Calls native functions whose signature is only known at run time, through
+//  a trampoline generated for the signature. Trampolines are generated on
+//  first use and kept for later calls with the same signature.
+class TrampolineCache
+{
+public:
+    TrampolineCache(CodeHeap* heap) : m_heap(heap)
+    {
+    }
+
+    // null if the code heap can't be written (see CodeHeap::write)
+    Trampoline get(const Signature &signature, bool dump_asm = false)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_trampolines.find(signature);
+        if( it != m_trampolines.end() )
+        {
+            return (Trampoline)it->second->get_code();
+        }
+
+        X64CodeGenerator* gen = new X64CodeGenerator(m_heap, dump_asm);
+        m_trampolines[signature].reset(gen);
+        gen->trampoline(signature.params, signature.return_type);
+        if( !gen->finalize() )
+        {
+            m_trampolines.erase(signature);
+            return nullptr;
+        }
+        return (Trampoline)gen->get_code();
+    }
+
+    // number of signatures with a trampoline
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_trampolines.size();
+    }
+
+private:
+    CodeHeap* m_heap;
+    std::map<Signature, std::unique_ptr<X64CodeGenerator>> m_trampolines;
+    std::mutex m_mutex;
+};
+
+} // namespace jitbox
@@ -7,7 +7,8 @@ namespace jitbox
 class X64CodeGenerator : public CodeGenerator
 {
 public:
-    X64CodeGenerator(bool dump_asm) : CodeGenerator(dump_asm)
+    X64CodeGenerator(CodeHeap* heap, bool dump_asm)
+        : CodeGenerator(heap, dump_asm), m_frame_pushes(0), m_frame_size(0)
     {
         m_reg_names.push_back("rax");
         m_reg_names.push_back("rcx");
@@ -26,16 +27,22 @@ public:
         m_reg_names.push_back("r14");
         m_reg_names.push_back("r15");
 
-        std::vector<Register> registers =
+        m_storage_alloc.set_registers(registers());
+    }
+
+    // registers of the SysV ABI available to the allocator, in order of
+    //  preference. parameters arrive in the Parameter registers in order.
+    static const std::vector<Register>& registers()
+    {
+        static const std::vector<Register> registers =
         {
              Register(7, RegisterFlag::GeneralPurpose | // rdi
                          RegisterFlag::Parameter),
              Register(6, RegisterFlag::GeneralPurpose | // rsi
                          RegisterFlag::Parameter),
-             // TODO: rdx used for mul/div, commenting out general use
-             //        until register spill is handled properly
-             Register(2, //RegisterFlag::GeneralPurpose | // rdx
-                         RegisterFlag::Parameter),
+             // rdx is taken by div (and moved out of on entry when it
+             //  holds a parameter)
+             Register(2, RegisterFlag::Parameter), // rdx
              Register(1, RegisterFlag::GeneralPurpose | // rcx
                          RegisterFlag::Parameter),
              Register(8, RegisterFlag::GeneralPurpose | // r8
@@ -43,7 +50,8 @@ public:
              Register(9, RegisterFlag::GeneralPurpose | // r9
                          RegisterFlag::Parameter),
              Register(10, RegisterFlag::GeneralPurpose), // r10
-             Register(11, RegisterFlag::GeneralPurpose), // r11
+             // scratch within a single instruction's expansion
+             Register(11, RegisterFlag::Temp), // r11
              Register(12, RegisterFlag::GeneralPurpose | // r12
                           RegisterFlag::Preserved),
              Register(13, RegisterFlag::GeneralPurpose | // r13
@@ -52,14 +60,12 @@ public:
                           RegisterFlag::Preserved),
              Register(15, RegisterFlag::GeneralPurpose | // r15
                           RegisterFlag::Preserved),
-             Register(0, RegisterFlag::GeneralPurpose | // rax
-                         RegisterFlag::Temp |
+             Register(0, RegisterFlag::Temp | // rax
                          RegisterFlag::Return),
              Register(3, RegisterFlag::GeneralPurpose | // rbx
                          RegisterFlag::Preserved),
         };
-
-        m_storage_alloc.set_registers(registers);
+        return registers;
     }
 
     std::string reg2str(Register reg)
@@ -67,15 +73,26 @@ public:
         return m_reg_names[reg.idx];
     }
 
-    void mov(Register reg, i32 value)
+    void mov(Register reg, i64 value)
     {
         if(m_dump_asm)
             std::cout << "  mov " << reg2str(reg) << ", " << value << std::endl;
 
-        u64 instr = 0x48c7c0 + (reg.idx >= 8 ? 0x010000 : 0);
-        u8 offset = reg.idx % 8;
-        EmitInstruction(instr+offset, 3);
-        EmitValue(value, 4);
+        if( value >= INT32_MIN && value <= INT32_MAX )
+        {
+            // sign extended imm32
+            u64 instr = 0x48c7c0 + (reg.idx >= 8 ? 0x010000 : 0);
+            u8 offset = reg.idx % 8;
+            EmitInstruction(instr+offset, 3);
+            EmitValue(value, 4);
+        }
+        else
+        {
+            u64 instr = 0x48b8 + (reg.idx >= 8 ? 0x0100 : 0);
+            u8 offset = reg.idx % 8;
+            EmitInstruction(instr+offset, 2);
+            EmitValue(value, 8);
+        }
     }
 
     void mov(Register dest, Register src)
@@ -111,130 +128,1125 @@ public:
         if(m_dump_asm)
             std::cout << "  call " << address << " ; c function" << std::endl;
 
+        // rel32 operand filled in by finalize(), through a veneer if the
+        //  target is out of range of the code
         EmitInstruction(0xe8, 1);
-        m_addresses_to_patch.push_back(get_offset());
-        EmitValue((u32)(size_t)address, 4);
+        m_call_patches.push_back(CallPatch(get_offset(), address));
+        EmitValue(0, 4);
     }
 
-    // TODO: refactor arithmetic ops to remove redundency
-    Value* imul(Value* lhs, Value* rhs)
+    void call_entry()
     {
-        // no destination passed in, so grab a temp register
-        Value* result = m_storage_alloc.alloc_temp(lhs->value_type);
-        Register src = lhs->get_register();
-        Register dest = result->get_register();
-        mov(dest, src);
+        if(m_dump_asm)
+            std::cout << "  call <entry>" << std::endl;
 
-        Register rhs_reg = rhs->get_register();
-        auto reg_idx = rhs_reg.idx;
-        u64 instr = 0x48f7e8 + (reg_idx >= 8 ? 0x010000 : 0);
-        reg_idx %= 8;
+        // target null for the function's own entry, see link()
+        EmitInstruction(0xe8, 1);
+        m_call_patches.push_back(CallPatch(get_offset(), nullptr));
+        EmitValue(0, 4);
+    }
+
+    void call_indirect(void** slot)
+    {
+        Register scratch = Register(11, RegisterFlag::Temp);
+        mov(scratch, (void*)slot);
 
         if(m_dump_asm)
-            std::cout << "  imul " << reg2str(rhs_reg) << std::endl;
+            std::cout << "  call [" << reg2str(scratch) << "]" << std::endl;
 
-        EmitInstruction(instr+reg_idx, 3);
-        return result;
+        EmitInstruction(0x41ff13, 3);
     }
 
-    Value* idiv(Value* lhs, Value* rhs)
+    void set_arguments(const std::vector<Value*> &args)
     {
-        // no destination passed in, so grab a temp register
-        Value* result = m_storage_alloc.alloc_temp(lhs->value_type);
-        Register src = lhs->get_register();
-        Register dest = result->get_register();
-        mov(dest, src);
+        assert(args.size() <= INT_ARG_REGISTERS && "Stack passed arguments not supported");
+
+        // the argument registers may hold other arguments, so this is a
+        //  parallel move
+        std::vector<std::pair<u16, u16>> moves;
+        for( size_t i = 0; i < args.size(); ++i )
+        {
+            if( !is_immediate(args[i]) && args[i]->get_register().idx != arg_register(i) )
+            {
+                moves.push_back(std::make_pair(arg_register(i), args[i]->get_register().idx));
+            }
+        }
+
+        const u16 scratch = 11;
+        while( !moves.empty() )
+        {
+            // a move whose destination no other move still reads from
+            size_t ready = moves.size();
+            for( size_t i = 0; i < moves.size() && ready == moves.size(); ++i )
+            {
+                bool is_read = false;
+                for( auto &move : moves )
+                {
+                    is_read = is_read || move.second == moves[i].first;
+                }
+                if( !is_read )
+                {
+                    ready = i;
+                }
+            }
+
+            if( ready == moves.size() )
+            {
+                // only cycles are left; park one destination's value in
+                //  the scratch register to break it
+                u16 parked = moves[0].first;
+                mov(Register(scratch, 0), Register(parked, 0));
+                for( auto &move : moves )
+                {
+                    if( move.second == parked )
+                    {
+                        move.second = scratch;
+                    }
+                }
+                ready = 0;
+            }
+
+            mov(Register(moves[ready].first, 0), Register(moves[ready].second, 0));
+            moves.erase(moves.begin() + ready);
+        }
+
+        for( size_t i = 0; i < args.size(); ++i )
+        {
+            if( is_immediate(args[i]) )
+            {
+                mov(Register(arg_register(i), 0), args[i]->get_constant());
+            }
+        }
+    }
+
+    void get_result(Value* dest)
+    {
+        mov(dest->get_register(), Register(0, RegisterFlag::Return));
+    }
+
+    // spill slots are addressed from rsp, which only moves around calls
+    void prologue(const std::vector<Register> &preserved, bool makes_calls,
+                  size_t spill_slots)
+    {
+        m_frame = preserved;
+        m_frame_pushes = preserved.size();
+        m_frame_size = (i32)(spill_slots * 8);
+        // rsp is 8 off 16 byte alignment on entry (return address)
+        if( makes_calls && (m_frame_pushes + spill_slots) % 2 == 0 )
+        {
+            m_frame_size += 8;
+        }
+
+        for( auto reg : m_frame )
+        {
+            push(reg);
+        }
+        if( m_frame_size > 0 )
+        {
+            adjust_stack(-m_frame_size);
+        }
+    }
+
+    void save_registers(const std::vector<Register> &registers)
+    {
+        for( auto reg : registers )
+        {
+            push(reg);
+        }
+        // keep rsp 16 byte aligned for the call
+        if( registers.size() % 2 == 1 )
+        {
+            adjust_stack(-8);
+        }
+    }
+
+    void restore_registers(const std::vector<Register> &registers)
+    {
+        if( registers.size() % 2 == 1 )
+        {
+            adjust_stack(8);
+        }
+        for( auto it = registers.rbegin(); it != registers.rend(); ++it )
+        {
+            pop(*it);
+        }
+    }
+
+    void imul(Value* dest, Value* lhs, Value* rhs)
+    {
+        Register dest_reg = dest->get_register();
+        Register lhs_reg = lhs->get_register();
+        if( is_immediate(rhs) )
+        {
+            i64 imm = rhs->get_constant();
+            if(m_dump_asm)
+                std::cout << "  imul " << reg2str(dest_reg) << ", " << reg2str(lhs_reg)
+                          << ", " << imm << std::endl;
+
+            // three operand form, imm8 or imm32
+            bool short_imm = imm >= INT8_MIN && imm <= INT8_MAX;
+            EmitRex(is_wide(lhs->value_type), dest_reg.idx, lhs_reg.idx);
+            EmitInstruction(short_imm ? 0x6b : 0x69, 1);
+            EmitModRM(dest_reg.idx, lhs_reg.idx);
+            EmitValue(imm, short_imm ? 1 : 4);
+            return;
+        }
+
+        Register rhs_reg = rhs->get_register();
+        mov(dest_reg, lhs_reg);
 
-        // sign extend rax to rdx:rax
-        // TODO: this special case needs to go through storagealloc in
-        //       some way to ensure anything in rdx is spilled out to stack
         if(m_dump_asm)
-            std::cout << "  cqo" << std::endl;
-        EmitInstruction(0x4899, 2);
+            std::cout << "  imul " << reg2str(dest_reg) << ", "
+                      << reg2str(rhs_reg) << std::endl;
+
+        // two operand form, so dest doesn't have to be rax
+        EmitRex(is_wide(lhs->value_type), dest_reg.idx, rhs_reg.idx);
+        EmitInstruction(0x0faf, 2);
+        EmitModRM(dest_reg.idx, rhs_reg.idx);
+    }
 
+    // signed or unsigned division, going by the value type
+    void idiv(Value* dest, Value* lhs, Value* rhs)
+    {
+        // dividend in rdx:rax, which are never allocated
+        Register rax = Register(0, 0);
         Register rhs_reg = rhs->get_register();
-        auto reg_idx = rhs_reg.idx;
-        u64 instr = 0x48f7f8 + (reg_idx >= 8 ? 0x010000 : 0);
-        reg_idx %= 8;
+        bool wide = is_wide(lhs->value_type);
+        bool is_signed_div = is_signed(lhs->value_type);
+        mov(rax, lhs->get_register());
+
+        if( is_signed_div )
+        {
+            // sign extend rax to rdx:rax
+            if(m_dump_asm)
+                std::cout << (wide ? "  cqo" : "  cdq") << std::endl;
+            EmitRex(wide, 0, 0);
+            EmitInstruction(0x99, 1);
+        }
+        else
+        {
+            if(m_dump_asm)
+                std::cout << "  xor rdx, rdx" << std::endl;
+            EmitInstruction(0x31d2, 2);
+        }
 
         if(m_dump_asm)
-            std::cout << "  idiv " << reg2str(rhs_reg) << std::endl;
+            std::cout << (is_signed_div ? "  idiv " : "  div ") << reg2str(rhs_reg) << std::endl;
 
-        EmitInstruction(instr+reg_idx, 3);
-        return result;
+        EmitRex(wide, 0, rhs_reg.idx);
+        EmitInstruction(0xf7, 1);
+        EmitModRM(is_signed_div ? 7 : 6, rhs_reg.idx);
+        mov(dest->get_register(), rax);
     }
 
-    Value* add(Value* lhs, Value* rhs)
+    void add(Value* dest, Value* lhs, Value* rhs)
     {
-        // no destination passed in, so grab a temp register
-        Value* result = m_storage_alloc.alloc_temp(lhs->value_type);
-        Register src = lhs->get_register();
-        Register dest = result->get_register();
-        mov(dest, src);
+        alu(0x01, 0, "add", dest, lhs, rhs);
+    }
+
+    void sub(Value* dest, Value* lhs, Value* rhs)
+    {
+        alu(0x29, 5, "sub", dest, lhs, rhs);
+    }
+
+    void bit_and(Value* dest, Value* lhs, Value* rhs)
+    {
+        alu(0x21, 4, "and", dest, lhs, rhs);
+    }
+
+    void bit_or(Value* dest, Value* lhs, Value* rhs)
+    {
+        alu(0x09, 1, "or", dest, lhs, rhs);
+    }
+
+    void bit_xor(Value* dest, Value* lhs, Value* rhs)
+    {
+        alu(0x31, 6, "xor", dest, lhs, rhs);
+    }
+
+    void bit_not(Value* dest, Value* value)
+    {
+        Register dest_reg = dest->get_register();
+        mov(dest_reg, value->get_register());
+
+        if(m_dump_asm)
+            std::cout << "  not " << reg2str(dest_reg) << std::endl;
+
+        EmitRex(is_wide(value->value_type), 0, dest_reg.idx);
+        EmitInstruction(0xf7, 1);
+        EmitModRM(2, dest_reg.idx);
+    }
 
+    // lhs & ~rhs
+    void andn(Value* dest, Value* lhs, Value* rhs)
+    {
+        Register dest_reg = dest->get_register();
+        Register lhs_reg = lhs->get_register();
         Register rhs_reg = rhs->get_register();
+        bool wide = is_wide(lhs->value_type);
 
-        u64 instr = 0x4801c0 + (dest.idx >= 8 ? 0x010000 : 0)
-                             + (rhs_reg.idx >= 8 ? 0x040000 : 0);
-        u8 dest_offset = dest.idx % 8;
-        u8 rhs_offset = rhs_reg.idx % 8;
+        if( m_cpu_features & CpuFeature::BMI1 )
+        {
+            if(m_dump_asm)
+                std::cout << "  andn " << reg2str(dest_reg) << ", " << reg2str(rhs_reg)
+                          << ", " << reg2str(lhs_reg) << std::endl;
+
+            // dest = ~vvvv & r/m
+            EmitVex(VEX_PP_NONE, wide, dest_reg.idx, rhs_reg.idx, lhs_reg.idx, 0xf2);
+            return;
+        }
+
+        mov(dest_reg, rhs_reg);
 
         if(m_dump_asm)
-            std::cout << "  add " << reg2str(dest) << ", "
-                      << reg2str(rhs_reg) << std::endl;
+        {
+            std::cout << "  not " << reg2str(dest_reg) << std::endl;
+            std::cout << "  and " << reg2str(dest_reg) << ", " << reg2str(lhs_reg) << std::endl;
+        }
 
-        EmitInstruction(instr+dest_offset+rhs_offset*8, 3);
-        return result;
+        EmitRex(wide, 0, dest_reg.idx);
+        EmitInstruction(0xf7, 1);
+        EmitModRM(2, dest_reg.idx);
+        EmitRex(wide, lhs_reg.idx, dest_reg.idx);
+        EmitInstruction(0x21, 1);
+        EmitModRM(lhs_reg.idx, dest_reg.idx);
     }
 
-    Value* sub(Value* lhs, Value* rhs)
+    void shl(Value* dest, Value* lhs, Value* rhs)
     {
-        // no destination passed in, so grab a temp register
-        Value* result = m_storage_alloc.alloc_temp(lhs->value_type);
-        Register src = lhs->get_register();
-        Register dest = result->get_register();
-        mov(dest, src);
+        shift(ShiftKind::Left, dest, lhs, rhs);
+    }
 
-        Register rhs_reg = rhs->get_register();
+    void shr(Value* dest, Value* lhs, Value* rhs)
+    {
+        shift(ShiftKind::Logical, dest, lhs, rhs);
+    }
 
-        u64 instr = 0x4829c0 + (dest.idx >= 8 ? 0x010000 : 0)
-                             + (rhs_reg.idx >= 8 ? 0x040000 : 0);
-        u8 dest_offset = dest.idx % 8;
-        u8 rhs_offset = rhs_reg.idx % 8;
+    void sar(Value* dest, Value* lhs, Value* rhs)
+    {
+        shift(ShiftKind::Arithmetic, dest, lhs, rhs);
+    }
+
+    void popcnt(Value* dest, Value* value)
+    {
+        Register dest_reg = dest->get_register();
+        Register src = value->get_register();
+        bool wide = is_wide(value->value_type);
+
+        if( m_cpu_features & CpuFeature::POPCNT )
+        {
+            if(m_dump_asm)
+                std::cout << "  popcnt " << reg2str(dest_reg) << ", " << reg2str(src) << std::endl;
+
+            EmitInstruction(0xf3, 1);
+            EmitRex(wide, dest_reg.idx, src.idx);
+            EmitInstruction(0x0fb8, 2);
+            EmitModRM(dest_reg.idx, src.idx);
+            return;
+        }
+
+        // shift bits out one at a time, adding up the carries
+        Register scratch = Register(11, RegisterFlag::Temp);
 
         if(m_dump_asm)
-            std::cout << "  sub " << reg2str(dest) << ", "
-                      << reg2str(rhs_reg) << std::endl;
+        {
+            std::cout << "  xor " << reg2str(dest_reg) << ", " << reg2str(dest_reg) << std::endl;
+            std::cout << "  mov " << reg2str(scratch) << ", " << reg2str(src) << std::endl;
+            std::cout << ".popcnt_loop:" << std::endl;
+            std::cout << "  shr " << reg2str(scratch) << ", 1" << std::endl;
+            std::cout << "  adc " << reg2str(dest_reg) << ", 0" << std::endl;
+            std::cout << "  test " << reg2str(scratch) << ", " << reg2str(scratch) << std::endl;
+            std::cout << "  jnz .popcnt_loop" << std::endl;
+        }
 
-        EmitInstruction(instr+dest_offset+rhs_offset*8, 3);
-        return result;
+        EmitRex(false, dest_reg.idx, dest_reg.idx);
+        EmitInstruction(0x31, 1);
+        EmitModRM(dest_reg.idx, dest_reg.idx);
+        // 32 bit mov to zero the upper half for 32 bit values
+        EmitRex(wide, src.idx, scratch.idx);
+        EmitInstruction(0x89, 1);
+        EmitModRM(src.idx, scratch.idx);
+
+        size_t loop_start = get_offset();
+        EmitRex(wide, 0, scratch.idx);
+        EmitInstruction(0xd1, 1);
+        EmitModRM(5, scratch.idx);
+        EmitRex(wide, 0, dest_reg.idx);
+        EmitInstruction(0x83, 1);
+        EmitModRM(2, dest_reg.idx);
+        EmitValue(0, 1);
+        EmitRex(wide, scratch.idx, scratch.idx);
+        EmitInstruction(0x85, 1);
+        EmitModRM(scratch.idx, scratch.idx);
+        EmitInstruction(0x75, 1);
+        EmitValue((u8)(loop_start - (get_offset() + 1)), 1);
     }
 
-    void ret(Value* value)
+    void tzcnt(Value* dest, Value* value)
+    {
+        Register dest_reg = dest->get_register();
+        Register src = value->get_register();
+        bool wide = is_wide(value->value_type);
+
+        if( m_cpu_features & CpuFeature::BMI1 )
+        {
+            if(m_dump_asm)
+                std::cout << "  tzcnt " << reg2str(dest_reg) << ", " << reg2str(src) << std::endl;
+
+            EmitInstruction(0xf3, 1);
+            EmitRex(wide, dest_reg.idx, src.idx);
+            EmitInstruction(0x0fbc, 2);
+            EmitModRM(dest_reg.idx, src.idx);
+            return;
+        }
+
+        // bsf leaves dest undefined for a zero source, which tzcnt defines
+        //  as the operand width
+        if(m_dump_asm)
+        {
+            std::cout << "  bsf " << reg2str(dest_reg) << ", " << reg2str(src) << std::endl;
+            std::cout << "  jnz .tzcnt_done" << std::endl;
+        }
+
+        EmitRex(wide, dest_reg.idx, src.idx);
+        EmitInstruction(0x0fbc, 2);
+        EmitModRM(dest_reg.idx, src.idx);
+        EmitInstruction(0x75, 1);
+        size_t skip = get_offset();
+        EmitValue(0, 1);
+        mov(dest_reg, (i64)bit_width(value->value_type));
+        PatchRel8(skip);
+
+        if(m_dump_asm)
+            std::cout << ".tzcnt_done:" << std::endl;
+    }
+
+    void lzcnt(Value* dest, Value* value)
     {
-        // allocate return register (rax)
-        Value* result = m_storage_alloc.alloc_return(value->value_type);
-        // mov rax, value_register (assuming it lives in register for now)
+        Register dest_reg = dest->get_register();
         Register src = value->get_register();
-        Register dest = result->get_register();
-        mov(dest, src);
+        bool wide = is_wide(value->value_type);
+
+        if( m_cpu_features & CpuFeature::LZCNT )
+        {
+            if(m_dump_asm)
+                std::cout << "  lzcnt " << reg2str(dest_reg) << ", " << reg2str(src) << std::endl;
+
+            EmitInstruction(0xf3, 1);
+            EmitRex(wide, dest_reg.idx, src.idx);
+            EmitInstruction(0x0fbd, 2);
+            EmitModRM(dest_reg.idx, src.idx);
+            return;
+        }
 
+        // lzcnt = (width - 1) - bsr = (width - 1) ^ bsr, or width for zero
+        i32 width = (i32)bit_width(value->value_type);
         if(m_dump_asm)
-            std::cout << "  ret" << std::endl;
+        {
+            std::cout << "  bsr " << reg2str(dest_reg) << ", " << reg2str(src) << std::endl;
+            std::cout << "  jz .lzcnt_zero" << std::endl;
+            std::cout << "  xor " << reg2str(dest_reg) << ", " << width - 1 << std::endl;
+            std::cout << "  jmp .lzcnt_done" << std::endl;
+            std::cout << ".lzcnt_zero:" << std::endl;
+        }
 
-        EmitInstruction(0xc3, 1);
+        EmitRex(wide, dest_reg.idx, src.idx);
+        EmitInstruction(0x0fbd, 2);
+        EmitModRM(dest_reg.idx, src.idx);
+        EmitInstruction(0x74, 1);
+        size_t if_zero = get_offset();
+        EmitValue(0, 1);
+        EmitRex(wide, 0, dest_reg.idx);
+        EmitInstruction(0x83, 1);
+        EmitModRM(6, dest_reg.idx);
+        EmitValue(width - 1, 1);
+        EmitInstruction(0xeb, 1);
+        size_t done = get_offset();
+        EmitValue(0, 1);
+        PatchRel8(if_zero);
+        mov(dest_reg, (i64)width);
+        PatchRel8(done);
+
+        if(m_dump_asm)
+            std::cout << ".lzcnt_done:" << std::endl;
+    }
+
+    void cmp(Condition cond, Value* dest, Value* lhs, Value* rhs)
+    {
+        Register dest_reg = dest->get_register();
+        Register lhs_reg = lhs->get_register();
+        // dest may take over the register of an operand that dies here, and
+        //  then can only be cleared after the compare
+        bool clear_first = dest_reg.idx != lhs_reg.idx &&
+                           (is_immediate(rhs) || dest_reg.idx != rhs->get_register().idx);
+
+        if(m_dump_asm)
+        {
+            if( clear_first )
+                std::cout << "  xor " << reg2str(dest_reg) << ", " << reg2str(dest_reg) << std::endl;
+            std::cout << "  cmp " << reg2str(lhs_reg) << ", "
+                      << operand2str(rhs) << std::endl;
+            std::cout << "  set" << cond2str(cond, lhs->value_type) << " "
+                      << reg2str(dest_reg) << std::endl;
+            if( !clear_first )
+                std::cout << "  movzx " << reg2str(dest_reg) << ", " << reg2str(dest_reg)
+                          << " ; byte" << std::endl;
+        }
+
+        // clear dest up front, as xor clobbers the flags
+        if( clear_first )
+        {
+            EmitRex(false, dest_reg.idx, dest_reg.idx);
+            EmitInstruction(0x31, 1);
+            EmitModRM(dest_reg.idx, dest_reg.idx);
+        }
+
+        if( is_immediate(rhs) )
+        {
+            EmitImmediateOp(7, is_wide(lhs->value_type), lhs_reg.idx, rhs->get_constant());
+        }
+        else
+        {
+            Register rhs_reg = rhs->get_register();
+            EmitRex(is_wide(lhs->value_type), rhs_reg.idx, lhs_reg.idx);
+            EmitInstruction(0x39, 1);
+            EmitModRM(rhs_reg.idx, lhs_reg.idx);
+        }
+
+        // setcc on the low byte. rex needed to address sil/dil rather than dh/bh
+        EmitRex(false, 0, dest_reg.idx, dest_reg.idx >= 4);
+        EmitInstruction(0x0f90 + condition_code(cond, lhs->value_type), 2);
+        EmitModRM(0, dest_reg.idx);
+
+        if( !clear_first )
+        {
+            EmitRex(false, dest_reg.idx, dest_reg.idx, dest_reg.idx >= 4);
+            EmitInstruction(0x0fb6, 2);
+            EmitModRM(dest_reg.idx, dest_reg.idx);
+        }
+    }
+
+    void load(Value* dest, Value* address)
+    {
+        load(dest->get_register(), address->get_register(), 0, dest->value_type);
+    }
+
+    void store(Value* address, Value* value)
+    {
+        Register base = address->get_register();
+        Register src = value->get_register();
+        ValueType type = value->value_type;
+
+        if(m_dump_asm)
+            std::cout << "  mov [" << reg2str(base) << "], " << reg2str(src)
+                      << " ; " << bit_width_name(type) << std::endl;
+
+        if( type == ValueType::u8 || type == ValueType::i8 )
+        {
+            // rex needed to address sil/dil rather than dh/bh
+            EmitRex(false, src.idx, base.idx, src.idx >= 4);
+            EmitInstruction(0x88, 1);
+        }
+        else
+        {
+            if( type == ValueType::u16 || type == ValueType::i16 )
+            {
+                // operand size prefix
+                EmitInstruction(0x66, 1);
+            }
+            EmitRex(is_wide(type), src.idx, base.idx);
+            EmitInstruction(0x89, 1);
+        }
+        EmitModRMIndirect(src.idx, base.idx);
+    }
+
+    // whole registers are stored and reloaded, whatever the value type
+    void spill(Value* dest, Value* value)
+    {
+        Register src = value->get_register();
+        i32 disp = (i32)dest->get_stack_offset();
+
+        if(m_dump_asm)
+            std::cout << "  mov [rsp" << disp2str(disp) << "], " << reg2str(src) << std::endl;
+
+        const u16 rsp = 4;
+        EmitRex(true, src.idx, rsp);
+        EmitInstruction(0x89, 1);
+        EmitModRMIndirect(src.idx, rsp, disp);
+    }
+
+    void reload(Value* dest, Value* value)
+    {
+        const u16 rsp = 4;
+        load(dest->get_register(), Register(rsp, 0), (i32)value->get_stack_offset(),
+             ValueType::u64);
+    }
+
+    void jmp(std::string label)
+    {
+        if(m_dump_asm)
+            std::cout << "  jmp " << label << std::endl;
+
+        // rel32 operand filled in by finalize(), once blocks are laid out
+        EmitInstruction(0xe9, 1);
+        m_jump_patches.push_back(JumpPatch(get_offset(), label));
+        EmitValue(0, 4);
+        EndOfFallthrough();
+    }
+
+    void jz(Value* value, std::string label)
+    {
+        branch_on_zero(value, label, true);
+    }
+
+    void jnz(Value* value, std::string label)
+    {
+        branch_on_zero(value, label, false);
+    }
+
+    // body of a Trampoline: calls `target` with arguments of the types in
+    //  `params` taken from the args[] slots, and stores the return value in
+    //  *result. see TrampolineCache.
+    void trampoline(const std::vector<ValueType> &params, ValueType return_type)
+    {
+        const Register rax = Register(0, RegisterFlag::Return);
+        const Register rbx = Register(3, RegisterFlag::Preserved);
+        // the incoming arguments are moved out of the argument registers
+        const Register target = Register(10, 0);
+        const Register args = Register(11, RegisterFlag::Temp);
+
+        // (register, slot) pairs for the register passed arguments, in the
+        //  order of the SysV integer and vector argument registers. the
+        //  rest go on the stack.
+        std::vector<std::pair<u16, size_t>> int_args;
+        std::vector<std::pair<u16, size_t>> float_args;
+        std::vector<size_t> stack_args;
+        for( size_t i = 0; i < params.size(); ++i )
+        {
+            assert(params[i] != ValueType::none);
+            if( is_float(params[i]) )
+            {
+                if( float_args.size() < FLOAT_ARG_REGISTERS )
+                {
+                    float_args.push_back(std::make_pair((u16)float_args.size(), i));
+                    continue;
+                }
+            }
+            else if( int_args.size() < INT_ARG_REGISTERS )
+            {
+                int_args.push_back(std::make_pair(arg_register(int_args.size()), i));
+                continue;
+            }
+            stack_args.push_back(i);
+        }
+
+        // rbx keeps the result pointer across the call. one push leaves the
+        //  stack 16 byte aligned.
+        prologue(std::vector<Register>(1, rbx), true, 0);
+        mov(rbx, Register(2, 0));
+        mov(target, Register(7, 0));
+        mov(args, Register(6, 0));
+
+        // stack arguments are pushed last to first, each in an 8 byte slot,
+        //  with padding below them to keep rsp aligned at the call
+        i32 stack_size = (i32)((stack_args.size() + stack_args.size() % 2) * 8);
+        if( stack_args.size() % 2 == 1 )
+        {
+            adjust_stack(-8);
+        }
+        for( auto it = stack_args.rbegin(); it != stack_args.rend(); ++it )
+        {
+            ValueType type = is_float(params[*it]) ? ValueType::u64 : params[*it];
+            load(rax, args, (i32)(*it * 8), type);
+            push(rax);
+        }
+        for( auto &arg : float_args )
+        {
+            sse_move(false, params[arg.second], arg.first, args.idx, (i32)(arg.second * 8));
+        }
+        for( auto &arg : int_args )
+        {
+            load(Register(arg.first, 0), args, (i32)(arg.second * 8), params[arg.second]);
+        }
+
+        // al holds the number of vector registers used, for variadic targets
+        mov(rax, (i64)float_args.size());
+        call(target);
+        if( stack_size > 0 )
+        {
+            adjust_stack(stack_size);
+        }
+
+        if( is_float(return_type) )
+        {
+            sse_move(true, return_type, 0, rbx.idx, 0);
+        }
+        else if( return_type != ValueType::none )
+        {
+            // only the low bits of narrow return values are defined
+            extend(rax, return_type);
+
+            if(m_dump_asm)
+                std::cout << "  mov [" << reg2str(rbx) << "], " << reg2str(rax) << std::endl;
+
+            EmitRex(true, rax.idx, rbx.idx);
+            EmitInstruction(0x89, 1);
+            EmitModRMIndirect(rax.idx, rbx.idx);
+        }
+        ret();
+    }
+
+    void count_block(u64* counter)
+    {
+        if(m_dump_asm)
+            std::cout << "  inc qword [" << counter << "] ; block count" << std::endl;
+
+        // flags are never live across a block boundary
+        Register scratch = Register(11, RegisterFlag::Temp);
+        mov(scratch, (void*)counter);
+        EmitInstruction(0x49ff03, 3);
+    }
+
+    void ret(Value* value)
+    {
+        // mov rax, value_register
+        Register rax = Register(0, RegisterFlag::Return);
+        mov(rax, value->get_register());
+        ret();
     }
 
     void ret()
     {
+        if( m_frame_size > 0 )
+        {
+            adjust_stack(m_frame_size);
+        }
+        for( auto it = m_frame.rbegin(); it != m_frame.rend(); ++it )
+        {
+            pop(*it);
+        }
+
         if(m_dump_asm)
             std::cout << "  ret" << std::endl;
 
         EmitInstruction(0xc3, 1);
+        EndOfFallthrough();
     }
 
 private:
+    enum class ShiftKind
+    {
+        Left,
+        Logical,
+        Arithmetic,
+    };
+
+    // SysV integer argument registers: rdi, rsi, rdx, rcx, r8, r9
+    static u16 arg_register(size_t index)
+    {
+        static const u16 registers[] = { 7, 6, 2, 1, 8, 9 };
+        return registers[index];
+    }
+    static const size_t INT_ARG_REGISTERS = 6;
+    // xmm0-xmm7 pass floating point arguments
+    static const size_t FLOAT_ARG_REGISTERS = 8;
+
+    // vex pp field, the implied legacy prefix
+    static const u8 VEX_PP_NONE = 0;
+    static const u8 VEX_PP_66 = 1;
+    static const u8 VEX_PP_F3 = 2;
+    static const u8 VEX_PP_F2 = 3;
+
+    // two operand ALU op (add, sub, and, or, xor):
+    //  mov dest, lhs; op dest, rhs. `extension` selects the op in the
+    //  immediate form.
+    void alu(u8 opcode, u8 extension, std::string name, Value* dest, Value* lhs, Value* rhs)
+    {
+        Register dest_reg = dest->get_register();
+        mov(dest_reg, lhs->get_register());
+
+        if(m_dump_asm)
+            std::cout << "  " << name << " " << reg2str(dest_reg) << ", "
+                      << operand2str(rhs) << std::endl;
+
+        if( is_immediate(rhs) )
+        {
+            EmitImmediateOp(extension, is_wide(lhs->value_type), dest_reg.idx,
+                            rhs->get_constant());
+            return;
+        }
+
+        Register rhs_reg = rhs->get_register();
+        EmitRex(is_wide(lhs->value_type), rhs_reg.idx, dest_reg.idx);
+        EmitInstruction(opcode, 1);
+        EmitModRM(rhs_reg.idx, dest_reg.idx);
+    }
+
+    void shift(ShiftKind kind, Value* dest, Value* lhs, Value* rhs)
+    {
+        static const char* names[] = { "shl", "shr", "sar" };
+        static const u8 extensions[] = { 4, 5, 7 };
+        Register dest_reg = dest->get_register();
+        Register src = lhs->get_register();
+        bool wide = is_wide(lhs->value_type);
+
+        if( is_immediate(rhs) )
+        {
+            mov(dest_reg, src);
+
+            if(m_dump_asm)
+                std::cout << "  " << names[(int)kind] << " " << reg2str(dest_reg)
+                          << ", " << rhs->get_constant() << std::endl;
+
+            EmitRex(wide, 0, dest_reg.idx);
+            EmitInstruction(0xc1, 1);
+            EmitModRM(extensions[(int)kind], dest_reg.idx);
+            EmitValue(rhs->get_constant(), 1);
+            return;
+        }
+
+        Register count = rhs->get_register();
+
+        if( m_cpu_features & CpuFeature::BMI2 )
+        {
+            static const u8 pps[] = { VEX_PP_66, VEX_PP_F2, VEX_PP_F3 };
+            if(m_dump_asm)
+                std::cout << "  " << names[(int)kind] << "x " << reg2str(dest_reg) << ", "
+                          << reg2str(src) << ", " << reg2str(count) << std::endl;
+
+            // three operand, count from any register: dest = r/m shift vvvv
+            EmitVex(pps[(int)kind], wide, dest_reg.idx, count.idx, src.idx, 0xf7);
+            return;
+        }
+
+        // legacy shifts take the count in cl, and rcx may be holding a
+        //  value. shift in the scratch register, borrowing rcx if needed.
+        const u16 rcx = 1;
+        Register scratch = Register(11, RegisterFlag::Temp);
+        mov(scratch, src);
+        if( count.idx != rcx )
+        {
+            xchg(rcx, count.idx);
+        }
+
+        if(m_dump_asm)
+            std::cout << "  " << names[(int)kind] << " " << reg2str(scratch)
+                      << ", cl" << std::endl;
+
+        EmitRex(wide, 0, scratch.idx);
+        EmitInstruction(0xd3, 1);
+        EmitModRM(extensions[(int)kind], scratch.idx);
+
+        if( count.idx != rcx )
+        {
+            xchg(rcx, count.idx);
+        }
+        mov(dest_reg, scratch);
+    }
+
+    // load a `type` sized value from [base + disp], narrow ones movzx/movsx
+    //  into the 32 bit register
+    void load(Register dest, Register base, i32 disp, ValueType type)
+    {
+        if(m_dump_asm)
+            std::cout << "  mov " << reg2str(dest) << ", [" << reg2str(base)
+                      << disp2str(disp) << "] ; " << bit_width_name(type) << std::endl;
+
+        switch( type )
+        {
+            case ValueType::u8:
+            case ValueType::i8:
+            case ValueType::u16:
+            case ValueType::i16:
+            {
+                bool is_byte = type == ValueType::u8 || type == ValueType::i8;
+                u16 opcode = (is_signed(type) ? 0x0fbe : 0x0fb6) + (is_byte ? 0 : 1);
+                EmitRex(false, dest.idx, base.idx);
+                EmitInstruction(opcode, 2);
+                break;
+            }
+            default:
+                EmitRex(is_wide(type), dest.idx, base.idx);
+                EmitInstruction(0x8b, 1);
+                break;
+        }
+        EmitModRMIndirect(dest.idx, base.idx, disp);
+    }
+
+    // sign or zero extend the low `type` bits of reg to 64 bits
+    void extend(Register reg, ValueType type)
+    {
+        if( is_wide(type) )
+        {
+            return;
+        }
+
+        bool is_byte = type == ValueType::u8 || type == ValueType::i8;
+        bool is_dword = type == ValueType::u32 || type == ValueType::i32;
+        if(m_dump_asm)
+            std::cout << "  " << (is_signed(type) ? (is_dword ? "movsxd " : "movsx ") : "movzx ")
+                      << reg2str(reg) << ", " << reg2str(reg) << " ; "
+                      << bit_width_name(type) << std::endl;
+
+        if( is_dword )
+        {
+            // movsxd r64, r/m32, or mov r32, r32 which clears the upper half
+            EmitRex(is_signed(type), reg.idx, reg.idx);
+            EmitInstruction(is_signed(type) ? 0x63 : 0x89, 1);
+        }
+        else
+        {
+            EmitRex(is_signed(type), reg.idx, reg.idx, is_byte && reg.idx >= 4);
+            EmitInstruction((is_signed(type) ? 0x0fbe : 0x0fb6) + (is_byte ? 0 : 1), 2);
+        }
+        EmitModRM(reg.idx, reg.idx);
+    }
+
+    // movss/movsd between xmm<xmm> and [base + disp]
+    void sse_move(bool is_store, ValueType type, u16 xmm, u16 base, i32 disp)
+    {
+        if(m_dump_asm)
+        {
+            std::string mem = "[" + m_reg_names[base] + disp2str(disp) + "]";
+            std::string reg = "xmm" + std::to_string(xmm);
+            std::cout << "  " << (type == ValueType::f32 ? "movss " : "movsd ")
+                      << (is_store ? mem : reg) << ", " << (is_store ? reg : mem) << std::endl;
+        }
+
+        EmitInstruction(type == ValueType::f32 ? 0xf3 : 0xf2, 1);
+        EmitRex(false, xmm, base);
+        EmitInstruction(is_store ? 0x0f11 : 0x0f10, 2);
+        EmitModRMIndirect(xmm, base, disp);
+    }
+
+    void call(Register reg)
+    {
+        if(m_dump_asm)
+            std::cout << "  call " << reg2str(reg) << std::endl;
+
+        EmitRex(false, 0, reg.idx);
+        EmitInstruction(0xff, 1);
+        EmitModRM(2, reg.idx);
+    }
+
+    void xchg(u16 a, u16 b)
+    {
+        if(m_dump_asm)
+            std::cout << "  xchg " << m_reg_names[a] << ", " << m_reg_names[b] << std::endl;
+
+        EmitRex(true, a, b);
+        EmitInstruction(0x87, 1);
+        EmitModRM(a, b);
+    }
+
+    void push(Register reg)
+    {
+        if(m_dump_asm)
+            std::cout << "  push " << reg2str(reg) << std::endl;
+
+        EmitRex(false, 0, reg.idx);
+        EmitInstruction(0x50 + reg.idx % 8, 1);
+    }
+
+    void pop(Register reg)
+    {
+        if(m_dump_asm)
+            std::cout << "  pop " << reg2str(reg) << std::endl;
+
+        EmitRex(false, 0, reg.idx);
+        EmitInstruction(0x58 + reg.idx % 8, 1);
+    }
+
+    // add rsp, amount
+    void adjust_stack(i32 amount)
+    {
+        if(m_dump_asm)
+            std::cout << "  add rsp, " << amount << std::endl;
+
+        const u16 rsp = 4;
+        EmitImmediateOp(0, true, rsp, amount);
+    }
+
+    static u32 bit_width(ValueType type)
+    {
+        return is_wide(type) ? 64 : 32;
+    }
+
+    static bool is_wide(ValueType type)
+    {
+        return type == ValueType::i64 || type == ValueType::u64 ||
+               type == ValueType::pointer;
+    }
+
+    static bool is_signed(ValueType type)
+    {
+        return type == ValueType::i8 || type == ValueType::i16 ||
+               type == ValueType::i32 || type == ValueType::i64;
+    }
+
+    static bool is_float(ValueType type)
+    {
+        return type == ValueType::f32 || type == ValueType::f64;
+    }
+
+    static std::string disp2str(i32 disp)
+    {
+        if( disp == 0 )
+        {
+            return "";
+        }
+        return (disp > 0 ? "+" : "") + std::to_string(disp);
+    }
+
+    // low nibble of the jcc/setcc opcodes
+    static u8 condition_code(Condition cond, ValueType type)
+    {
+        bool is_signed_cmp = is_signed(type);
+        switch( cond )
+        {
+            case Condition::Equal:        return 0x4;
+            case Condition::NotEqual:     return 0x5;
+            case Condition::Less:         return is_signed_cmp ? 0xc : 0x2;
+            case Condition::LessEqual:    return is_signed_cmp ? 0xe : 0x6;
+            case Condition::Greater:      return is_signed_cmp ? 0xf : 0x7;
+            case Condition::GreaterEqual: return is_signed_cmp ? 0xd : 0x3;
+        }
+        return 0;
+    }
+
+    static std::string cond2str(Condition cond, ValueType type)
+    {
+        static const char* names[16] =
+        {
+            "o", "no", "b", "ae", "e", "ne", "be", "a",
+            "s", "ns", "p", "np", "l", "ge", "le", "g",
+        };
+        return names[condition_code(cond, type)];
+    }
+
+    // rex prefix for a reg/rm register pair, skipped when it would be empty
+    //  unless `force` is set
+    void EmitRex(bool wide, u16 reg, u16 rm, bool force = false)
+    {
+        u8 rex = 0x40 | (wide ? 0x08 : 0)
+                      | (reg >= 8 ? 0x04 : 0)
+                      | (rm >= 8 ? 0x01 : 0);
+        if( rex != 0x40 || force )
+        {
+            EmitInstruction(rex, 1);
+        }
+    }
+
+    // register direct modrm
+    void EmitModRM(u16 reg, u16 rm)
+    {
+        EmitInstruction(0xc0 + (reg % 8)*8 + (rm % 8), 1);
+    }
+
+    // constants without a register are encoded as immediates (see
+    //  is_immediate_operand)
+    static bool is_immediate(Value* value)
+    {
+        return value->get_storage_type() != StorageType::Register;
+    }
+
+    std::string operand2str(Value* value)
+    {
+        if( is_immediate(value) )
+        {
+            return std::to_string(value->get_constant());
+        }
+        return reg2str(value->get_register());
+    }
+
+    // 0x81/0x83 group op (add, or, and, sub, xor, cmp) on a register with an
+    //  imm8 or imm32
+    void EmitImmediateOp(u8 extension, bool wide, u16 reg, i64 imm)
+    {
+        bool short_imm = imm >= INT8_MIN && imm <= INT8_MAX;
+        EmitRex(wide, 0, reg);
+        EmitInstruction(short_imm ? 0x83 : 0x81, 1);
+        EmitModRM(extension, reg);
+        EmitValue(imm, short_imm ? 1 : 4);
+    }
+
+    // modrm addressing [base + disp], with the shortest displacement
+    void EmitModRMIndirect(u16 reg, u16 base, i32 disp = 0)
+    {
+        // rbp/r13 can't go without a displacement, use disp8 0
+        size_t disp_size = 0;
+        if( disp != 0 || base % 8 == 5 )
+        {
+            disp_size = (disp >= INT8_MIN && disp <= INT8_MAX) ? 1 : 4;
+        }
+
+        u8 mod = disp_size == 0 ? 0x00 : (disp_size == 1 ? 0x40 : 0x80);
+        EmitInstruction(mod + (reg % 8)*8 + (base % 8), 1);
+        if( base % 8 == 4 )
+        {
+            // rsp/r12 need a sib byte (no index)
+            EmitInstruction(0x24, 1);
+        }
+        if( disp_size > 0 )
+        {
+            EmitValue((u32)disp, disp_size);
+        }
+    }
+
+    static std::string bit_width_name(ValueType type)
+    {
+        switch( type )
+        {
+            case ValueType::u8:
+            case ValueType::i8:  return "byte";
+            case ValueType::u16:
+            case ValueType::i16: return "word";
+            case ValueType::u32:
+            case ValueType::i32: return "dword";
+            default:             return "qword";
+        }
+    }
+
+    // 3 byte vex prefix, 0f38 opcode map, followed by the opcode and a
+    //  register direct modrm
+    void EmitVex(u8 pp, bool wide, u16 reg, u16 vreg, u16 rm, u8 opcode)
+    {
+        u8 byte1 = (reg >= 8 ? 0x00 : 0x80) | 0x40 |
+                   (rm >= 8 ? 0x00 : 0x20) | 0x02;
+        u8 byte2 = (wide ? 0x80 : 0x00) | ((~vreg & 0xf) << 3) | pp;
+        EmitInstruction(0xc4, 1);
+        EmitInstruction(byte1, 1);
+        EmitInstruction(byte2, 1);
+        EmitInstruction(opcode, 1);
+        EmitModRM(reg, rm);
+    }
+
+    void branch_on_zero(Value* value, std::string label, bool if_zero)
+    {
+        Register reg = value->get_register();
+
+        if(m_dump_asm)
+        {
+            std::cout << "  test " << reg2str(reg) << ", " << reg2str(reg) << std::endl;
+            std::cout << "  " << (if_zero ? "jz " : "jnz ") << label << std::endl;
+        }
+
+        EmitRex(is_wide(value->value_type), reg.idx, reg.idx);
+        EmitInstruction(0x85, 1);
+        EmitModRM(reg.idx, reg.idx);
+
+        // rel32 operand filled in by finalize(), once blocks are laid out
+        EmitInstruction(if_zero ? 0x0f84 : 0x0f85, 2);
+        m_jump_patches.push_back(JumpPatch(get_offset(), label));
+        EmitValue(0, 4);
+    }
+
     std::vector<std::string> m_reg_names;
+    // callee saved registers pushed by the prologue
+    std::vector<Register> m_frame;
+    size_t m_frame_pushes;
+    // bytes reserved below the pushes, for spill slots and alignment
+    i32 m_frame_size;
 };
 
 } // namespace jitbox
@@ -0,0 +1,241 @@
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+// sum of `columns` i64 columns, as a batch kernel unrolled `unroll` times,
+//  against the same loop in C++
+static void check_sum(size_t columns, u32 unroll)
+{
+    Module module("batch_kernel");
+    Function* element = module.new_function("sum", ValueType::i64);
+    std::vector<Value*> params;
+    for( size_t c = 0; c < columns; ++c )
+    {
+        params.push_back(element->new_param("c" + std::to_string(c), ValueType::i64));
+    }
+    element->begin_block("entry");
+    Value* sum = params[0];
+    for( size_t c = 1; c < columns; ++c )
+    {
+        sum = element->add(sum, params[c]);
+    }
+    element->end_block_with_return(sum);
+
+    Function* kernel = module.new_batch_kernel("kernel", element, unroll);
+    module.compile();
+
+    // odd row count and begin, so remainder iterations run too
+    const size_t rows = 1003;
+    std::vector<std::vector<i64>> data(columns, std::vector<i64>(rows));
+    std::vector<const void*> pointers;
+    for( size_t c = 0; c < columns; ++c )
+    {
+        for( size_t r = 0; r < rows; ++r )
+        {
+            data[c][r] = (i64)(r * 31 + c * 1000003) * (c % 2 ? -1 : 1);
+        }
+        pointers.push_back(data[c].data());
+    }
+
+    std::vector<i64> output(rows, -1);
+    ((BatchKernel)kernel->get())(pointers.data(), output.data(), 3, rows);
+
+    size_t mismatches = 0;
+    for( size_t r = 0; r < rows; ++r )
+    {
+        i64 expected = -1;
+        if( r >= 3 )
+        {
+            expected = 0;
+            for( size_t c = 0; c < columns; ++c )
+            {
+                expected += data[c][r];
+            }
+        }
+        mismatches += output[r] != expected;
+    }
+    CHECK_EQ(mismatches, 0u);
+}
+
+// ((c0 * c1) - c2) ^ (c3 + c4 + c5), with all six columns live at once
+static void check_mixed(u32 unroll)
+{
+    Module module("batch_kernel");
+    Function* element = module.new_function("mixed", ValueType::i64);
+    std::vector<Value*> c;
+    for( int i = 0; i < 6; ++i )
+    {
+        c.push_back(element->new_param("c" + std::to_string(i), ValueType::i64));
+    }
+    element->begin_block("entry");
+    Value* lhs = element->sub(element->mul(c[0], c[1]), c[2]);
+    Value* rhs = element->add(element->add(c[3], c[4]), c[5]);
+    element->end_block_with_return(element->bit_xor(lhs, rhs));
+
+    Function* kernel = module.new_batch_kernel("kernel", element, unroll);
+    module.compile();
+
+    const size_t rows = 517;
+    std::vector<std::vector<i64>> data(6, std::vector<i64>(rows));
+    std::vector<const void*> pointers;
+    for( size_t i = 0; i < 6; ++i )
+    {
+        for( size_t r = 0; r < rows; ++r )
+        {
+            data[i][r] = (i64)(r * 7919 + i * 104729) - 250000;
+        }
+        pointers.push_back(data[i].data());
+    }
+
+    std::vector<i64> output(rows);
+    ((BatchKernel)kernel->get())(pointers.data(), output.data(), 0, rows);
+
+    size_t mismatches = 0;
+    for( size_t r = 0; r < rows; ++r )
+    {
+        i64 expected = ((data[0][r] * data[1][r]) - data[2][r]) ^
+                       (data[3][r] + data[4][r] + data[5][r]);
+        mismatches += output[r] != expected;
+    }
+    CHECK_EQ(mismatches, 0u);
+}
+
+// odd columns are i32 and return early when below 50, the even i64 ones
+//  are summed up; so the loads are spread over several blocks
+static void check_branches(size_t columns, u32 unroll)
+{
+    Module module("batch_kernel");
+    Function* element = module.new_function("branches", ValueType::i64);
+    std::vector<Value*> params;
+    for( size_t c = 0; c < columns; ++c )
+    {
+        params.push_back(element->new_param("c" + std::to_string(c),
+                                            c % 2 ? ValueType::i32 : ValueType::i64));
+    }
+    element->begin_block("entry");
+    Value* sum = element->new_constant(ValueType::i64, 0);
+    for( size_t c = 0; c < columns; ++c )
+    {
+        if( c % 2 == 0 )
+        {
+            sum = element->add(sum, params[c]);
+            continue;
+        }
+        std::string next = "c" + std::to_string(c) + ".high";
+        element->branch_if_not(element->cmp_lt(params[c], element->new_constant(ValueType::i32, 50)),
+                               next);
+        element->end_block_with_return(element->new_constant(ValueType::i64, -(i64)c));
+        element->begin_block(next);
+    }
+    element->end_block_with_return(sum);
+
+    Function* kernel = module.new_batch_kernel("kernel", element, unroll);
+    module.compile();
+
+    const size_t rows = 1001;
+    std::vector<std::vector<i64>> wide(columns, std::vector<i64>(rows));
+    std::vector<std::vector<i32>> narrow(columns, std::vector<i32>(rows));
+    std::vector<const void*> pointers;
+    for( size_t c = 0; c < columns; ++c )
+    {
+        for( size_t r = 0; r < rows; ++r )
+        {
+            wide[c][r] = (i64)(r * (c + 1)) << 20;
+            narrow[c][r] = (i32)((r * 7 + c) % 100);
+        }
+        pointers.push_back(c % 2 ? (const void*)narrow[c].data() : (const void*)wide[c].data());
+    }
+
+    std::vector<i64> output(rows);
+    ((BatchKernel)kernel->get())(pointers.data(), output.data(), 0, rows);
+
+    size_t mismatches = 0;
+    for( size_t r = 0; r < rows; ++r )
+    {
+        i64 expected = 0;
+        for( size_t c = 0; c < columns; ++c )
+        {
+            if( c % 2 == 0 )
+            {
+                expected += wide[c][r];
+            }
+            else if( narrow[c][r] < 50 )
+            {
+                expected = -(i64)c;
+                break;
+            }
+        }
+        mismatches += output[r] != expected;
+    }
+    CHECK_EQ(mismatches, 0u);
+}
+
+// c0 < 0 ? 0 : c0 * 3 + 1, split into small chunks across runners of
+//  several threads, run after run: every row is done by the time run()
+//  returns, whichever thread ran or stole its chunk. interpreted kernels
+//  are run through Function::run().
+static void check_runner(bool interpret)
+{
+    Module module("batch_kernel");
+    module.set_option(JitOption::INTERPRET, interpret);
+    Function* element = module.new_function("scale", ValueType::i64);
+    Value* x = element->new_param("x", ValueType::i64);
+    element->begin_block("entry");
+    Value* zero = element->new_constant(ValueType::i64, 0);
+    element->branch_if(element->cmp_lt(x, zero), "negative");
+    Value* tripled = element->mul(x, element->new_constant(ValueType::i64, 3));
+    element->end_block_with_return(element->add(tripled, element->new_constant(ValueType::i64, 1)));
+    element->begin_block("negative");
+    element->end_block_with_return(zero);
+    Function* kernel = module.new_batch_kernel("kernel", element, 4);
+    module.compile();
+    CHECK((kernel->get() == nullptr) == interpret);
+
+    const size_t rows = 100003;
+    std::vector<i64> column(rows);
+    for( size_t r = 0; r < rows; ++r )
+    {
+        column[r] = r % 7 == 0 ? -(i64)r : (i64)r;
+    }
+    const void* columns[] = { column.data() };
+
+    for( size_t threads : { 1, 2, 4, 8 } )
+    {
+        BatchRunner runner(threads, 1024);
+        CHECK_EQ(runner.get_thread_count(), threads);
+        for( size_t count : { (size_t)0, (size_t)1, (size_t)64, (size_t)65, rows } )
+        {
+            std::vector<i64> output(rows, -1);
+            runner.run(kernel, columns, output.data(), count, 2 * sizeof(i64));
+
+            size_t mismatches = 0;
+            for( size_t r = 0; r < rows; ++r )
+            {
+                i64 expected = r >= count ? -1 : column[r] < 0 ? 0 : column[r] * 3 + 1;
+                mismatches += output[r] != expected;
+            }
+            CHECK_EQ(mismatches, 0u);
+        }
+    }
+}
+
+int main()
+{
+    for( size_t columns = 1; columns <= 6; ++columns )
+    {
+        for( u32 unroll : { 1, 2, 4, 8 } )
+        {
+            check_sum(columns, unroll);
+            check_branches(columns, unroll);
+        }
+    }
+    for( u32 unroll : { 1, 2, 4, 8 } )
+    {
+        check_mixed(unroll);
+    }
+    check_runner(false);
+    check_runner(true);
+    return test_result("batch_kernel");
+}
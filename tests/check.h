@@ -0,0 +1,32 @@
+#pragma once
+#include <iostream>
+
+// failed checks are reported and counted; tests return the count from main
+static int check_failures = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if( !(cond) ) \
+        { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++check_failures; \
+        } \
+    } while( 0 )
+
+#define CHECK_EQ(a, b) \
+    do \
+    { \
+        if( !((a) == (b)) ) \
+        { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b ") failed: " \
+                      << (a) << " != " << (b) << std::endl; \
+            ++check_failures; \
+        } \
+    } while( 0 )
+
+inline int test_result(const char* name)
+{
+    std::cout << name << ": " << (check_failures ? "FAILED" : "ok") << std::endl;
+    return check_failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+static Function* square(Module &module, std::string name)
+{
+    Function* func = module.new_function(name, ValueType::i32);
+    Value* x = func->new_param("x", ValueType::i32);
+    func->begin_block("entry");
+    func->end_block_with_return(func->mul(x, x));
+    return func;
+}
+
+// code written next to a running function doesn't stop it
+static void check_write_keeps_code_executable()
+{
+    Module module("code_heap");
+    Function* first = square(module, "first");
+    module.compile();
+
+    // the runner keeps calling the newest function, which shares its page
+    //  with the next one written
+    std::atomic<void*> newest(first->get());
+    std::atomic<bool> stop(false);
+    std::atomic<u64> calls(0);
+    std::thread runner([&]()
+    {
+        while( !stop )
+        {
+            calls += ((int(*)(int))newest.load())(7) == 49;
+        }
+    });
+
+    for( int i = 0; i < 2000; ++i )
+    {
+        Function* func = square(module, "f" + std::to_string(i));
+        module.compile(func);
+        CHECK_EQ(((int(*)(int))func->get())(i), i * i);
+        newest = func->get();
+    }
+    stop = true;
+    runner.join();
+    CHECK(calls > 0);
+}
+
+// released code space is reused after a reclaim
+static void check_reuse()
+{
+    Module module("code_heap");
+    void* first = nullptr;
+    for( int i = 0; i < 100; ++i )
+    {
+        Function* func = square(module, "f");
+        module.compile();
+        CHECK_EQ(((int(*)(int))func->get())(i), i * i);
+        if( !first )
+        {
+            first = func->get();
+        }
+        CHECK(func->get() == first);
+        CHECK(module.release_function(func));
+        module.reclaim();
+    }
+}
+
+// chunks are placed in rel32 range of the target where there's room, also
+//  for targets at the bottom and top of user space, and anywhere otherwise
+static void check_near()
+{
+    const size_t CHUNK = 1 << 20;
+    const size_t PAGE = sysconf(_SC_PAGESIZE);
+    void* targets[] =
+    {
+        (void*)&square,
+        (void*)PAGE,
+        (void*)(((size_t)1 << 47) - PAGE),
+    };
+
+    CodeHeap heap;
+    for( void* target : targets )
+    {
+        for( int i = 0; i < 4; ++i )
+        {
+            u8* mem = heap.allocate(CHUNK, 16, target, CodeRegion::Normal);
+            CHECK(mem != nullptr);
+            if( target == (void*)&square )
+            {
+                CHECK(CodeHeap::in_rel32_range(mem, (u8*)target));
+            }
+        }
+    }
+}
+
+int main()
+{
+    check_write_keeps_code_executable();
+    check_reuse();
+    check_near();
+    return test_result("code_heap");
+}
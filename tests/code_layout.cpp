@@ -0,0 +1,120 @@
+#include <set>
+#include <string>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef i32 (*Binary)(i32, i32);
+
+enum class Layout
+{
+    Default,
+    // "equal" and "ge" marked unlikely
+    Unlikely,
+    // block counts from a profiled build
+    Profiled,
+};
+
+// x < y ? x * y : x == y ? x + y : x - y, with the tests in separate blocks
+static Function* select(Module &module, Layout layout)
+{
+    u32 unlikely = layout == Layout::Unlikely ? BlockFlag::Unlikely : 0;
+    Function* func = module.new_function("select", ValueType::i32);
+    Value* x = func->new_param("x", ValueType::i32);
+    Value* y = func->new_param("y", ValueType::i32);
+    func->begin_block("entry");
+    func->branch_if(func->cmp_lt(x, y), "less");
+    func->begin_block("ge", unlikely);
+    func->branch_if(func->cmp_eq(x, y), "equal");
+    func->end_block_with_return(func->sub(x, y));
+    func->begin_block("equal", unlikely | BlockFlag::LoopHeader);
+    func->end_block_with_return(func->add(x, y));
+    func->begin_block("less", BlockFlag::LoopHeader);
+    func->end_block_with_return(func->mul(x, y));
+    return func;
+}
+
+static void check_select(Binary select)
+{
+    CHECK_EQ(select(2, 3), 6);
+    CHECK_EQ(select(5, 3), 2);
+    CHECK_EQ(select(4, 4), 8);
+    CHECK_EQ(select(-7, 2), -14);
+    CHECK_EQ(select(2, -7), 9);
+}
+
+// `cold` blocks lie outside the function's hot code and the rest inside
+//  it, and the loop headers start 32 byte aligned in either section
+static void check_placement(Function* func, const std::set<std::string> &cold)
+{
+    u8* hot = (u8*)func->get();
+    for( const char* block : { "entry", "ge", "equal", "less" } )
+    {
+        u8* address = (u8*)func->get_block_address(block);
+        bool in_hot = address >= hot && address < hot + func->get_code_size();
+        CHECK_EQ(in_hot, cold.count(block) == 0);
+    }
+    for( const char* block : { "equal", "less" } )
+    {
+        CHECK_EQ((size_t)func->get_block_address(block) % 32, (size_t)0);
+    }
+}
+
+// functions start aligned, and blocks moved out of line, by flag or by
+//  profile counts, still run the same
+int main()
+{
+    for( Layout layout : { Layout::Default, Layout::Unlikely } )
+    {
+        Module module("code_layout");
+        module.set_code_alignment(64, 32);
+        Function* func = select(module, layout);
+        module.compile();
+        CHECK_EQ((size_t)func->get() % 64, (size_t)0);
+        check_select((Binary)func->get());
+        if( layout == Layout::Unlikely )
+        {
+            check_placement(func, { "ge", "equal" });
+        }
+        else
+        {
+            check_placement(func, {});
+        }
+    }
+
+    Module profiled("code_layout_profiled");
+    profiled.set_option(JitOption::PROFILE, true);
+    Function* counted = select(profiled, Layout::Default);
+    profiled.compile();
+    check_select((Binary)counted->get());
+    CHECK_EQ(counted->get_block_count("entry"), (u64)5);
+    CHECK_EQ(counted->get_block_count("less"), (u64)2);
+    CHECK_EQ(counted->get_block_count("ge"), (u64)3);
+    CHECK_EQ(counted->get_block_count("equal"), (u64)1);
+
+    Module module("code_layout");
+    module.set_code_alignment(64, 32);
+    Function* func = select(module, Layout::Profiled);
+    for( const char* block : { "entry", "ge", "equal", "less" } )
+    {
+        func->set_block_count(block, counted->get_block_count(block));
+    }
+    module.compile();
+    CHECK_EQ((size_t)func->get() % 64, (size_t)0);
+    check_select((Binary)func->get());
+    // every block ran in at least 1% of the calls
+    check_placement(func, {});
+
+    Module skewed("code_layout_skewed");
+    skewed.set_code_alignment(64, 32);
+    Function* rare = select(skewed, Layout::Profiled);
+    rare->set_block_count("entry", 1000);
+    rare->set_block_count("less", 995);
+    rare->set_block_count("ge", 5);
+    rare->set_block_count("equal", 1);
+    skewed.compile();
+    check_select((Binary)rare->get());
+    check_placement(rare, { "ge", "equal" });
+    return test_result("code_layout");
+}
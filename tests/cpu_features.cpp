@@ -0,0 +1,103 @@
+#include <functional>
+#include <random>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+// The ops with extension encodings (popcnt, tzcnt/lzcnt, andn, shlx/shrx/
+//  sarx), built for the plain x86-64 baseline and with the host's
+//  features, have to agree.
+
+typedef std::function<Value*(Function*, Value*, Value*)> Builder;
+
+static const std::vector<Builder> ops =
+{
+    [](Function* f, Value* a, Value*) { return f->popcount(a); },
+    [](Function* f, Value* a, Value*) { return f->count_trailing_zeros(a); },
+    [](Function* f, Value* a, Value*) { return f->count_leading_zeros(a); },
+    [](Function* f, Value* a, Value* b) { return f->and_not(a, b); },
+    [](Function* f, Value* a, Value* b) { return f->shl(a, b); },
+    [](Function* f, Value* a, Value* b) { return f->shr(a, b); },
+};
+
+static const ValueType types[] =
+{
+    ValueType::i8, ValueType::u8, ValueType::i16, ValueType::u16,
+    ValueType::i32, ValueType::u32, ValueType::i64, ValueType::u64,
+};
+
+// `value` as passed for `type`, extended from the type's width
+static u64 extend(ValueType type, u64 value)
+{
+    switch( type )
+    {
+        case ValueType::i8:  return (u64)(i64)(i8)value;
+        case ValueType::u8:  return (u8)value;
+        case ValueType::i16: return (u64)(i64)(i16)value;
+        case ValueType::u16: return (u16)value;
+        case ValueType::i32: return (u64)(i64)(i32)value;
+        case ValueType::u32: return (u32)value;
+        default:             return value;
+    }
+}
+
+static std::vector<Function*> build(Module &module)
+{
+    std::vector<Function*> functions;
+    for( auto type : types )
+    {
+        for( auto &op : ops )
+        {
+            Function* func = module.new_function("op", type);
+            Value* a = func->new_param("a", type);
+            Value* b = func->new_param("b", type);
+            func->begin_block("entry");
+            func->end_block_with_return(op(func, a, b));
+            functions.push_back(func);
+        }
+    }
+    return functions;
+}
+
+int main()
+{
+    // features the host lacks can't be turned on
+    Module module("cpu_features");
+    module.set_cpu_features(CpuFeature::All);
+    CHECK_EQ(module.get_cpu_features(), detect_cpu_features());
+
+    Module baseline("baseline");
+    baseline.set_cpu_features(CpuFeature::Baseline);
+    Module host("host");
+    std::vector<Function*> baseline_functions = build(baseline);
+    std::vector<Function*> host_functions = build(host);
+    baseline.compile();
+    host.compile();
+
+    std::vector<u64> inputs = { 0, 1, 2, 3, 31, 32, 63, 64, 0x80, 0xff, 0x8000, 0xffff,
+                                0x80000000, 0xffffffff, 0x8000000000000000ull, ~0ull };
+    std::mt19937_64 rng(30);
+    for( int i = 0; i < 48; ++i )
+    {
+        inputs.push_back(rng() >> (rng() % 64));
+    }
+
+    for( size_t f = 0; f < host_functions.size(); ++f )
+    {
+        ValueType type = host_functions[f]->get_return_type();
+        size_t mismatches = 0;
+        for( auto a : inputs )
+        {
+            for( auto b : inputs )
+            {
+                u64 args[] = { extend(type, a), extend(type, b) };
+                mismatches += baseline_functions[f]->run(args) != host_functions[f]->run(args);
+            }
+        }
+        CHECK_EQ(mismatches, 0u);
+    }
+
+    return test_result("cpu_features");
+}
@@ -0,0 +1,201 @@
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef u8 (*Predicate)(u8, u8);
+
+static const u8 inputs[] = { 0, 1, 2, 128, 255 };
+
+// AND/OR on u8 columns, with the rhs lowered branchless and, by wrapping it
+//  in a division that could trap, with a branch around it. both agree with
+//  C++ on any nonzero u8 being true.
+static void check_logical(ExprCompiler &compiler)
+{
+    std::vector<ValueType> row = { ValueType::u8, ValueType::u8 };
+    ExprPtr lhs = Expr::column(0, ValueType::u8);
+    ExprPtr rhs = Expr::column(1, ValueType::u8);
+    ExprPtr trapping_rhs = Expr::div(rhs, Expr::literal(ValueType::u8, 1));
+
+    Predicate and_branchless = (Predicate)compiler.compile(Expr::logical_and(lhs, rhs), row)->get();
+    Predicate and_branchy = (Predicate)compiler.compile(Expr::logical_and(lhs, trapping_rhs), row)->get();
+    Predicate or_branchless = (Predicate)compiler.compile(Expr::logical_or(lhs, rhs), row)->get();
+    Predicate or_branchy = (Predicate)compiler.compile(Expr::logical_or(lhs, trapping_rhs), row)->get();
+    Predicate not_lhs = (Predicate)compiler.compile(Expr::logical_not(lhs), row)->get();
+    // comparisons are booleans already
+    Predicate and_compare = (Predicate)compiler.compile(
+        Expr::logical_and(Expr::gt(lhs, rhs), Expr::logical_not(Expr::eq(rhs, lhs))), row)->get();
+
+    for( u8 a : inputs )
+    {
+        for( u8 b : inputs )
+        {
+            CHECK_EQ((int)and_branchless(a, b), (int)(a && b));
+            CHECK_EQ((int)and_branchy(a, b), (int)(a && b));
+            CHECK_EQ((int)or_branchless(a, b), (int)(a || b));
+            CHECK_EQ((int)or_branchy(a, b), (int)(a || b));
+            CHECK_EQ((int)not_lhs(a, b), (int)!a);
+            CHECK_EQ((int)and_compare(a, b), (int)(a > b && !(b == a)));
+        }
+    }
+}
+
+typedef i64 (*Projection)(i64);
+typedef i32 (*Projection2)(i32, i32);
+
+// CASE WHEN c0 < c1 THEN c1 / c0 WHEN c0 == c1 THEN 0 ELSE c0 * 2 - c1 END
+static ExprPtr case_expr()
+{
+    ExprPtr c0 = Expr::column(0, ValueType::i32);
+    ExprPtr c1 = Expr::column(1, ValueType::i32);
+    return Expr::case_when({ { Expr::lt(c0, c1), Expr::div(c1, c0) },
+                             { Expr::eq(c0, c1), Expr::literal(ValueType::i32, 0) } },
+                           Expr::sub(Expr::mul(c0, Expr::literal(ValueType::i32, 2)), c1));
+}
+
+// structurally equal trees share one compiled function (and batch kernel),
+//  which evaluates them like C++ would
+static void check_cache(ExprCompiler &compiler)
+{
+    std::vector<ValueType> row = { ValueType::i32, ValueType::i32 };
+    size_t size = compiler.size();
+    Function* func = compiler.compile(case_expr(), row);
+    CHECK(compiler.compile(case_expr(), row) == func);
+    CHECK_EQ(compiler.size(), size + 1);
+
+    // the same tree over wider columns is another function
+    std::vector<ValueType> wider_row = { ValueType::i32, ValueType::i32, ValueType::i64 };
+    CHECK(compiler.compile(case_expr(), wider_row) != func);
+    CHECK_EQ(compiler.size(), size + 2);
+
+    for( i32 a : { -7, 1, 3, 5 } )
+    {
+        for( i32 b : { -7, 1, 4, 5 } )
+        {
+            i32 expected = a < b ? b / a : a == b ? 0 : a * 2 - b;
+            CHECK_EQ(((Projection2)func->get())(a, b), expected);
+        }
+    }
+
+    // batch kernels are kept by unroll count, on top of the element function
+    Function* kernel = compiler.compile_batch(case_expr(), row, 2);
+    CHECK(compiler.compile_batch(case_expr(), row, 2) == kernel);
+    CHECK(compiler.compile_batch(case_expr(), row, 4) != kernel);
+    CHECK_EQ(compiler.size(), size + 4);
+
+    std::vector<i32> c0 = { 1, 2, 3, 4, 5 };
+    std::vector<i32> c1 = { 9, 2, 1, 8, -1 };
+    std::vector<i32> output(c0.size());
+    const void* columns[] = { c0.data(), c1.data() };
+    ((BatchKernel)kernel->get())(columns, output.data(), 0, c0.size());
+    for( size_t r = 0; r < c0.size(); ++r )
+    {
+        i32 a = c0[r];
+        i32 b = c1[r];
+        CHECK_EQ(output[r], a < b ? b / a : a == b ? 0 : a * 2 - b);
+    }
+}
+
+// balanced tree of (lhs * 3 + rhs) over two columns, alternating them at
+//  the leaves
+static ExprPtr deep_expr(int depth, size_t lhs, size_t rhs)
+{
+    if( depth == 0 )
+    {
+        return Expr::column(lhs, ValueType::i64);
+    }
+    return Expr::add(Expr::mul(deep_expr(depth - 1, lhs, rhs), Expr::literal(ValueType::i64, 3)),
+                     deep_expr(depth - 1, rhs, lhs));
+}
+
+static i64 deep_value(int depth, i64 lhs, i64 rhs)
+{
+    return depth == 0 ? lhs : deep_value(depth - 1, lhs, rhs) * 3 + deep_value(depth - 1, rhs, lhs);
+}
+
+// trees deep enough to hold more intermediate values than there are
+//  registers still compile, and evaluate like C++
+static void check_deep(ExprCompiler &compiler)
+{
+    std::vector<ValueType> row = { ValueType::i64, ValueType::i64 };
+    const int DEPTH = 12;
+    Function* func = compiler.compile(deep_expr(DEPTH, 0, 1), row);
+    CHECK(func != nullptr);
+    typedef i64 (*Projection2x64)(i64, i64);
+    for( i64 a : { 1, 2, -5 } )
+    {
+        for( i64 b : { 2, 1, 7 } )
+        {
+            CHECK_EQ(((Projection2x64)func->get())(a, b), deep_value(DEPTH, a, b));
+        }
+    }
+
+    Function* kernel = compiler.compile_batch(deep_expr(DEPTH, 0, 1), row);
+    CHECK(kernel != nullptr);
+    std::vector<i64> c0 = { 1, 2, -5 };
+    std::vector<i64> c1 = { 2, 1, 7 };
+    std::vector<i64> output(c0.size());
+    const void* columns[] = { c0.data(), c1.data() };
+    ((BatchKernel)kernel->get())(columns, output.data(), 0, c0.size());
+    for( size_t r = 0; r < c0.size(); ++r )
+    {
+        CHECK_EQ(output[r], deep_value(DEPTH, c0[r], c1[r]));
+    }
+}
+
+// threads compiling col0 * k + k for k below KEYS into a shared compiler,
+//  each key from several threads at once: every key compiles once, to one
+//  function, while the others compile alongside it
+static void check_concurrent()
+{
+    const int THREADS = 8;
+    const int KEYS = 32;
+    Module module("expr_compiler_concurrent");
+    module.set_option(JitOption::THREAD_SAFE, true);
+    ExprCompiler compiler(module);
+    std::vector<ValueType> row = { ValueType::i64 };
+
+    std::vector<std::vector<Function*>> compiled(THREADS, std::vector<Function*>(KEYS));
+    std::vector<std::thread> threads;
+    for( int t = 0; t < THREADS; ++t )
+    {
+        threads.emplace_back([&, t]()
+        {
+            for( int i = 0; i < KEYS; ++i )
+            {
+                int k = (i + t) % KEYS;
+                ExprPtr k_literal = Expr::literal(ValueType::i64, k);
+                ExprPtr expr = Expr::add(Expr::mul(Expr::column(0, ValueType::i64), k_literal),
+                                         k_literal);
+                compiled[t][k] = compiler.compile(expr, row);
+            }
+        });
+    }
+    for( auto &thread : threads )
+    {
+        thread.join();
+    }
+
+    CHECK_EQ(compiler.size(), (size_t)KEYS);
+    for( int k = 0; k < KEYS; ++k )
+    {
+        for( int t = 1; t < THREADS; ++t )
+        {
+            CHECK(compiled[t][k] == compiled[0][k]);
+        }
+        CHECK_EQ(((Projection)compiled[0][k]->get())(3), (i64)(3 * k + k));
+    }
+}
+
+int main()
+{
+    Module module("expr_compiler");
+    ExprCompiler compiler(module);
+    check_logical(compiler);
+    check_cache(compiler);
+    check_deep(compiler);
+    check_concurrent();
+    return test_result("expr_compiler");
+}
@@ -0,0 +1,48 @@
+#include <unistd.h>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+static i64 recorded = 0;
+
+static void record(i64 x)
+{
+    recorded += x;
+}
+
+// calls to native code in the executable and in libc, which are too far
+//  apart for both to be in rel32 range of the generated code, and calls
+//  between generated functions. the far ones go through veneers.
+int main()
+{
+    Module module("far_calls");
+    module.set_inline_limits(0, 0);
+
+    Function* native = module.new_function("native", ValueType::none);
+    native->new_param("x", ValueType::i64);
+    native->begin_block("entry");
+    native->call((void*)&record);
+    native->call((void*)&getpid);
+    native->call((void*)&record);
+    native->end_block_with_return();
+
+    Function* twice = module.new_function("twice", ValueType::i64);
+    Value* x = twice->new_param("x", ValueType::i64);
+    twice->begin_block("entry");
+    twice->end_block_with_return(twice->add(x, x));
+
+    Function* caller = module.new_function("caller", ValueType::i64);
+    Value* y = caller->new_param("y", ValueType::i64);
+    caller->begin_block("entry");
+    caller->end_block_with_return(caller->call(twice, { caller->call(twice, { y }) }));
+    module.compile();
+
+    CHECK(!CodeHeap::in_rel32_range((u8*)native->get(), (u8*)&record) ||
+          !CodeHeap::in_rel32_range((u8*)native->get(), (u8*)&getpid));
+
+    ((void (*)(i64))native->get())(21);
+    CHECK_EQ(recorded, 42);
+    CHECK_EQ(((i64 (*)(i64))caller->get())(5), 20);
+    return test_result("far_calls");
+}
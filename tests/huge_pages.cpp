@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef i32 (*Unary)(i32);
+
+// functions on a code heap backed by huge pages (or regular pages, where the
+//  system has none) run, and hot functions end up packed together, apart
+//  from the others
+int main()
+{
+    const int FUNCTIONS = 200;
+    Module module("huge_pages");
+    module.set_option(JitOption::HUGE_PAGES, true);
+
+    std::vector<Function*> functions;
+    for( int i = 0; i < FUNCTIONS; ++i )
+    {
+        Function* func = module.new_function("f" + std::to_string(i), ValueType::i32);
+        Value* x = func->new_param("x", ValueType::i32);
+        func->set_hot(i % 2 == 0);
+        func->begin_block("entry");
+        func->end_block_with_return(func->add(func->mul(x, x),
+                                              func->new_constant(ValueType::i32, i)));
+        functions.push_back(func);
+    }
+    module.compile();
+
+    u8* hot_begin = (u8*)functions[0]->get();
+    u8* hot_end = hot_begin;
+    for( int i = 0; i < FUNCTIONS; ++i )
+    {
+        CHECK_EQ(((Unary)functions[i]->get())(i), i * i + i);
+        if( i % 2 == 0 )
+        {
+            hot_begin = std::min(hot_begin, (u8*)functions[i]->get());
+            hot_end = std::max(hot_end, (u8*)functions[i]->get());
+        }
+    }
+
+    CHECK(hot_end - hot_begin < 64 * FUNCTIONS);
+    for( int i = 1; i < FUNCTIONS; i += 2 )
+    {
+        u8* code = (u8*)functions[i]->get();
+        CHECK(code < hot_begin || code > hot_end);
+    }
+    return test_result("huge_pages");
+}
@@ -0,0 +1,141 @@
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef i64 (*Unary)(i64);
+typedef i64 (*Binary)(i64, i64);
+
+struct Functions
+{
+    Function* f;
+    Function* g;
+    Function* even;
+    Function* odd;
+};
+
+static Value* constant(Function* func, i64 value)
+{
+    return func->new_constant(ValueType::i64, value);
+}
+
+// f(x, y) = clamp(scale(x, 3), y) + scale(4, 5) + clamp(y, x), calling a
+//  small helper and one with branches that assigns its param,
+//  g(x, y) = sub(y, x), with arguments swapped, and the mutually
+//  recursive even(n) and odd(n)
+static Functions build(Module &module)
+{
+    Function* scale = module.new_function("scale", ValueType::i64);
+    Value* a = scale->new_param("a", ValueType::i64);
+    Value* k = scale->new_param("k", ValueType::i64);
+    scale->begin_block("entry");
+    scale->end_block_with_return(scale->add(scale->mul(a, k), constant(scale, 1)));
+
+    Function* clamp = module.new_function("clamp", ValueType::i64);
+    Value* v = clamp->new_param("v", ValueType::i64);
+    Value* hi = clamp->new_param("hi", ValueType::i64);
+    clamp->begin_block("entry");
+    clamp->branch_if_not(clamp->cmp_gt(v, hi), "done");
+    clamp->assign(v, hi);
+    clamp->begin_block("done");
+    clamp->end_block_with_return(v);
+
+    Functions functions;
+    Function* f = functions.f = module.new_function("f", ValueType::i64);
+    Value* x = f->new_param("x", ValueType::i64);
+    Value* y = f->new_param("y", ValueType::i64);
+    f->begin_block("entry");
+    Value* clamped = f->call(clamp, { f->call(scale, { x, constant(f, 3) }), y });
+    Value* folded = f->call(scale, { constant(f, 4), constant(f, 5) });
+    f->end_block_with_return(f->add(f->add(clamped, folded), f->call(clamp, { y, x })));
+
+    Function* sub = module.new_function("sub", ValueType::i64);
+    Value* p = sub->new_param("p", ValueType::i64);
+    Value* q = sub->new_param("q", ValueType::i64);
+    sub->begin_block("entry");
+    sub->end_block_with_return(sub->sub(p, q));
+
+    Function* g = functions.g = module.new_function("g", ValueType::i64);
+    Value* gx = g->new_param("x", ValueType::i64);
+    Value* gy = g->new_param("y", ValueType::i64);
+    g->begin_block("entry");
+    g->end_block_with_return(g->call(sub, { gy, gx }));
+
+    Function* even = functions.even = module.new_function("even", ValueType::i64);
+    Function* odd = functions.odd = module.new_function("odd", ValueType::i64);
+    Function* pair[] = { even, odd };
+    Value* params[] = { even->new_param("n", ValueType::i64), odd->new_param("n", ValueType::i64) };
+    for( int parity = 0; parity < 2; ++parity )
+    {
+        Function* func = pair[parity];
+        func->begin_block("entry");
+        func->branch_if(func->cmp_eq(params[parity], constant(func, 0)), "base");
+        func->end_block_with_return(func->call(pair[1 - parity],
+                                               { func->sub(params[parity], constant(func, 1)) }));
+        func->begin_block("base");
+        func->end_block_with_return(constant(func, parity == 0));
+    }
+    return functions;
+}
+
+static size_t count(Function* func, Opcode op)
+{
+    size_t count = 0;
+    for( auto &block : func->get_ir().blocks() )
+    {
+        for( auto &instr : block.instructions )
+        {
+            count += instr.op == op;
+        }
+    }
+    return count;
+}
+
+static i64 clamp(i64 v, i64 hi)
+{
+    return v > hi ? hi : v;
+}
+
+// inlined calls, with constant arguments folded into the callee's code, give
+//  the same results as the calls
+int main()
+{
+    for( bool inline_calls : { true, false } )
+    {
+        Module module("inliner");
+        if( !inline_calls )
+        {
+            module.set_inline_limits(0, 0);
+        }
+        Functions functions = build(module);
+        module.compile();
+
+        if( inline_calls )
+        {
+            CHECK_EQ(count(functions.f, Opcode::Call), (size_t)0);
+            CHECK_EQ(count(functions.g, Opcode::Call), (size_t)0);
+            // scale(x, 3) is left with a multiply, scale(4, 5) with none
+            CHECK_EQ(count(functions.f, Opcode::Mul), (size_t)1);
+        }
+        else
+        {
+            CHECK_EQ(count(functions.f, Opcode::Call), (size_t)4);
+        }
+
+        for( i64 x = -5; x < 6; ++x )
+        {
+            for( i64 y = -7; y < 30; y += 3 )
+            {
+                CHECK_EQ(((Binary)functions.f->get())(x, y),
+                         clamp(x * 3 + 1, y) + 21 + clamp(y, x));
+                CHECK_EQ(((Binary)functions.g->get())(x, y), y - x);
+            }
+        }
+        for( i64 n = 0; n < 20; ++n )
+        {
+            CHECK_EQ(((Unary)functions.even->get())(n), (i64)(n % 2 == 0));
+            CHECK_EQ(((Unary)functions.odd->get())(n), (i64)(n % 2 == 1));
+        }
+    }
+    return test_result("inliner");
+}
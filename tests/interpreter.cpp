@@ -0,0 +1,371 @@
+#include <functional>
+#include <random>
+#include <setjmp.h>
+#include <signal.h>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+// Every op of the bytecode, run by the interpreter and as native code on
+//  the same inputs, with the results compared bit for bit.
+
+static const ValueType types[] =
+{
+    ValueType::i8, ValueType::u8, ValueType::i16, ValueType::u16,
+    ValueType::i32, ValueType::u32, ValueType::i64, ValueType::u64,
+};
+
+// `value` cut to `type` and extended back to 64 bits, as values of the
+//  type are passed and returned
+static u64 extend(ValueType type, u64 value)
+{
+    switch( type )
+    {
+        case ValueType::i8:  return (u64)(i64)(i8)value;
+        case ValueType::u8:  return (u8)value;
+        case ValueType::i16: return (u64)(i64)(i16)value;
+        case ValueType::u16: return (u16)value;
+        case ValueType::i32: return (u64)(i64)(i32)value;
+        case ValueType::u32: return (u32)value;
+        default:             return value;
+    }
+}
+
+// a / b traps for b == 0, and for the smallest signed value / -1 in the 32
+//  or 64 bits the division is done in
+static bool division_traps(ValueType type, u64 a, u64 b)
+{
+    if( b == 0 )
+    {
+        return true;
+    }
+    if( type == ValueType::i32 )
+    {
+        return (i32)a == INT32_MIN && (i32)b == -1;
+    }
+    return type == ValueType::i64 && (i64)a == INT64_MIN && (i64)b == -1;
+}
+
+typedef std::function<Value*(Function*, Value*, Value*)> BinaryBuilder;
+typedef std::function<Value*(Function*, Value*)> UnaryBuilder;
+
+struct BinaryOp
+{
+    const char* name;
+    BinaryBuilder build;
+    bool is_division;
+    // returns a u8 rather than the operand type
+    bool is_compare;
+};
+
+static const std::vector<BinaryOp> binary_ops =
+{
+    { "add", [](Function* f, Value* a, Value* b) { return f->add(a, b); }, false, false },
+    { "sub", [](Function* f, Value* a, Value* b) { return f->sub(a, b); }, false, false },
+    { "mul", [](Function* f, Value* a, Value* b) { return f->mul(a, b); }, false, false },
+    { "div", [](Function* f, Value* a, Value* b) { return f->div(a, b); }, true, false },
+    { "and", [](Function* f, Value* a, Value* b) { return f->bit_and(a, b); }, false, false },
+    { "or", [](Function* f, Value* a, Value* b) { return f->bit_or(a, b); }, false, false },
+    { "xor", [](Function* f, Value* a, Value* b) { return f->bit_xor(a, b); }, false, false },
+    { "and_not", [](Function* f, Value* a, Value* b) { return f->and_not(a, b); }, false, false },
+    { "shl", [](Function* f, Value* a, Value* b) { return f->shl(a, b); }, false, false },
+    { "shr", [](Function* f, Value* a, Value* b) { return f->shr(a, b); }, false, false },
+    { "eq", [](Function* f, Value* a, Value* b) { return f->cmp_eq(a, b); }, false, true },
+    { "ne", [](Function* f, Value* a, Value* b) { return f->cmp_ne(a, b); }, false, true },
+    { "lt", [](Function* f, Value* a, Value* b) { return f->cmp_lt(a, b); }, false, true },
+    { "le", [](Function* f, Value* a, Value* b) { return f->cmp_le(a, b); }, false, true },
+    { "gt", [](Function* f, Value* a, Value* b) { return f->cmp_gt(a, b); }, false, true },
+    { "ge", [](Function* f, Value* a, Value* b) { return f->cmp_ge(a, b); }, false, true },
+};
+
+static const std::vector<std::pair<const char*, UnaryBuilder>> unary_ops =
+{
+    { "not", [](Function* f, Value* a) { return f->bit_not(a); } },
+    { "popcount", [](Function* f, Value* a) { return f->popcount(a); } },
+    { "tzcnt", [](Function* f, Value* a) { return f->count_trailing_zeros(a); } },
+    { "lzcnt", [](Function* f, Value* a) { return f->count_leading_zeros(a); } },
+    // loads and stores at the width of the type, and branches on its value
+    { "memory", [](Function* f, Value* a)
+        {
+            Value* slot = f->new_param("slot", ValueType::pointer);
+            f->store(slot, a);
+            return f->load(slot, a->value_type);
+        } },
+    { "branch", [](Function* f, Value* a)
+        {
+            Value* result = f->new_local("result", a->value_type);
+            f->assign(result, f->new_constant(a->value_type, 1));
+            f->branch_if(a, "done");
+            f->assign(result, f->new_constant(a->value_type, 2));
+            f->begin_block("done");
+            return result;
+        } },
+};
+
+// immediates, cut to the type. some only fit in a register.
+static const i64 immediates[] = { 0, 1, 3, -1, 7, 31, 33, 63, 100, -128, 0x7fff, 1 << 20, INT32_MIN };
+
+// the same function built in the native and the interpreted module
+struct Pair
+{
+    std::string name;
+    ValueType type;
+    Function* native;
+    Function* interpreted;
+    bool is_division;
+    bool takes_rhs;
+    u64 imm;
+    bool has_imm;
+};
+
+static Function* build_binary(Module &module, const BinaryOp &op, ValueType type,
+                              bool has_imm, u64 imm)
+{
+    Function* func = module.new_function(op.name, op.is_compare ? ValueType::u8 : type);
+    Value* a = func->new_param("a", type);
+    Value* b = func->new_param("b", type);
+    func->begin_block("entry");
+    Value* rhs = has_imm ? func->new_constant(type, (i64)imm) : b;
+    func->end_block_with_return(op.build(func, a, rhs));
+    return func;
+}
+
+static Function* build_unary(Module &module, const char* name, const UnaryBuilder &build,
+                             ValueType type)
+{
+    Function* func = module.new_function(name, type);
+    Value* a = func->new_param("a", type);
+    func->begin_block("entry");
+    func->end_block_with_return(build(func, a));
+    return func;
+}
+
+static u64 native_mix(u64 a, u64 b, u64 c)
+{
+    return a * 3 + b - c;
+}
+
+// fib (recursive calls), calls to a function passing its arguments on to
+//  native code, and a loop calling fib
+static std::vector<Function*> build_calls(Module &module)
+{
+    Function* fib = module.new_function("fib", ValueType::i64);
+    Value* n = fib->new_param("n", ValueType::i64);
+    fib->begin_block("entry");
+    fib->branch_if(fib->cmp_lt(n, fib->new_constant(ValueType::i64, 2)), "base");
+    Value* one = fib->new_constant(ValueType::i64, 1);
+    Value* two = fib->new_constant(ValueType::i64, 2);
+    fib->end_block_with_return(fib->add(fib->call(fib, fib->sub(n, one)),
+                                        fib->call(fib, fib->sub(n, two))));
+    fib->begin_block("base");
+    fib->end_block_with_return(n);
+
+    // returns the native call's result, left in the return register
+    Function* mix = module.new_function("mix", ValueType::u64);
+    mix->new_param("a", ValueType::u64);
+    mix->new_param("b", ValueType::u64);
+    mix->new_param("c", ValueType::u64);
+    mix->begin_block("entry");
+    mix->call((void*)&native_mix);
+    mix->end_block_with_return();
+
+    Function* mixes = module.new_function("mixes", ValueType::u64);
+    Value* a = mixes->new_param("a", ValueType::u64);
+    Value* b = mixes->new_param("b", ValueType::u64);
+    mixes->begin_block("entry");
+    Value* x = mixes->call(mix, a, b, mixes->new_constant(ValueType::u64, 9));
+    Value* y = mixes->call(mix, b, x, a);
+    mixes->end_block_with_return(mixes->add(x, y));
+
+    Function* loop = module.new_function("loop", ValueType::i64);
+    Value* count = loop->new_param("count", ValueType::i64);
+    loop->begin_block("entry");
+    Value* sum = loop->new_local("sum", ValueType::i64);
+    loop->assign(sum, loop->new_constant(ValueType::i64, 0));
+    Value* i = loop->begin_loop(loop->new_constant(ValueType::i64, 0), count,
+                                loop->new_constant(ValueType::i64, 1), 2);
+        loop->assign(sum, loop->add(sum, loop->mul(i, loop->call(fib, i))));
+    loop->end_loop();
+    loop->end_block_with_return(sum);
+
+    // more sums carried around a loop calling fib than there are registers,
+    //  so some live in spill slots
+    Function* sums = module.new_function("sums", ValueType::i64);
+    Value* rounds = sums->new_param("rounds", ValueType::i64);
+    Value* seed = sums->new_param("seed", ValueType::i64);
+    sums->begin_block("entry");
+    std::vector<Value*> locals;
+    for( i64 k = 0; k < 16; ++k )
+    {
+        locals.push_back(sums->new_local("sum", ValueType::i64));
+        sums->assign(locals[k], sums->mul(seed, sums->new_constant(ValueType::i64, k + 1)));
+    }
+    Value* round = sums->begin_loop(sums->new_constant(ValueType::i64, 0), rounds,
+                                    sums->new_constant(ValueType::i64, 1));
+        for( i64 k = 0; k < 16; ++k )
+        {
+            Value* scaled = sums->mul(locals[k], sums->new_constant(ValueType::i64, k + 3));
+            sums->assign(locals[k], sums->add(scaled, locals[(k + 1) % 16]));
+        }
+        sums->assign(locals[0], sums->add(locals[0], sums->call(fib, round)));
+    sums->end_loop();
+    Value* total = locals[0];
+    for( i64 k = 1; k < 16; ++k )
+    {
+        total = sums->bit_xor(total, locals[k]);
+    }
+    sums->end_block_with_return(total);
+
+    return { fib, mixes, loop, sums };
+}
+
+static void check_calls()
+{
+    for( bool profile : { false, true } )
+    {
+        Module native("native");
+        Module interpreted("interpreted");
+        interpreted.set_option(JitOption::INTERPRET, true);
+        native.set_option(JitOption::PROFILE, profile);
+        interpreted.set_option(JitOption::PROFILE, profile);
+        // real calls, rather than inlined ones
+        native.set_inline_limits(0, 0);
+        interpreted.set_inline_limits(0, 0);
+        std::vector<Function*> native_calls = build_calls(native);
+        std::vector<Function*> interpreted_calls = build_calls(interpreted);
+        native.compile();
+        interpreted.compile();
+
+        for( u64 n = 0; n < 20; ++n )
+        {
+            u64 args[] = { n, n * 1000 + 7 };
+            for( size_t f = 0; f < native_calls.size(); ++f )
+            {
+                CHECK_EQ(native_calls[f]->run(args), interpreted_calls[f]->run(args));
+            }
+        }
+        if( profile )
+        {
+            CHECK_EQ(native_calls[0]->get_call_count(), interpreted_calls[0]->get_call_count());
+            CHECK_EQ(native_calls[0]->get_block_count("base"),
+                     interpreted_calls[0]->get_block_count("base"));
+            CHECK(interpreted_calls[0]->get_call_count() > 0);
+        }
+    }
+}
+
+static sigjmp_buf trap_jump;
+
+static void on_sigfpe(int)
+{
+    siglongjmp(trap_jump, 1);
+}
+
+// runs `func`, returning false if it raised SIGFPE
+static bool run_trapping(Function* func, const u64* args, u64 &result)
+{
+    if( sigsetjmp(trap_jump, 1) )
+    {
+        return false;
+    }
+    result = func->run(args);
+    return true;
+}
+
+int main()
+{
+    Module native("native");
+    Module interpreted("interpreted");
+    interpreted.set_option(JitOption::INTERPRET, true);
+    signal(SIGFPE, on_sigfpe);
+
+    std::vector<Pair> pairs;
+    for( auto type : types )
+    {
+        for( auto &op : binary_ops )
+        {
+            Pair pair = { op.name, type, build_binary(native, op, type, false, 0),
+                          build_binary(interpreted, op, type, false, 0),
+                          op.is_division, true, 0, false };
+            pairs.push_back(pair);
+            for( auto imm : immediates )
+            {
+                u64 value = extend(type, (u64)imm);
+                Pair with_imm = { op.name, type, build_binary(native, op, type, true, value),
+                                  build_binary(interpreted, op, type, true, value),
+                                  op.is_division, false, value, true };
+                pairs.push_back(with_imm);
+            }
+        }
+        for( auto &op : unary_ops )
+        {
+            Pair pair = { op.first, type, build_unary(native, op.first, op.second, type),
+                          build_unary(interpreted, op.first, op.second, type),
+                          false, false, 0, false };
+            pairs.push_back(pair);
+        }
+    }
+    native.compile();
+    interpreted.compile();
+
+    // edge values of every width, then random ones
+    std::vector<u64> inputs = { 0, 1, 2, 3, 7, 8, 31, 32, 63, 64, 0x7f, 0x80, 0xff,
+                                0x7fff, 0x8000, 0xffff, 0x7fffffff, 0x80000000, 0xffffffff,
+                                0x7fffffffffffffffull, 0x8000000000000000ull, ~0ull };
+    for( u64 i = 0; i < 30; ++i )
+    {
+        inputs.push_back((u64)-(i64)inputs[i % 22]);
+    }
+    std::mt19937_64 rng(37);
+    for( int i = 0; i < 40; ++i )
+    {
+        inputs.push_back(rng());
+        inputs.push_back(rng() % 64);
+    }
+
+    size_t traps_seen = 0;
+    for( auto &pair : pairs )
+    {
+        for( auto a_input : inputs )
+        {
+            for( size_t bi = 0; bi < (pair.takes_rhs ? inputs.size() : 1); ++bi )
+            {
+                u64 slot_native = 0;
+                u64 slot_interpreted = 0;
+                u64 a = extend(pair.type, a_input);
+                u64 b = pair.has_imm ? pair.imm : extend(pair.type, inputs[bi]);
+                u64 native_args[] = { a, b, 0 };
+                u64 interpreted_args[] = { a, b, 0 };
+                // the memory op takes its slot in place of b
+                native_args[1] = pair.takes_rhs || pair.has_imm ? b : (u64)&slot_native;
+                interpreted_args[1] = pair.takes_rhs || pair.has_imm ? b : (u64)&slot_interpreted;
+
+                u64 native_result = 0;
+                u64 interpreted_result = 0;
+                bool native_ok = run_trapping(pair.native, native_args, native_result);
+                bool interpreted_ok = run_trapping(pair.interpreted, interpreted_args,
+                                                   interpreted_result);
+                bool traps = pair.is_division && division_traps(pair.type, a, b);
+                traps_seen += traps;
+                if( native_ok != !traps || interpreted_ok != !traps ||
+                    native_result != interpreted_result || slot_native != slot_interpreted )
+                {
+                    std::cout << pair.name << " type " << (int)pair.type << " a " << a
+                              << " b " << b << ": native " << native_result << " ("
+                              << native_ok << "), interpreted " << interpreted_result
+                              << " (" << interpreted_ok << ")" << std::endl;
+                    ++check_failures;
+                }
+            }
+        }
+    }
+
+    // both kinds of division trap came up
+    CHECK(traps_seen > inputs.size());
+
+    check_calls();
+
+    return test_result("interpreter");
+}
@@ -0,0 +1,122 @@
+#include <limits>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+// sum over begin <= i < end, by `step`, of a[i] * 3 (unless b[i] < 0) + i,
+//  with the loop unrolled `unroll` times
+static Function* sum(Module &module, i64 step, u32 unroll)
+{
+    Function* func = module.new_function("sum", ValueType::i64);
+    Value* a = func->new_param("a", ValueType::pointer);
+    Value* b = func->new_param("b", ValueType::pointer);
+    Value* begin = func->new_param("begin", ValueType::i64);
+    Value* end = func->new_param("end", ValueType::i64);
+    func->begin_block("entry");
+    Value* acc = func->new_local("acc", ValueType::i64);
+    func->assign(acc, func->new_constant(ValueType::i64, 0));
+    Value* i = func->begin_loop(begin, end, func->new_constant(ValueType::i64, step), unroll);
+        Value* x = func->load(func->add(a, func->mul(i, func->new_constant(ValueType::i64, 8))),
+                              ValueType::i64);
+        Value* y = func->load(func->add(b, func->mul(i, func->new_constant(ValueType::i64, 4))),
+                              ValueType::i32);
+        func->branch_if(func->cmp_lt(y, func->new_constant(ValueType::i32, 0)), "skip");
+        func->assign(acc, func->add(acc, func->mul(x, func->new_constant(ValueType::i64, 3))));
+        func->begin_block("skip");
+        func->assign(acc, func->add(acc, i));
+    func->end_loop();
+    func->end_block_with_return(acc);
+    return func;
+}
+
+// iterations of begin <= i < end, by `step`, with i of type `type`
+static Function* count(Module &module, ValueType type, i64 step, u32 unroll)
+{
+    Function* func = module.new_function("count", ValueType::i64);
+    Value* begin = func->new_param("begin", type);
+    Value* end = func->new_param("end", type);
+    func->begin_block("entry");
+    Value* n = func->new_local("n", ValueType::i64);
+    func->assign(n, func->new_constant(ValueType::i64, 0));
+    func->begin_loop(begin, end, func->new_constant(type, step), unroll);
+        func->assign(n, func->add(n, func->new_constant(ValueType::i64, 1)));
+    func->end_loop();
+    func->end_block_with_return(n);
+    return func;
+}
+
+// loops ending near the top of their type's range, where i plus the span
+//  of an unrolled iteration overflows, still stop at end
+static void check_top_of_range(bool interpret)
+{
+    for( ValueType type : { ValueType::i32, ValueType::u32, ValueType::i64 } )
+    {
+        i64 top = type == ValueType::i32 ? std::numeric_limits<i32>::max()
+                : type == ValueType::u32 ? std::numeric_limits<u32>::max()
+                : std::numeric_limits<i64>::max();
+        for( u32 unroll : { 2u, 4u, 8u } )
+        {
+            for( i64 step : { 1, 2 } )
+            {
+                Module module("loop");
+                module.set_option(JitOption::INTERPRET, interpret);
+                Function* func = count(module, type, step, unroll);
+                module.compile();
+
+                // the last step stays in range
+                for( i64 end : { top - 2, top - 5, top - 40, top - 50 } )
+                {
+                    i64 begin = top - 45;
+                    i64 expected = end > begin ? (end - begin + step - 1) / step : 0;
+                    u64 args[] = { (u64)begin, (u64)end };
+                    CHECK_EQ((i64)func->run(args), expected);
+                }
+            }
+        }
+    }
+}
+
+// unrolled loops, including their remainder iterations, match the plain
+//  loop for any trip count, compiled and interpreted
+int main()
+{
+    std::vector<i64> a(100);
+    std::vector<i32> b(100);
+    for( int i = 0; i < 100; ++i )
+    {
+        a[i] = i * i - 7;
+        b[i] = i % 5 == 0 ? -1 : i;
+    }
+
+    for( bool interpret : { false, true } )
+    {
+        for( u32 unroll : { 1u, 2u, 3u, 4u, 8u } )
+        {
+            for( i64 step : { 1, 2, 3 } )
+            {
+                Module module("loop");
+                module.set_option(JitOption::INTERPRET, interpret);
+                Function* func = sum(module, step, unroll);
+                module.compile();
+
+                for( i64 begin : { 0, 1, 5 } )
+                {
+                    for( i64 end : { 0, 1, 2, 3, 7, 8, 9, 17, 64, 99 } )
+                    {
+                        i64 expected = 0;
+                        for( i64 i = begin; i < end; i += step )
+                        {
+                            expected += (b[i] < 0 ? 0 : a[i] * 3) + i;
+                        }
+                        u64 args[] = { (u64)a.data(), (u64)b.data(), (u64)begin, (u64)end };
+                        CHECK_EQ((i64)func->run(args), expected);
+                    }
+                }
+            }
+        }
+        check_top_of_range(interpret);
+    }
+    return test_result("loop");
+}
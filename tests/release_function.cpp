@@ -0,0 +1,73 @@
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef i64 (*Unary)(i64);
+
+static Function* unary(Module &module, std::string name, Function* callee, i64 addend)
+{
+    Function* func = module.new_function(name, ValueType::i64);
+    Value* x = func->new_param("x", ValueType::i64);
+    func->begin_block("entry");
+    Value* result = func->add(x, func->new_constant(ValueType::i64, addend));
+    if( callee )
+    {
+        result = func->call(callee, { result });
+    }
+    func->end_block_with_return(result);
+    return func;
+}
+
+// released functions nobody calls any more leave the rest of the module
+//  working, across reclaims and later compiles. functions still called,
+//  and ones the module doesn't own, are refused.
+int main()
+{
+    Module module("release_function");
+    // no inlining, except for functions marked always inline
+    module.set_inline_limits(0, 0);
+
+    Function* leaf = unary(module, "leaf", nullptr, 1);
+    Function* caller = unary(module, "caller", leaf, 10);
+    Function* inlined = unary(module, "inlined", nullptr, 100);
+    inlined->set_always_inline(true);
+    Function* inliner = unary(module, "inliner", inlined, 1000);
+    Function* unused = unary(module, "unused", nullptr, 5);
+    module.compile();
+
+    CHECK_EQ(((Unary)caller->get())(1), 12);
+    CHECK_EQ(((Unary)inliner->get())(1), 1101);
+    CHECK_EQ(((Unary)unused->get())(1), 6);
+
+    // the inliner's copy of `inlined` doesn't call it
+    CHECK(module.release_function(unused));
+    CHECK(module.release_function(inlined));
+    CHECK(!module.release_function(inlined));
+    CHECK(!module.release_function(leaf));
+    module.reclaim();
+
+    // new code goes into the reclaimed space
+    Function* late = unary(module, "late", leaf, 20);
+    Function* late_inliner = unary(module, "late_inliner", nullptr, 30);
+    module.compile();
+
+    CHECK_EQ(((Unary)caller->get())(2), 13);
+    CHECK_EQ(((Unary)inliner->get())(2), 1102);
+    CHECK_EQ(((Unary)late->get())(2), 23);
+    CHECK_EQ(((Unary)late_inliner->get())(2), 32);
+
+    // and callers go before their callees
+    Module other("other");
+    CHECK(!other.release_function(leaf));
+    CHECK(module.release_function(caller));
+    CHECK(!module.release_function(leaf));
+    CHECK(module.release_function(late));
+    CHECK(module.release_function(leaf));
+    module.reclaim();
+    module.compile();
+    CHECK_EQ(((Unary)inliner->get())(3), 1103);
+    CHECK_EQ(((Unary)late_inliner->get())(3), 33);
+
+    return test_result("release_function");
+}
@@ -0,0 +1,96 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef i64 (*Unary)(i64);
+
+// threads building, compiling, calling and releasing functions on one
+//  THREAD_SAFE module at once, calling a shared helper, each other's newest
+//  functions and trampolines
+int main()
+{
+    const int THREADS = 8;
+    const int FUNCTIONS = 300;
+    Module module("thread_safe");
+    module.set_option(JitOption::THREAD_SAFE, true);
+
+    // helper(x) = x + 7
+    Function* helper = module.new_function("helper", ValueType::i64);
+    Value* hx = helper->new_param("x", ValueType::i64);
+    helper->begin_block("entry");
+    helper->end_block_with_return(helper->add(hx, helper->new_constant(ValueType::i64, 7)));
+    module.compile(helper);
+
+    std::atomic<int> failures(0);
+    std::vector<std::atomic<void*>> newest(THREADS);
+    for( auto &func : newest )
+    {
+        func = nullptr;
+    }
+
+    std::vector<std::thread> threads;
+    for( int t = 0; t < THREADS; ++t )
+    {
+        threads.emplace_back([&, t]()
+        {
+            Function* previous = nullptr;
+            for( int n = 0; n < FUNCTIONS; ++n )
+            {
+                // helper of the sum of i * (t + 1) for i < x
+                Function* func = module.new_function("f" + std::to_string(t) + "." +
+                                                     std::to_string(n), ValueType::i64);
+                Value* x = func->new_param("x", ValueType::i64);
+                func->begin_block("entry");
+                Value* sum = func->new_local("sum", ValueType::i64);
+                func->assign(sum, func->new_constant(ValueType::i64, 0));
+                Value* i = func->begin_loop(func->new_constant(ValueType::i64, 0), x,
+                                            func->new_constant(ValueType::i64, 1), 1 + n % 3);
+                    func->assign(sum, func->add(sum, func->mul(i, func->new_constant(ValueType::i64,
+                                                                                      t + 1))));
+                func->end_loop();
+                func->end_block_with_return(func->call(helper, { sum }));
+                module.compile(func);
+
+                failures += ((Unary)func->get())(n) != (i64)(t + 1) * n * (n - 1) / 2 + 7;
+                newest[t] = func->get();
+
+                // nothing calls the previous one, though other threads may
+                //  still run its code, which is only retired
+                if( previous )
+                {
+                    failures += !module.release_function(previous);
+                }
+                previous = func;
+
+                void* other = newest[(t + 1) % THREADS];
+                if( other )
+                {
+                    // (t + 1) * 3 + 7 for the other thread's t
+                    failures += ((Unary)other)(3) % 3 != 7 % 3;
+                }
+
+                if( n % 10 == 0 )
+                {
+                    Trampoline trampoline = module.get_trampoline(
+                        Signature(ValueType::i64, { ValueType::i64 }));
+                    u64 arg = 5;
+                    u64 result = 0;
+                    trampoline(helper->get(), &arg, &result);
+                    failures += result != 12;
+                }
+            }
+        });
+    }
+    for( auto &thread : threads )
+    {
+        thread.join();
+    }
+
+    CHECK_EQ(failures.load(), 0);
+    return test_result("thread_safe");
+}
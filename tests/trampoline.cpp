@@ -0,0 +1,136 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "check.h"
+#include "jitbox.h"
+
+using namespace jitbox;
+
+typedef ValueType V;
+
+static u64 from_double(double value)
+{
+    u64 bits;
+    memcpy(&bits, &value, sizeof(value));
+    return bits;
+}
+
+static u64 from_float(float value)
+{
+    u64 bits = 0;
+    memcpy(&bits, &value, sizeof(value));
+    return bits;
+}
+
+static double to_double(u64 bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static float to_float(u64 bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// more integer arguments than registers, of every width
+static long long integers(long long a, int b, short c, signed char d, unsigned char e,
+                          unsigned short f, long long g, int h, long long i, char j)
+{
+    return a + b * 2 + c * 3 + d * 5 + e * 7 + f * 11 + g * 13 + h * 17 + i * 19 + j * 23;
+}
+
+// more floating point arguments than registers, mixed with integers
+static double mixed(double a, int b, float c, double d, double e, double f, double g,
+                    double h, double i, double j, float k, long long l, double m)
+{
+    return a + b + c * 2 + d * 3 + e * 4 + f * 5 + g * 6 + h * 7 + i * 8 + j * 9 + k * 10 +
+           l * 11 + m * 12;
+}
+
+static signed char negate_i8(int x)
+{
+    return (signed char)-x;
+}
+
+static unsigned short to_u16(int x)
+{
+    return (unsigned short)x;
+}
+
+static unsigned to_u32(int x)
+{
+    return (unsigned)x;
+}
+
+static float halve(float x)
+{
+    return x / 2;
+}
+
+static int void_calls = 0;
+
+static void count_call()
+{
+    ++void_calls;
+}
+
+// C functions called through trampolines get their arguments converted from
+//  u64 slots to the signature's types, in registers and on the stack, and
+//  return values extended back to u64
+int main()
+{
+    Module module("trampoline");
+    u64 result = 0;
+
+    Signature integers_signature(V::i64, { V::i64, V::i32, V::i16, V::i8, V::u8, V::u16,
+                                           V::i64, V::i32, V::i64, V::i8 });
+    Trampoline integers_trampoline = module.get_trampoline(integers_signature);
+    u64 integer_args[] = { 1000, (u64)-2, 0xffff0003, 0x1ff, 0x1ff, 0x10005, 6, 7, 8, (u64)-9 };
+    integers_trampoline((void*)&integers, integer_args, &result);
+    CHECK_EQ((long long)result, integers(1000, -2, 3, -1, 255, 5, 6, 7, 8, -9));
+    // one trampoline per signature
+    CHECK(module.get_trampoline(integers_signature) == integers_trampoline);
+
+    u64 mixed_args[] = { from_double(0.5), (u64)-3, from_float(1.25f), from_double(1),
+                         from_double(2), from_double(3), from_double(4), from_double(5),
+                         from_double(6), from_double(7), from_float(8.5f), 9, from_double(10) };
+    module.get_trampoline(Signature(V::f64, { V::f64, V::i32, V::f32, V::f64, V::f64, V::f64,
+                                              V::f64, V::f64, V::f64, V::f64, V::f32, V::i64,
+                                              V::f64 }))((void*)&mixed, mixed_args, &result);
+    CHECK_EQ(to_double(result), mixed(0.5, -3, 1.25f, 1, 2, 3, 4, 5, 6, 7, 8.5f, 9, 10));
+
+    u64 arg = 5;
+    module.get_trampoline(Signature(V::i8, { V::i32 }))((void*)&negate_i8, &arg, &result);
+    CHECK_EQ((i64)result, -5);
+    arg = 0x12345;
+    module.get_trampoline(Signature(V::u16, { V::i32 }))((void*)&to_u16, &arg, &result);
+    CHECK_EQ(result, 0x2345ull);
+    arg = (u64)-1;
+    module.get_trampoline(Signature(V::u32, { V::i32 }))((void*)&to_u32, &arg, &result);
+    CHECK_EQ(result, 0xffffffffull);
+    arg = from_float(3.0f);
+    module.get_trampoline(Signature(V::f32, { V::f32 }))((void*)&halve, &arg, &result);
+    CHECK_EQ(to_float(result), 1.5f);
+    module.get_trampoline(Signature(V::none, {}))((void*)&count_call, nullptr, nullptr);
+    CHECK_EQ(void_calls, 1);
+
+    // variadic functions get the number of vector registers used
+    char buffer[64];
+    u64 sprintf_args[] = { (u64)buffer, (u64)"%d %.2f %s", 42, from_double(2.5), (u64)"x" };
+    module.get_trampoline(Signature(V::i32, { V::pointer, V::pointer, V::i32, V::f64,
+                                              V::pointer }))((void*)&sprintf, sprintf_args,
+                                                             &result);
+    CHECK_EQ(std::string(buffer), std::string("42 2.50 x"));
+    CHECK_EQ(result, 9ull);
+
+    u64 ldexp_args[] = { from_double(0.75), 3 };
+    module.get_trampoline(Signature(V::f64, { V::f64, V::i32 }))(
+        (void*)(double (*)(double, int))&ldexp, ldexp_args, &result);
+    CHECK_EQ(to_double(result), 6.0);
+    return test_result("trampoline");
+}